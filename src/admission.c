@@ -0,0 +1,190 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#include "admission.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+
+/* Free space is measured at most this often. */
+#define FREE_SPACE_INTERVAL_MS 100
+/* How often a waiting create checks again. */
+#define WAIT_INTERVAL_MS 10
+
+static AdmissionSettings settings;
+static JobQueue* jobqueue = NULL;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool too_many_jobs = false;
+static bool too_many_bytes = false;
+static bool too_little_space = false;
+static long long free_bytes = -1;
+static long long free_bytes_checked_ms = 0;
+
+static int evaluate();
+static void update_free_space(long long now);
+static bool watermark(bool was_over, long long value, long long high, long long low);
+static long long now_ms();
+
+
+void admission_settings_init(AdmissionSettings* s) {
+    s->max_jobs = 0;
+    s->resume_jobs = 0;
+    s->max_bytes = 0;
+    s->resume_bytes = 0;
+    s->min_free_bytes = 0;
+    s->resume_free_bytes = 0;
+    s->wait_ms = 0;
+}
+
+void admission_init(const AdmissionSettings* s, JobQueue* jq) {
+    settings = *s;
+    jobqueue = jq;
+}
+
+int admission_check() {
+    if (!jobqueue) {
+        return 0;
+    }
+
+    long long deadline = now_ms() + settings.wait_ms;
+    while (true) {
+        int ret = evaluate();
+        long long remaining = deadline - now_ms();
+        if (ret == 0 || remaining <= 0) {
+            return ret;
+        }
+        if (remaining > WAIT_INTERVAL_MS) {
+            remaining = WAIT_INTERVAL_MS;
+        }
+        struct timespec ts = { 0, remaining * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+}
+
+void admission_adjust_statvfs(struct statvfs* st) {
+    if (!jobqueue) {
+        return;
+    }
+
+    long jobs;
+    long long bytes;
+    jobqueue_get_backlog(jobqueue, &jobs, &bytes);
+    unsigned long block_size = st->f_frsize ? st->f_frsize : st->f_bsize;
+
+    pthread_mutex_lock(&mutex);
+    bool no_files = too_many_jobs;
+    bool no_space = too_many_bytes || too_little_space;
+    pthread_mutex_unlock(&mutex);
+
+    if (settings.max_jobs > 0) {
+        fsfilcnt_t left = (jobs < settings.max_jobs) ? settings.max_jobs - jobs : 0;
+        if (no_files) {
+            left = 0;
+        }
+        if (st->f_ffree > left) {
+            st->f_ffree = left;
+        }
+        if (st->f_favail > left) {
+            st->f_favail = left;
+        }
+    }
+
+    if (settings.min_free_bytes > 0) {
+        fsblkcnt_t reserved = (settings.min_free_bytes + block_size - 1) / block_size;
+        st->f_bfree = (st->f_bfree > reserved) ? st->f_bfree - reserved : 0;
+        st->f_bavail = (st->f_bavail > reserved) ? st->f_bavail - reserved : 0;
+    }
+    if (settings.max_bytes > 0) {
+        fsblkcnt_t left = (bytes < settings.max_bytes) ? (settings.max_bytes - bytes) / block_size : 0;
+        if (st->f_bavail > left) {
+            st->f_bavail = left;
+        }
+    }
+    if (no_space) {
+        st->f_bavail = 0;
+    }
+}
+
+static int evaluate() {
+    long jobs;
+    long long bytes;
+    jobqueue_get_backlog(jobqueue, &jobs, &bytes);
+
+    pthread_mutex_lock(&mutex);
+    too_many_jobs = watermark(too_many_jobs, jobs, settings.max_jobs, settings.resume_jobs);
+    too_many_bytes = watermark(too_many_bytes, bytes, settings.max_bytes, settings.resume_bytes);
+    if (settings.min_free_bytes > 0) {
+        update_free_space(now_ms());
+        // Free space is the other way around: too little is bad.
+        too_little_space = watermark(too_little_space, -free_bytes,
+                                     -settings.min_free_bytes, -settings.resume_free_bytes);
+    }
+    int ret = 0;
+    if (too_little_space) {
+        ret = -ENOSPC;
+    } else if (too_many_jobs || too_many_bytes) {
+        ret = -EAGAIN;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (ret != 0) {
+        DPRINTF("Not admitting new files: %ld jobs, %lld bytes queued, %lld bytes free",
+                jobs, bytes, free_bytes);
+    }
+    return ret;
+}
+
+static void update_free_space(long long now) {
+    if (free_bytes != -1 && now - free_bytes_checked_ms < FREE_SPACE_INTERVAL_MS) {
+        return;
+    }
+    struct statvfs st;
+    if (statvfs(".", &st) == 0) {
+        unsigned long block_size = st.f_frsize ? st.f_frsize : st.f_bsize;
+        free_bytes = (long long)st.f_bavail * block_size;
+    } else {
+        DPRINTF("statvfs failed: %d", errno);
+    }
+    free_bytes_checked_ms = now;
+}
+
+/*
+ * Whether a value is over the limit, given whether it was last time.
+ * Past the high watermark it stays over until it drops to the low one.
+ */
+static bool watermark(bool was_over, long long value, long long high, long long low) {
+    if (high == 0) {
+        return false;
+    }
+    return was_over ? value > low : value >= high;
+}
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
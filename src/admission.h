@@ -0,0 +1,67 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#ifndef INC_QUEUEFS_ADMISSION_H
+#define INC_QUEUEFS_ADMISSION_H
+
+#include "jobqueue.h"
+
+#include <stdbool.h>
+
+struct statvfs;
+
+/*
+ * Admission control for new files.
+ *
+ * When the backlog of the job queue or the free space of the source
+ * directory crosses a high watermark, creating files fails until it
+ * is back past the low watermark. Each limit is 0 if unused.
+ */
+typedef struct AdmissionSettings {
+    long max_jobs;    /* Jobs added and not yet finished */
+    long resume_jobs;
+    long long max_bytes; /* Size of those jobs' files */
+    long long resume_bytes;
+    long long min_free_bytes; /* Free space in the source directory */
+    long long resume_free_bytes;
+    int wait_ms; /* How long a create may wait to be admitted */
+} AdmissionSettings;
+
+void admission_settings_init(AdmissionSettings* settings);
+
+/* Free space is measured in the current working directory. */
+void admission_init(const AdmissionSettings* settings, JobQueue* jq);
+
+/*
+ * Returns 0 if a new file may be created, or else -EAGAIN if the
+ * backlog is too large or -ENOSPC if free space is too low.
+ * Waits up to wait_ms for that to change.
+ *
+ * This function is thread-safe.
+ */
+int admission_check();
+
+/* Reduces the capacity in a statvfs result to what will be admitted. */
+void admission_adjust_statvfs(struct statvfs* st);
+
+#endif
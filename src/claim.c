@@ -0,0 +1,434 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#include "claim.h"
+#include "hash.h"
+#include "debug.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define CLAIM_SUFFIX ".claim"
+#define ALIVE_SUFFIX ".alive"
+
+static gchar* claim_dir = NULL;
+static gchar* owner = NULL;
+static gchar* alive_path = NULL;
+static long lease_ms;
+static bool recover_own;
+static ClaimTakeoverFunc on_takeover;
+
+static pthread_t scan_thread;
+static pthread_t heartbeat_thread;
+static pthread_mutex_t stop_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static bool stopping;
+
+static void* claim_thread(void* arg);
+static void* heartbeat_loop(void* arg);
+static bool sleep_unless_stopped(long wait_ms); // returns false when stopping
+static void touch_heartbeat();
+static void scan_claims();
+static void restore_claim(const char* tmp_path, const char* tmp_owner, GHashTable* liveness);
+static bool read_claim(const char* path, gchar** claim_owner, gchar** rel_path);
+static bool write_claim(int fd, const char* rel_path);
+static bool owner_alive(const char* claim_owner);
+static bool owner_alive_cached(const char* claim_owner, GHashTable* liveness);
+static bool take_over(const char* path, const char* dead_owner, const char* rel_path);
+static long long now_ms();
+
+
+bool claim_init(const char* dir, const char* mountpoint, long lease_ms_,
+                bool recover_own_, ClaimTakeoverFunc on_takeover_) {
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        return false;
+    }
+
+    char host[256];
+    if (gethostname(host, sizeof(host)) == -1) {
+        strcpy(host, "localhost");
+    }
+    host[sizeof(host) - 1] = '\0';
+    for (char* p = host; *p; ++p) {
+        if (*p == '/') {
+            *p = '_';
+        }
+    }
+
+    claim_dir = g_strdup(dir);
+    owner = g_strdup_printf("%s-%016llx", host,
+                            (unsigned long long)xxh64(mountpoint, strlen(mountpoint), 0));
+    alive_path = g_strdup_printf("%s/%s" ALIVE_SUFFIX, claim_dir, owner);
+    lease_ms = lease_ms_;
+    recover_own = recover_own_;
+    on_takeover = on_takeover_;
+    stopping = false;
+
+    touch_heartbeat();
+    if (pthread_create(&heartbeat_thread, NULL, &heartbeat_loop, NULL) != 0) {
+        g_free(claim_dir);
+        g_free(owner);
+        g_free(alive_path);
+        claim_dir = owner = alive_path = NULL;
+        return false;
+    }
+    if (pthread_create(&scan_thread, NULL, &claim_thread, NULL) != 0) {
+        pthread_mutex_lock(&stop_mutex);
+        stopping = true;
+        pthread_cond_broadcast(&stop_cond);
+        pthread_mutex_unlock(&stop_mutex);
+        pthread_join(heartbeat_thread, NULL);
+        g_free(claim_dir);
+        g_free(owner);
+        g_free(alive_path);
+        claim_dir = owner = alive_path = NULL;
+        return false;
+    }
+    DPRINTF("Claiming jobs in %s as %s", claim_dir, owner);
+    return true;
+}
+
+void claim_shutdown() {
+    if (!claim_dir) {
+        return;
+    }
+    pthread_mutex_lock(&stop_mutex);
+    stopping = true;
+    pthread_cond_broadcast(&stop_cond);
+    pthread_mutex_unlock(&stop_mutex);
+    pthread_join(scan_thread, NULL);
+    pthread_join(heartbeat_thread, NULL);
+
+    g_free(claim_dir);
+    g_free(owner);
+    g_free(alive_path);
+    claim_dir = owner = alive_path = NULL;
+}
+
+bool claim_acquire(const char* rel_path) {
+    gchar* path = claim_file_name(claim_dir, rel_path);
+    bool claimed = false;
+    // Retried if the claim changes hands while we look at it.
+    for (int tries = 0; tries < 3; ++tries) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            if (!write_claim(fd, rel_path)) {
+                DPRINTF("Failed to write claim %s: %d", path, errno);
+            }
+            close(fd);
+            claimed = true;
+            break;
+        }
+        if (errno != EEXIST) {
+            // Running a job twice is better than not running it.
+            DPRINTF("Failed to create claim %s: %d", path, errno);
+            claimed = true;
+            break;
+        }
+
+        gchar* claim_owner;
+        gchar* claim_rel_path;
+        if (!read_claim(path, &claim_owner, &claim_rel_path)) {
+            if (errno == ENOENT) {
+                continue;
+            } else if (errno == ESTALE) {
+                // Its creator died before writing it.
+                claimed = take_over(path, NULL, rel_path);
+                if (claimed) {
+                    break;
+                }
+                continue;
+            }
+            break; // Still being written by whoever just created it
+        }
+        bool retry = false;
+        if (g_str_equal(claim_owner, owner)) {
+            claimed = true;
+        } else if (!owner_alive(claim_owner)) {
+            claimed = take_over(path, claim_owner, rel_path);
+            retry = !claimed;
+        }
+        g_free(claim_owner);
+        g_free(claim_rel_path);
+        if (!retry) {
+            break;
+        }
+    }
+    g_free(path);
+    return claimed;
+}
+
+void claim_release(const char* rel_path) {
+    gchar* path = claim_file_name(claim_dir, rel_path);
+    gchar* claim_owner;
+    gchar* claim_rel_path;
+    if (read_claim(path, &claim_owner, &claim_rel_path)) {
+        if (g_str_equal(claim_owner, owner) && unlink(path) == -1 && errno != ENOENT) {
+            DPRINTF("Failed to delete claim %s: %d", path, errno);
+        }
+        g_free(claim_owner);
+        g_free(claim_rel_path);
+    }
+    g_free(path);
+}
+
+gchar* claim_file_name(const char* dir, const char* rel_path) {
+    HashState hs;
+    char hash[HASH_HEX_LEN + 1];
+    hash_init(&hs);
+    hash_update(&hs, rel_path, strlen(rel_path));
+    hash_final(&hs, hash);
+    return g_strdup_printf("%s/%s" CLAIM_SUFFIX, dir, hash);
+}
+
+static void* claim_thread(void* arg) {
+    (void)arg;
+    do {
+        scan_claims();
+        recover_own = false;
+    } while (sleep_unless_stopped(lease_ms / 3));
+    return NULL;
+}
+
+/* Separate from the scans, which may take longer than a lease in a big claim directory. */
+static void* heartbeat_loop(void* arg) {
+    (void)arg;
+    // Heartbeats come often enough that one can be late or lost.
+    while (sleep_unless_stopped(lease_ms / 3)) {
+        touch_heartbeat();
+    }
+    return NULL;
+}
+
+static bool sleep_unless_stopped(long wait_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait_ms / 1000;
+    deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&stop_mutex);
+    while (!stopping && pthread_cond_timedwait(&stop_cond, &stop_mutex, &deadline) != ETIMEDOUT) {
+    }
+    bool stopped = stopping;
+    pthread_mutex_unlock(&stop_mutex);
+    return !stopped;
+}
+
+static void touch_heartbeat() {
+    int fd = open(alive_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1 || futimens(fd, NULL) == -1) {
+        DPRINTF("Failed to touch %s: %d", alive_path, errno);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/* Takes over the claims of dead owners and cleans up after them. */
+static void scan_claims() {
+    DIR* dir = opendir(claim_dir);
+    if (!dir) {
+        DPRINTF("Failed to open claim directory %s: %d", claim_dir, errno);
+        return;
+    }
+
+    GHashTable* owners_with_claims = g_hash_table_new_full(&g_str_hash, &g_str_equal, &g_free, NULL);
+    // Each owner's heartbeat is looked at once per scan, not once per claim.
+    GHashTable* liveness = g_hash_table_new_full(&g_str_hash, &g_str_equal, &g_free, NULL);
+    GSList* heartbeat_owners = NULL;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        const char* tmp_owner = strstr(name, CLAIM_SUFFIX ".");
+        gchar* path = g_strdup_printf("%s/%s", claim_dir, name);
+        if (g_str_has_suffix(name, CLAIM_SUFFIX)) {
+            gchar* claim_owner;
+            gchar* rel_path;
+            if (read_claim(path, &claim_owner, &rel_path)) {
+                if (g_str_equal(claim_owner, owner)) {
+                    if (recover_own) {
+                        DPRINTF("Recovering own claim on %s", rel_path);
+                        on_takeover(rel_path);
+                    }
+                    g_free(claim_owner);
+                } else if (!owner_alive_cached(claim_owner, liveness) && take_over(path, claim_owner, rel_path)) {
+                    DPRINTF("Took over %s from %s", rel_path, claim_owner);
+                    on_takeover(rel_path);
+                    g_free(claim_owner);
+                } else {
+                    g_hash_table_insert(owners_with_claims, claim_owner, NULL);
+                }
+                g_free(rel_path);
+            }
+        } else if (g_str_has_suffix(name, ALIVE_SUFFIX)) {
+            heartbeat_owners = g_slist_prepend(heartbeat_owners,
+                                               g_strndup(name, strlen(name) - strlen(ALIVE_SUFFIX)));
+        } else if (tmp_owner) {
+            restore_claim(path, tmp_owner + strlen(CLAIM_SUFFIX "."), liveness);
+        }
+        g_free(path);
+    }
+    closedir(dir);
+
+    // Heartbeats of owners that are gone and have nothing left
+    for (GSList* item = heartbeat_owners; item; item = item->next) {
+        const char* heartbeat_owner = item->data;
+        if (!g_str_equal(heartbeat_owner, owner) &&
+                !g_hash_table_lookup_extended(owners_with_claims, heartbeat_owner, NULL, NULL) &&
+                !owner_alive_cached(heartbeat_owner, liveness)) {
+            gchar* path = g_strdup_printf("%s/%s" ALIVE_SUFFIX, claim_dir, heartbeat_owner);
+            unlink(path);
+            g_free(path);
+        }
+        g_free(item->data);
+    }
+    g_slist_free(heartbeat_owners);
+    g_hash_table_destroy(owners_with_claims);
+    g_hash_table_destroy(liveness);
+}
+
+/* Puts back a claim that its taker died with while it was renamed aside. */
+static void restore_claim(const char* tmp_path, const char* tmp_owner, GHashTable* liveness) {
+    bool own = g_str_equal(tmp_owner, owner);
+    if (own ? !recover_own : owner_alive_cached(tmp_owner, liveness)) {
+        return;
+    }
+    gchar* path = g_strndup(tmp_path, strlen(tmp_path) - strlen(tmp_owner) - 1);
+    if (link(tmp_path, path) == 0 || errno == EEXIST) {
+        unlink(tmp_path);
+    }
+    g_free(path);
+}
+
+/*
+ * Claim files contain the owner and the relative path, one per line.
+ * Sets errno to EAGAIN if the claim is still being written,
+ * or to ESTALE if it was left unfinished for longer than the lease.
+ */
+static bool read_claim(const char* path, gchar** claim_owner, gchar** rel_path) {
+    gchar* content;
+    if (!g_file_get_contents(path, &content, NULL, NULL)) {
+        errno = ENOENT;
+        return false;
+    }
+    char* newline = strchr(content, '\n');
+    char* end = newline ? strchr(newline + 1, '\n') : NULL;
+    if (!end) {
+        g_free(content);
+        struct stat st;
+        errno = EAGAIN;
+        if (stat(path, &st) == 0) {
+            long long mtime_ms = (long long)st.st_mtim.tv_sec * 1000 + st.st_mtim.tv_nsec / 1000000;
+            if (now_ms() - mtime_ms >= lease_ms) {
+                errno = ESTALE;
+            }
+        }
+        return false;
+    }
+    *claim_owner = g_strndup(content, newline - content);
+    *rel_path = g_strndup(newline + 1, end - newline - 1);
+    g_free(content);
+    return true;
+}
+
+static bool write_claim(int fd, const char* rel_path) {
+    gchar* content = g_strdup_printf("%s\n%s\n", owner, rel_path);
+    size_t len = strlen(content);
+    bool ok = write(fd, content, len) == (ssize_t)len;
+    g_free(content);
+    return ok;
+}
+
+static bool owner_alive(const char* claim_owner) {
+    gchar* path = g_strdup_printf("%s/%s" ALIVE_SUFFIX, claim_dir, claim_owner);
+    struct stat st;
+    bool alive = false;
+    if (stat(path, &st) == 0) {
+        long long mtime_ms = (long long)st.st_mtim.tv_sec * 1000 + st.st_mtim.tv_nsec / 1000000;
+        alive = now_ms() - mtime_ms < lease_ms;
+    }
+    g_free(path);
+    return alive;
+}
+
+static bool owner_alive_cached(const char* claim_owner, GHashTable* liveness) {
+    gpointer value;
+    if (!g_hash_table_lookup_extended(liveness, claim_owner, NULL, &value)) {
+        value = GINT_TO_POINTER(owner_alive(claim_owner));
+        g_hash_table_insert(liveness, g_strdup(claim_owner), value);
+    }
+    return GPOINTER_TO_INT(value);
+}
+
+/*
+ * Renaming the claim aside succeeds for only one instance. That one
+ * checks that the claim is still the dead owner's, or still stale if
+ * dead_owner is NULL, rewrites it and links it back, which fails if
+ * someone has created a new claim since.
+ */
+static bool take_over(const char* path, const char* dead_owner, const char* rel_path) {
+    gchar* tmp_path = g_strdup_printf("%s.%s", path, owner);
+    bool ok = false;
+    if (rename(path, tmp_path) == 0) {
+        gchar* claim_owner = NULL;
+        gchar* claim_rel_path = NULL;
+        bool unchanged;
+        if (read_claim(tmp_path, &claim_owner, &claim_rel_path)) {
+            unchanged = dead_owner && g_str_equal(claim_owner, dead_owner);
+        } else {
+            unchanged = !dead_owner && errno == ESTALE;
+        }
+        if (unchanged) {
+            int fd = open(tmp_path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+            ok = fd != -1 && write_claim(fd, rel_path);
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+        g_free(claim_owner);
+        g_free(claim_rel_path);
+        // Someone else's claim goes back as it was.
+        if (link(tmp_path, path) == -1) {
+            ok = false;
+        }
+        unlink(tmp_path);
+    }
+    g_free(tmp_path);
+    return ok;
+}
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
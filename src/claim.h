@@ -0,0 +1,89 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#ifndef INC_QUEUEFS_CLAIM_H
+#define INC_QUEUEFS_CLAIM_H
+
+#include <stdbool.h>
+
+#include <glib.h>
+
+/*
+ * Claims on jobs, for several instances working on one source directory,
+ * possibly on different hosts sharing a file system.
+ *
+ * A claim is a file in a shared claim directory, named after a hash of
+ * the job's path relative to the source directory. It's created with
+ * O_EXCL before the job is queued and deleted when the job succeeds,
+ * so only one instance ever queues a file at a time.
+ *
+ * Each instance has an owner ID, written into its claims, and touches
+ * <owner>.alive in the claim directory regularly. Claims of an owner
+ * whose heartbeat is older than the lease are taken over by renaming
+ * the claim aside, which only one instance can do, and linking it back.
+ * So are claims left empty or partly written for longer than the lease
+ * by an instance that died while creating them.
+ * The owner ID is derived from the host name and mountpoint, so an
+ * instance restarted after a crash gets its own old claims back, and
+ * one that took over by handoff (see handoff.h) keeps them.
+ */
+
+/*
+ * Called from the claim thread with the relative path of a job
+ * whose claim was just taken over.
+ */
+typedef void (*ClaimTakeoverFunc)(const char* rel_path);
+
+/*
+ * Starts heartbeats and takeovers. If recover_own is set, claims that
+ * already belong to this owner are handed to on_takeover too, as they
+ * were left behind by a previous run. Returns false on error.
+ */
+bool claim_init(const char* dir, const char* mountpoint, long lease_ms,
+                bool recover_own, ClaimTakeoverFunc on_takeover);
+
+/*
+ * Stops the claim thread. Claims and the heartbeat file are left for
+ * an instance that takes over by handoff or the next run to pick up.
+ */
+void claim_shutdown();
+
+/*
+ * Claims a job. Returns false if another live instance has claimed it.
+ *
+ * This function is thread-safe.
+ */
+bool claim_acquire(const char* rel_path);
+
+/*
+ * Gives up a claim of ours on a job that won't be run, e.g. because
+ * its file was deleted. Claims of other instances are left alone.
+ *
+ * This function is thread-safe.
+ */
+void claim_release(const char* rel_path);
+
+/* The claim file of a job. The result must be freed with g_free(). */
+gchar* claim_file_name(const char* dir, const char* rel_path);
+
+#endif
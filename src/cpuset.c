@@ -0,0 +1,230 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#include <config.h>
+
+#include "cpuset.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#include <glib.h>
+
+#ifndef CPU_SETSIZE
+#define CPU_SETSIZE 1024
+#endif
+
+struct CpuSet {
+    int count;
+    int* cpus; // Ascending
+};
+
+static CpuSet* make_set(const bool* present); // CPU_SETSIZE flags, NULL if none is set
+static CpuSet* read_sys_list(const char* path);
+
+
+CpuSet* cpuset_parse(const char* list) {
+    bool present[CPU_SETSIZE] = { false };
+    gchar** parts = g_strsplit(list, ",", 0);
+    bool ok = true;
+    for (gchar** part = parts; *part && ok; ++part) {
+        const char* p = g_strstrip(*part);
+        if (*p == '\0') {
+            continue;
+        }
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end != p && *end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+        }
+        if (end == p || *end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+            ok = false;
+            break;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            present[cpu] = true;
+        }
+    }
+    g_strfreev(parts);
+    return ok ? make_set(present) : NULL;
+}
+
+CpuSet* cpuset_current() {
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == -1) {
+        DPRINTF("sched_getaffinity failed: %d", errno);
+        return NULL;
+    }
+    bool present[CPU_SETSIZE];
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        present[cpu] = CPU_ISSET(cpu, &mask);
+    }
+    return make_set(present);
+#else
+    return NULL;
+#endif
+}
+
+CpuSet* cpuset_on_node(const CpuSet* set, int node) {
+    gchar* path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    CpuSet* node_set = read_sys_list(path);
+    g_free(path);
+    if (!node_set) {
+        return NULL;
+    }
+
+    bool on_node[CPU_SETSIZE] = { false };
+    for (int i = 0; i < node_set->count; ++i) {
+        on_node[node_set->cpus[i]] = true;
+    }
+    cpuset_free(node_set);
+    bool present[CPU_SETSIZE] = { false };
+    for (int i = 0; i < set->count; ++i) {
+        present[set->cpus[i]] = on_node[set->cpus[i]];
+    }
+    return make_set(present);
+}
+
+CpuSet* cpuset_single(const CpuSet* set, int index) {
+    CpuSet* single = g_malloc(sizeof(CpuSet));
+    single->count = 1;
+    single->cpus = g_malloc(sizeof(int));
+    single->cpus[0] = set->cpus[index];
+    return single;
+}
+
+void cpuset_free(CpuSet* set) {
+    if (set) {
+        g_free(set->cpus);
+        g_free(set);
+    }
+}
+
+int cpuset_count(const CpuSet* set) {
+    return set->count;
+}
+
+int cpuset_max_node() {
+    CpuSet* nodes = read_sys_list("/sys/devices/system/node/online");
+    if (!nodes) {
+        return -1;
+    }
+    int max = nodes->cpus[nodes->count - 1];
+    cpuset_free(nodes);
+    return max;
+}
+
+int cpuset_current_node() {
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1) {
+        return -1;
+    }
+    return node;
+#else
+    return -1;
+#endif
+}
+
+bool cpuset_pin_thread(const CpuSet* set) {
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int i = 0; i < set->count; ++i) {
+        CPU_SET(set->cpus[i], &mask);
+    }
+    return sched_setaffinity(0, sizeof(mask), &mask) == 0;
+#else
+    (void)set;
+    return true;
+#endif
+}
+
+bool cpuset_pin_process(const CpuSet* set) {
+#if defined(HAVE_SCHED_SETAFFINITY) && defined(__linux__)
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int i = 0; i < set->count; ++i) {
+        CPU_SET(set->cpus[i], &mask);
+    }
+    DIR* dir = opendir("/proc/self/task");
+    if (!dir) {
+        return cpuset_pin_thread(set);
+    }
+    bool ok = true;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        pid_t tid = atoi(entry->d_name);
+        if (sched_setaffinity(tid, sizeof(mask), &mask) == -1 && errno != ESRCH) {
+            DPRINTF("Failed to pin thread %d: %d", (int)tid, errno);
+            ok = false;
+        }
+    }
+    closedir(dir);
+    return ok;
+#else
+    return cpuset_pin_thread(set);
+#endif
+}
+
+static CpuSet* make_set(const bool* present) {
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        count += present[cpu];
+    }
+    if (count == 0) {
+        return NULL;
+    }
+    CpuSet* set = g_malloc(sizeof(CpuSet));
+    set->count = 0;
+    set->cpus = g_malloc(count * sizeof(int));
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (present[cpu]) {
+            set->cpus[set->count++] = cpu;
+        }
+    }
+    return set;
+}
+
+static CpuSet* read_sys_list(const char* path) {
+    gchar* contents;
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return NULL;
+    }
+    CpuSet* set = cpuset_parse(g_strstrip(contents));
+    g_free(contents);
+    return set;
+}
@@ -0,0 +1,74 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#ifndef INC_QUEUEFS_CPUSET_H
+#define INC_QUEUEFS_CPUSET_H
+
+#include <stdbool.h>
+
+/*
+ * Sets of CPUs to pin processes to, written like "0-3,8" as in
+ * taskset(1) and /sys/devices/system/cpu/online.
+ *
+ * NUMA nodes are read from /sys/devices/system/node.
+ * Pinning does nothing where sched_setaffinity() is not available.
+ */
+
+struct CpuSet;
+typedef struct CpuSet CpuSet;
+
+/* Returns NULL if the list is malformed or empty. */
+CpuSet* cpuset_parse(const char* list);
+
+/* The CPUs the calling thread may run on, or NULL if unknown. */
+CpuSet* cpuset_current();
+
+/* The CPUs of a NUMA node that are also in set, or NULL if there are none. */
+CpuSet* cpuset_on_node(const CpuSet* set, int node);
+
+/* The CPU at index of set, in ascending order, as a set of its own. */
+CpuSet* cpuset_single(const CpuSet* set, int index);
+
+void cpuset_free(CpuSet* set);
+
+int cpuset_count(const CpuSet* set);
+
+/* The highest NUMA node number, or -1 if there is no NUMA information. */
+int cpuset_max_node();
+
+/*
+ * The NUMA node the calling thread is running on, or -1 if unknown.
+ * Cheap enough to call per request.
+ */
+int cpuset_current_node();
+
+/*
+ * Pins the calling thread to set. After fork(), this is the whole process.
+ * Doesn't allocate, so it may be used between fork() and exec().
+ */
+bool cpuset_pin_thread(const CpuSet* set);
+
+/* Pins all threads of the calling process to set. Threads started later inherit it. */
+bool cpuset_pin_process(const CpuSet* set);
+
+#endif
@@ -0,0 +1,124 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#include "dedup.h"
+#include "hash.h"
+#include "debug.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int index_fd = -1;
+static off_t index_read_upto = 0;
+static GHashTable* hashes = NULL;
+
+static void read_new_entries();
+
+
+bool dedup_init(const char* index_file) {
+    index_fd = open(index_file, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (index_fd == -1) {
+        return false;
+    }
+    hashes = g_hash_table_new_full(&g_str_hash, &g_str_equal, &g_free, NULL);
+    index_read_upto = 0;
+    read_new_entries();
+    DPRINTF("Loaded %u hashes from %s", g_hash_table_size(hashes), index_file);
+    return true;
+}
+
+void dedup_shutdown() {
+    if (index_fd != -1) {
+        close(index_fd);
+        index_fd = -1;
+    }
+    if (hashes) {
+        g_hash_table_destroy(hashes);
+        hashes = NULL;
+    }
+}
+
+bool dedup_seen(const char* hash) {
+    pthread_mutex_lock(&mutex);
+    bool seen = false;
+    if (hashes) {
+        seen = g_hash_table_lookup_extended(hashes, hash, NULL, NULL);
+        if (!seen) {
+            read_new_entries();
+            seen = g_hash_table_lookup_extended(hashes, hash, NULL, NULL);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    return seen;
+}
+
+int dedup_open_for_append(const char* index_file) {
+    return open(index_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+void dedup_record(int fd, const char* hash) {
+    // One small O_APPEND write, so lines from different shards don't interleave.
+    char line[HASH_HEX_LEN + 1];
+    memcpy(line, hash, HASH_HEX_LEN);
+    line[HASH_HEX_LEN] = '\n';
+    if (write(fd, line, sizeof(line)) != (ssize_t)sizeof(line)) {
+        DPRINTF("Failed to write dedup index: %d", errno);
+    }
+}
+
+/* Must be called with the mutex held. */
+static void read_new_entries() {
+    struct stat st;
+    if (fstat(index_fd, &st) == -1 || st.st_size <= index_read_upto) {
+        return;
+    }
+
+    size_t len = st.st_size - index_read_upto;
+    char* buf = g_malloc(len);
+    ssize_t ret = pread(index_fd, buf, len, index_read_upto);
+    if (ret <= 0) {
+        DPRINTF("Failed to read dedup index: %d", errno);
+        g_free(buf);
+        return;
+    }
+
+    // Only whole lines are consumed; a partial one is read again next time.
+    char* line = buf;
+    char* end = buf + ret;
+    char* newline;
+    while ((newline = memchr(line, '\n', end - line)) != NULL) {
+        if (newline - line == HASH_HEX_LEN) {
+            g_hash_table_insert(hashes, g_strndup(line, HASH_HEX_LEN), NULL);
+        }
+        line = newline + 1;
+    }
+    index_read_upto += line - buf;
+    g_free(buf);
+}
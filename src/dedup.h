@@ -0,0 +1,54 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#ifndef INC_QUEUEFS_DEDUP_H
+#define INC_QUEUEFS_DEDUP_H
+
+#include <stdbool.h>
+
+/*
+ * A persistent index of the content hashes of files whose jobs
+ * have succeeded. The index file has one hex hash per line and is
+ * only ever appended to, by the job queue processes, so entries
+ * added while queuefs runs are picked up as the file grows.
+ */
+
+/* Opens or creates the index and loads it. Returns false on error. */
+bool dedup_init(const char* index_file);
+
+void dedup_shutdown();
+
+/*
+ * Whether a job with content hash (see hash.h) has already succeeded.
+ *
+ * This function is thread-safe.
+ */
+bool dedup_seen(const char* hash);
+
+/* Opens the index for dedup_record(). Returns -1 on error. */
+int dedup_open_for_append(const char* index_file);
+
+/* Appends a hash to an index opened with dedup_open_for_append(). */
+void dedup_record(int fd, const char* hash);
+
+#endif
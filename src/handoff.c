@@ -0,0 +1,327 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#include <config.h>
+
+#include "handoff.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/mount.h>
+#endif
+
+#define HANDOFF_GREETING "QUEUEFS-HANDOFF"
+#define HANDOFF_MOUNTED "MOUNTED"
+#define HANDOFF_MSG_SIZE (64 + JOBQUEUE_MAX_SHARDS * 12)
+#define HANDOFF_MAX_FDS (1 + 2 * JOBQUEUE_MAX_SHARDS)
+
+typedef struct HandoffServer {
+    int listen_fd;
+    char* mountpoint;
+    JobQueue* jq;
+} HandoffServer;
+
+static void* handoff_thread(void* arg);
+static bool serve_handoff(HandoffServer* server, int sock);
+static void detach_mount(int root_fd, const char* mountpoint);
+static bool make_address(const char* socket_path, struct sockaddr_un* addr);
+
+
+bool handoff_listen(const char* socket_path, const char* mountpoint, JobQueue* jq) {
+    struct sockaddr_un addr;
+    if (!make_address(socket_path, &addr)) {
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return false;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    // Whoever connects gets the job queue, so only our own user may.
+    // The socket isn't listening yet while its mode is still the umask's.
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+            chmod(socket_path, 0600) == -1 || listen(fd, 1) == -1) {
+        close(fd);
+        return false;
+    }
+
+    HandoffServer* server = malloc(sizeof(HandoffServer));
+    server->listen_fd = fd;
+    server->mountpoint = strdup(mountpoint);
+    server->jq = jq;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &handoff_thread, server) != 0) {
+        close(fd);
+        free(server->mountpoint);
+        free(server);
+        return false;
+    }
+    pthread_detach(thread);
+
+    DPRINTF("Listening for handoff on %s", socket_path);
+    return true;
+}
+
+int handoff_connect(const char* socket_path, JobQueueExport* exp) {
+    struct sockaddr_un addr;
+    if (!make_address(socket_path, &addr)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        int saved_errno = errno;
+        close(sock);
+        errno = saved_errno;
+        return -1;
+    }
+
+    char buf[HANDOFF_MSG_SIZE];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) - 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t len;
+    do {
+        len = recvmsg(sock, &msg, 0);
+    } while (len == -1 && errno == EINTR);
+
+    struct cmsghdr* cmsg = (len > 0) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        DPRINT("Malformed handoff message");
+        close(sock);
+        errno = EPROTO;
+        return -1;
+    }
+    int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int fds[HANDOFF_MAX_FDS];
+    memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+    for (int i = 0; i < num_fds; ++i) {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    // QUEUEFS-HANDOFF <shards> <pid>...
+    buf[len] = '\0';
+    bool ok = strncmp(buf, HANDOFF_GREETING " ", strlen(HANDOFF_GREETING " ")) == 0;
+    char* p = buf + strlen(HANDOFF_GREETING " ");
+    char* end;
+    exp->num_shards = ok ? (int)strtol(p, &end, 10) : 0;
+    ok = ok && end != p && exp->num_shards >= 1 && exp->num_shards <= JOBQUEUE_MAX_SHARDS &&
+        num_fds == 1 + 2 * exp->num_shards;
+    for (int i = 0; ok && i < exp->num_shards; ++i) {
+        p = end;
+        exp->pids[i] = strtol(p, &end, 10);
+        exp->input_fds[i] = fds[1 + 2 * i];
+        exp->output_fds[i] = fds[2 + 2 * i];
+        ok = end != p;
+    }
+    exp->shared_fd = fds[0];
+
+    if (!ok) {
+        DPRINTF("Unexpected handoff greeting: %s", buf);
+        for (int i = 0; i < num_fds; ++i) {
+            close(fds[i]);
+        }
+        close(sock);
+        errno = EPROTO;
+        return -1;
+    }
+    return sock;
+}
+
+void handoff_complete(int sock) {
+    const char* msg = HANDOFF_MOUNTED "\n";
+    if (write(sock, msg, strlen(msg)) == -1) {
+        DPRINTF("Failed to notify old instance: %d", errno);
+    }
+    close(sock);
+}
+
+static void* handoff_thread(void* arg) {
+    HandoffServer* server = arg;
+
+    while (true) {
+        int sock = accept(server->listen_fd, NULL, NULL);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            DPRINTF("accept() on handoff socket failed: %d", errno);
+            break;
+        }
+        fcntl(sock, F_SETFD, FD_CLOEXEC);
+        bool done = serve_handoff(server, sock);
+        close(sock);
+        if (done) {
+            break;
+        }
+    }
+
+    close(server->listen_fd);
+    free(server->mountpoint);
+    free(server);
+    return NULL;
+}
+
+// Returns true if the job queue was handed over.
+static bool serve_handoff(HandoffServer* server, int sock) {
+    DPRINT("New instance connected for handoff");
+
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 || cred.uid != geteuid()) {
+        DPRINT("Refusing handoff to another user");
+        return false;
+    }
+
+    // Refer to our own mount while it's still the topmost one.
+    int root_fd = open(server->mountpoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+        DPRINTF("Failed to open our mountpoint: %d", errno);
+    }
+
+    JobQueueExport exp;
+    jobqueue_export(server->jq, &exp);
+
+    // The shared memory first, then the pipes of each shard.
+    int num_fds = 1 + 2 * exp.num_shards;
+    int fds[HANDOFF_MAX_FDS];
+    fds[0] = exp.shared_fd;
+    char buf[HANDOFF_MSG_SIZE];
+    size_t len = snprintf(buf, sizeof(buf), HANDOFF_GREETING " %d", exp.num_shards);
+    for (int i = 0; i < exp.num_shards; ++i) {
+        fds[1 + 2 * i] = exp.input_fds[i];
+        fds[2 + 2 * i] = exp.output_fds[i];
+        len += snprintf(buf + len, sizeof(buf) - len, " %d", (int)exp.pids[i]);
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "\n");
+
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+
+    if (sendmsg(sock, &msg, 0) == -1) {
+        DPRINTF("Failed to send job queue: %d", errno);
+        jobqueue_reclaim(server->jq);
+        if (root_fd != -1) {
+            close(root_fd);
+        }
+        return false;
+    }
+
+    // Wait until the new instance has mounted on top of us.
+    char reply[16];
+    ssize_t reply_len;
+    do {
+        reply_len = read(sock, reply, sizeof(reply) - 1);
+    } while (reply_len == -1 && errno == EINTR);
+    if (reply_len <= 0 || strncmp(reply, HANDOFF_MOUNTED, strlen(HANDOFF_MOUNTED)) != 0) {
+        DPRINT("New instance failed to mount. Keeping the job queue.");
+        jobqueue_reclaim(server->jq);
+        if (root_fd != -1) {
+            close(root_fd);
+        }
+        return false;
+    }
+
+    detach_mount(root_fd, server->mountpoint);
+    return true;
+}
+
+static void detach_mount(int root_fd, const char* mountpoint) {
+    if (root_fd == -1) {
+        return;
+    }
+#if defined(__linux__) && defined(MNT_DETACH)
+    // The mountpoint path now leads to the new mount,
+    // but /proc/self/fd/N still leads to ours.
+    // FUSE ends our session once the last open file is closed.
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", root_fd);
+    if (umount2(path, MNT_DETACH) == 0) {
+        DPRINT("Detached old mount");
+    } else {
+        fprintf(stderr,
+                "Could not detach the old mount beneath %s: %s\n"
+                "It stays mounted until the new one is unmounted.\n",
+                mountpoint, strerror(errno));
+    }
+#else
+    fprintf(stderr,
+            "The old mount stays beneath %s until the new one is unmounted.\n",
+            mountpoint);
+#endif
+    close(root_fd);
+}
+
+static bool make_address(const char* socket_path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    strcpy(addr->sun_path, socket_path);
+    return true;
+}
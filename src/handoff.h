@@ -0,0 +1,63 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#ifndef INC_QUEUEFS_HANDOFF_H
+#define INC_QUEUEFS_HANDOFF_H
+
+#include "jobqueue.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Handing a running mount over to a new queuefs instance, e.g. to upgrade it.
+ *
+ * The running instance listens on a Unix socket. A new instance connects
+ * before mounting and receives the job queue processes' pipes by SCM_RIGHTS.
+ * The job queue processes, their queues and running workers carry on as before.
+ * The new instance then mounts on top of the old mount and tells the old
+ * instance, which lazily unmounts itself and exits once its open files
+ * are closed. Files closed through either mount are queued, so writes
+ * are accepted throughout.
+ *
+ * libfuse 2 can't resume a FUSE session that another process has started,
+ * hence the second mount instead of passing /dev/fuse along.
+ */
+
+/*
+ * Starts a thread that hands the job queue over to the first instance
+ * that connects to socket_path. The path is replaced if it exists.
+ */
+bool handoff_listen(const char* socket_path, const char* mountpoint, JobQueue* jq);
+
+/*
+ * Connects to an instance listening on socket_path and receives its job queue.
+ * Returns a socket to pass to handoff_complete(), or -1 with errno set.
+ * ENOENT and ECONNREFUSED mean there is no instance to take over from.
+ */
+int handoff_connect(const char* socket_path, JobQueueExport* exp);
+
+/* Tells the old instance that the new mount is up and closes the socket. */
+void handoff_complete(int sock);
+
+#endif
@@ -0,0 +1,180 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#include "hash.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* The second half of the hash is seeded with this. */
+#define SECOND_SEED 0x9e3779b97f4a7c15ULL
+
+static const uint64_t PRIME1 = 11400714785074694791ULL;
+static const uint64_t PRIME2 = 14029467366897019727ULL;
+static const uint64_t PRIME3 = 1609587929392839161ULL;
+static const uint64_t PRIME4 = 9650029242287828579ULL;
+static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+static void xxh64_init(Xxh64State* s, uint64_t seed);
+static void xxh64_update(Xxh64State* s, const unsigned char* p, size_t len);
+static uint64_t xxh64_digest(const Xxh64State* s);
+static inline uint64_t rotl(uint64_t x, int r);
+static inline uint64_t read64(const unsigned char* p);
+static inline uint32_t read32(const unsigned char* p);
+static inline uint64_t round64(uint64_t acc, uint64_t input);
+static inline uint64_t merge_round(uint64_t acc, uint64_t val);
+
+
+void hash_init(HashState* state) {
+    xxh64_init(&state->parts[0], 0);
+    xxh64_init(&state->parts[1], SECOND_SEED);
+}
+
+void hash_update(HashState* state, const void* data, size_t len) {
+    xxh64_update(&state->parts[0], data, len);
+    xxh64_update(&state->parts[1], data, len);
+}
+
+void hash_final(const HashState* state, char* out) {
+    snprintf(out, HASH_HEX_LEN + 1, "%016llx%016llx",
+             (unsigned long long)xxh64_digest(&state->parts[0]),
+             (unsigned long long)xxh64_digest(&state->parts[1]));
+}
+
+uint64_t xxh64(const void* data, size_t len, uint64_t seed) {
+    Xxh64State s;
+    xxh64_init(&s, seed);
+    xxh64_update(&s, data, len);
+    return xxh64_digest(&s);
+}
+
+static void xxh64_init(Xxh64State* s, uint64_t seed) {
+    s->acc[0] = seed + PRIME1 + PRIME2;
+    s->acc[1] = seed + PRIME2;
+    s->acc[2] = seed;
+    s->acc[3] = seed - PRIME1;
+    s->total_len = 0;
+    s->seed = seed;
+    s->buf_len = 0;
+}
+
+static void xxh64_update(Xxh64State* s, const unsigned char* p, size_t len) {
+    s->total_len += len;
+
+    if (s->buf_len + len < 32) {
+        memcpy(s->buf + s->buf_len, p, len);
+        s->buf_len += len;
+        return;
+    }
+
+    if (s->buf_len > 0) {
+        size_t fill = 32 - s->buf_len;
+        memcpy(s->buf + s->buf_len, p, fill);
+        for (int i = 0; i < 4; ++i) {
+            s->acc[i] = round64(s->acc[i], read64(s->buf + i * 8));
+        }
+        p += fill;
+        len -= fill;
+        s->buf_len = 0;
+    }
+
+    // Four independent lanes, which the CPU can run in parallel.
+    uint64_t a0 = s->acc[0], a1 = s->acc[1], a2 = s->acc[2], a3 = s->acc[3];
+    while (len >= 32) {
+        a0 = round64(a0, read64(p));
+        a1 = round64(a1, read64(p + 8));
+        a2 = round64(a2, read64(p + 16));
+        a3 = round64(a3, read64(p + 24));
+        p += 32;
+        len -= 32;
+    }
+    s->acc[0] = a0; s->acc[1] = a1; s->acc[2] = a2; s->acc[3] = a3;
+
+    memcpy(s->buf, p, len);
+    s->buf_len = len;
+}
+
+static uint64_t xxh64_digest(const Xxh64State* s) {
+    uint64_t h;
+    if (s->total_len >= 32) {
+        h = rotl(s->acc[0], 1) + rotl(s->acc[1], 7) + rotl(s->acc[2], 12) + rotl(s->acc[3], 18);
+        for (int i = 0; i < 4; ++i) {
+            h = merge_round(h, s->acc[i]);
+        }
+    } else {
+        h = s->seed + PRIME5;
+    }
+    h += s->total_len;
+
+    const unsigned char* p = s->buf;
+    size_t len = s->buf_len;
+    while (len >= 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+        p++;
+        len--;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Little-endian loads. Compilers turn these into single loads where they can. */
+static inline uint64_t read64(const unsigned char* p) {
+    return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+}
+
+static inline uint32_t read32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
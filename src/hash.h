@@ -0,0 +1,57 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#ifndef INC_QUEUEFS_HASH_H
+#define INC_QUEUEFS_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A streaming 128-bit content hash made of two XXH64 hashes
+ * with different seeds. Fast, but not cryptographic.
+ */
+
+#define HASH_HEX_LEN 32
+
+typedef struct Xxh64State {
+    uint64_t acc[4];
+    uint64_t total_len;
+    uint64_t seed;
+    unsigned char buf[32];
+    size_t buf_len;
+} Xxh64State;
+
+typedef struct HashState {
+    Xxh64State parts[2];
+} HashState;
+
+void hash_init(HashState* state);
+void hash_update(HashState* state, const void* data, size_t len);
+
+/* Writes HASH_HEX_LEN hex digits and a NUL to out. */
+void hash_final(const HashState* state, char* out);
+
+uint64_t xxh64(const void* data, size_t len, uint64_t seed);
+
+#endif
@@ -0,0 +1,226 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#include "joblog.h"
+#include "debug.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+/* Lines longer than this are split when prefixed in the shared log. */
+#define MAX_LINE_LENGTH 4096
+
+struct JobLog {
+    gchar* file_path; // NULL if there is no per-job file
+    int fd;
+    long bytes_written;
+    bool truncated;
+
+    gchar* prefix;
+    GString* partial_line;
+};
+
+static gchar* log_dir = NULL;
+static gchar* shared_path = NULL;
+static gchar* shared_rotated_path = NULL;
+static int shared_fd = -1;
+static long shared_size = 0;
+static long max_bytes = 0;
+
+static bool open_shared_log();
+static void write_shared_line(JobLog* log, const char* data, size_t len);
+static void write_fully(int fd, const char* data, size_t len);
+
+
+bool joblog_init(const char* dir, const char* shared_file, long max_bytes_) {
+    max_bytes = max_bytes_;
+    if (dir) {
+        log_dir = g_strdup(dir);
+        if (mkdir(log_dir, 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "Failed to create job log directory %s: %s\n", log_dir, strerror(errno));
+            return false;
+        }
+    }
+    if (shared_file) {
+        shared_path = g_strdup(shared_file);
+        shared_rotated_path = g_strdup_printf("%s.1", shared_file);
+        if (!open_shared_log()) {
+            fprintf(stderr, "Failed to open job log %s: %s\n", shared_path, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+void joblog_shutdown() {
+    if (shared_fd != -1) {
+        close(shared_fd);
+        shared_fd = -1;
+    }
+    g_free(log_dir);
+    g_free(shared_path);
+    g_free(shared_rotated_path);
+    log_dir = shared_path = shared_rotated_path = NULL;
+}
+
+bool joblog_enabled() {
+    return log_dir != NULL || shared_path != NULL;
+}
+
+JobLog* joblog_open(long long job_id, int attempt, const char* path) {
+    JobLog* log = g_malloc(sizeof(JobLog));
+    log->file_path = NULL;
+    log->fd = -1;
+    log->bytes_written = 0;
+    log->truncated = false;
+    log->prefix = NULL;
+    log->partial_line = NULL;
+
+    if (log_dir) {
+        log->file_path = g_strdup_printf("%s/%lld.log", log_dir, job_id);
+        log->fd = open(log->file_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (log->fd == -1) {
+            DPRINTF("Failed to open job log %s: %d", log->file_path, errno);
+        } else {
+            gchar* header = g_strdup_printf("# job %lld attempt %d: %s\n", job_id, attempt + 1, path);
+            write_fully(log->fd, header, strlen(header));
+            g_free(header);
+        }
+    }
+    if (shared_path) {
+        log->prefix = g_strdup_printf("[job %lld %s] ", job_id, path);
+        log->partial_line = g_string_new("");
+    }
+    return log;
+}
+
+void joblog_write(JobLog* log, const char* data, size_t len) {
+    if (log->fd != -1 && !log->truncated) {
+        size_t amount = len;
+        if (max_bytes > 0 && log->bytes_written + (long)amount > max_bytes) {
+            amount = max_bytes - log->bytes_written;
+            log->truncated = true;
+        }
+        write_fully(log->fd, data, amount);
+        log->bytes_written += amount;
+        if (log->truncated) {
+            const char* note = "\n# output truncated\n";
+            write_fully(log->fd, note, strlen(note));
+        }
+    }
+
+    if (log->partial_line) {
+        const char* end = data + len;
+        while (data < end) {
+            const char* newline = memchr(data, '\n', end - data);
+            size_t amount = newline ? (size_t)(newline - data) : (size_t)(end - data);
+            g_string_append_len(log->partial_line, data, amount);
+            data += amount;
+            if (newline) {
+                data++;
+            }
+            if (newline || log->partial_line->len >= MAX_LINE_LENGTH) {
+                write_shared_line(log, log->partial_line->str, log->partial_line->len);
+                g_string_truncate(log->partial_line, 0);
+            }
+        }
+    }
+}
+
+void joblog_close(JobLog* log, bool keep_file) {
+    if (log->fd != -1) {
+        close(log->fd);
+    }
+    if (log->file_path && !keep_file) {
+        unlink(log->file_path);
+    }
+    if (log->partial_line) {
+        if (log->partial_line->len > 0) {
+            write_shared_line(log, log->partial_line->str, log->partial_line->len);
+        }
+        g_string_free(log->partial_line, TRUE);
+    }
+    g_free(log->file_path);
+    g_free(log->prefix);
+    g_free(log);
+}
+
+static bool open_shared_log() {
+    shared_fd = open(shared_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (shared_fd == -1) {
+        return false;
+    }
+    struct stat st;
+    shared_size = (fstat(shared_fd, &st) == 0) ? st.st_size : 0;
+    return true;
+}
+
+static void write_shared_line(JobLog* log, const char* data, size_t len) {
+    if (shared_fd == -1) {
+        return;
+    }
+
+    size_t prefix_len = strlen(log->prefix);
+    size_t total = prefix_len + len + 1;
+    if (max_bytes > 0 && shared_size > 0 && shared_size + (long)total > max_bytes) {
+        DPRINTF("Rotating job log %s", shared_path);
+        close(shared_fd);
+        if (rename(shared_path, shared_rotated_path) == -1) {
+            DPRINTF("Failed to rotate job log: %d", errno);
+        }
+        if (!open_shared_log()) {
+            DPRINTF("Failed to reopen job log: %d", errno);
+            return;
+        }
+    }
+
+    // One write per line so lines from different jobs don't interleave.
+    gchar* line = g_malloc(total);
+    memcpy(line, log->prefix, prefix_len);
+    memcpy(line + prefix_len, data, len);
+    line[total - 1] = '\n';
+    write_fully(shared_fd, line, total);
+    g_free(line);
+    shared_size += total;
+}
+
+static void write_fully(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t ret = write(fd, data, len);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DPRINTF("Failed to write job log: %d", errno);
+            return;
+        }
+        data += ret;
+        len -= ret;
+    }
+}
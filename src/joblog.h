@@ -0,0 +1,64 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#ifndef INC_QUEUEFS_JOBLOG_H
+#define INC_QUEUEFS_JOBLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Destinations for the captured stdout and stderr of jobs.
+ *
+ * Each run of a job can go to its own file, <dir>/<job id>.log,
+ * and/or to a shared log where every line is prefixed with the job ID
+ * and path. Both are capped at max_bytes: a job's own file is cut
+ * short and the shared log is rotated to <file>.1.
+ *
+ * Used only by the job queue process, which is single-threaded.
+ */
+
+struct JobLog;
+typedef struct JobLog JobLog;
+
+/* Either path may be NULL. Returns false if a log can't be opened. */
+bool joblog_init(const char* dir, const char* shared_file, long max_bytes);
+
+void joblog_shutdown();
+
+/* Whether jobs' output should be captured at all. */
+bool joblog_enabled();
+
+/* Starts the log of one run of a job. Truncates any log of an earlier run. */
+JobLog* joblog_open(long long job_id, int attempt, const char* path);
+
+void joblog_write(JobLog* log, const char* data, size_t len);
+
+/*
+ * Finishes the log of a run. The job's own log file is deleted
+ * unless keep_file is set, which is done for failed runs so the
+ * output is available until the job is retried.
+ */
+void joblog_close(JobLog* log, bool keep_file);
+
+#endif
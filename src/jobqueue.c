@@ -25,6 +25,8 @@
 #include "jobqueue_process.h"
 #include "debug.h"
 #include "misc.h"
+#include "hash.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -32,118 +34,512 @@
 #include <assert.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <alloca.h>
 #include <pthread.h>
 
+typedef struct Shard {
+    pthread_mutex_t mutex;
+    pid_t pid;
+    int input_fd;
+    int output_fd;
+
+    // One waiter at a time reads replies, which may be for others' barriers,
+    // and wakes the others through reply_cond after each read.
+    pthread_mutex_t reply_mutex; // Protects the rest
+    pthread_cond_t reply_cond;
+    bool reading;
+    char reply_buf[64]; // Partially read reply
+    size_t reply_len;
+    long long* done_ids; // Barriers reached and not yet waited for
+    int num_done;
+    int done_capacity;
+} Shard;
+
 struct JobQueue {
     JobQueueSettings settings;
-    pthread_mutex_t mutex;
-    pid_t child_pid;
-    int child_input_fd;
-    int child_output_fd;
+    int num_shards;
+    Shard shards[JOBQUEUE_MAX_SHARDS];
+    int shared_fd;
+    JobQueueShared* shared;
+    bool adopted;  // The processes are not our children
+    bool exported; // The processes belong to another instance now
+    long long last_barrier_id;
 };
 
-static void send_command(JobQueue* jq, const char* cmd, size_t len);
+static JobQueue* alloc_jobqueue(int num_shards);
+static void free_jobqueue(JobQueue* jq);
+static JobQueueShared* map_shared(int fd);
+static bool start_shard(JobQueue* jq, int index, const int* wake_fds);
+static int wait_for_shard(JobQueue* jq, Shard* shard);
+static int choose_shard(JobQueue* jq, const char* path, const uint64_t* key_hash);
+static void format_job_attributes(const JobInfo* info, uint64_t key_hash, char* buf, size_t size);
+static void lock_all_shards(JobQueue* jq);
+static void unlock_all_shards(JobQueue* jq);
+static void send_command(Shard* shard, const char* cmd, size_t len, int fd);
+static bool take_done_id(Shard* shard, long long id);
+static void read_replies(Shard* shard);
+static bool copy_settings(JobQueueSettings* dest, const JobQueueSettings* src);
+static void free_settings(JobQueueSettings* settings);
+static bool copy_string_setting(const char** dest, const char* src);
 
 
+void jobqueue_settings_init(JobQueueSettings* settings) {
+    settings->cmd_template = NULL;
+    settings->source_dir = NULL;
+    settings->max_workers = 100;
+    settings->max_running_bytes = 0;
+    settings->shards = 1;
+    settings->retry_wait_ms = 30 * 1000;
+    settings->timeout_ms = 0;
+    settings->kill_grace_ms = 5 * 1000;
+    settings->trace_file = NULL;
+    settings->record_file = NULL;
+    settings->job_log_dir = NULL;
+    settings->job_log_file = NULL;
+    settings->job_log_max_bytes = 1024 * 1024;
+    settings->dedup_index = NULL;
+    settings->stdin_file = false;
+    settings->delete_on_finish = false;
+    settings->move_on_finish_dir = NULL;
+    settings->max_start_rate = 0;
+    settings->start_burst = 1;
+    settings->smallest_first = 0;
+    settings->claim_dir = NULL;
+    settings->queue_cpus = NULL;
+    settings->worker_cpus = NULL;
+    settings->worker_placement = JOBQUEUE_PLACE_ANY;
+    settings->simulation = NULL;
+}
+
 JobQueue* jobqueue_create(const JobQueueSettings* settings) {
-    JobQueue* jq = NULL;
+    int num_shards = settings->shards;
+    if (num_shards < 1 || num_shards > JOBQUEUE_MAX_SHARDS) {
+        DPRINTF("Invalid number of shards: %d", num_shards);
+        return NULL;
+    }
 
-    int input_pipe[2] = {-1, -1};
-    int output_pipe[2] = {-1, -1};
-    if (pipe(input_pipe) == -1) {
-        goto error;
+    JobQueue* jq = alloc_jobqueue(num_shards);
+    if (!jq) {
+        return NULL;
     }
-    if (pipe(output_pipe) == -1) {
-        goto error;
+    if (!copy_settings(&jq->settings, settings)) {
+        free_jobqueue(jq);
+        return NULL;
     }
 
-    jq = malloc(sizeof(JobQueue));
-    if (!jq) {
-        goto error;
+    // The shared memory lives in a deleted file so that it can be handed over.
+    FILE* f = tmpfile();
+    if (f) {
+        jq->shared_fd = dup(fileno(f));
+        fclose(f);
+    }
+    if (jq->shared_fd == -1 || ftruncate(jq->shared_fd, sizeof(JobQueueShared)) == -1) {
+        DPRINTF("Failed to create shared memory for job queue: %d", errno);
+        free_jobqueue(jq);
+        return NULL;
     }
-    jq->settings = *settings;
-    jq->settings.cmd_template = strdup(jq->settings.cmd_template);
-    if (!jq->settings.cmd_template) {
-        goto error;
+    fcntl(jq->shared_fd, F_SETFD, FD_CLOEXEC);
+    jq->shared = map_shared(jq->shared_fd);
+    if (!jq->shared) {
+        free_jobqueue(jq);
+        return NULL;
+    }
+    jq->shared->num_shards = num_shards;
+    jq->shared->max_workers = settings->max_workers;
+    jq->shared->max_running_bytes = settings->max_running_bytes;
+    if (settings->max_start_rate > 0) {
+        int burst = settings->start_burst > 1 ? settings->start_burst : 1;
+        jq->shared->start_interval_us = (long long)(1000000 / settings->max_start_rate);
+        if (jq->shared->start_interval_us < 1) {
+            // Zero would turn the limit off.
+            jq->shared->start_interval_us = 1;
+        }
+        jq->shared->start_tolerance_us = jq->shared->start_interval_us * (burst - 1);
     }
-    pthread_mutex_init(&jq->mutex, NULL);
-    jq->child_input_fd = input_pipe[1];
-    jq->child_output_fd = output_pipe[0];
 
-    fflush(stdout);
-    fflush(stderr);
+    int* wake_fds = alloca(2 * num_shards * sizeof(int));
+    for (int i = 0; i < num_shards; ++i) {
+        if (pipe(&wake_fds[2 * i]) == -1) {
+            for (int j = 0; j < 2 * i; ++j) {
+                close(wake_fds[j]);
+            }
+            free_jobqueue(jq);
+            return NULL;
+        }
+        for (int j = 2 * i; j < 2 * i + 2; ++j) {
+            fcntl(wake_fds[j], F_SETFL, O_NONBLOCK);
+            fcntl(wake_fds[j], F_SETFD, FD_CLOEXEC);
+        }
+    }
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        DPRINT("Job queue process forked");
-        close(input_pipe[1]);
-        close(output_pipe[0]);
-        jobqueue_process_main(&jq->settings, input_pipe[0], output_pipe[1]);
-        _exit(0);
-    } else if (pid == -1) {
-        DPRINTF("Failed to fork jobqueue: %d", errno);
-        goto error;
+    bool ok = true;
+    for (int i = 0; i < num_shards && ok; ++i) {
+        ok = start_shard(jq, i, wake_fds);
+    }
+
+    // Only the shards use these.
+    for (int i = 0; i < 2 * num_shards; ++i) {
+        close(wake_fds[i]);
     }
 
-    jq->child_pid = pid;
+    if (!ok) {
+        jobqueue_destroy(jq);
+        return NULL;
+    }
 
-    DPRINTF("Job queue created with cmd_template = `%s`", jq->settings.cmd_template);
+    DPRINTF("Job queue created with %d shard(s) and cmd_template = `%s`",
+            num_shards, jq->settings.cmd_template);
     return jq;
+}
 
-error:
-    close(input_pipe[0]);
-    close(input_pipe[1]);
-    close(output_pipe[0]);
-    close(output_pipe[1]);
-    if (jq) {
-        pthread_mutex_destroy(&jq->mutex);
-        free((char*)jq->settings.cmd_template);
-    }
-    free(jq);
-    return NULL;
+void jobqueue_job_info_init(JobInfo* info) {
+    info->bytes = -1;
+    info->hash = NULL;
+    info->stdin_fd = -1;
+    info->order_key = NULL;
+    info->numa_node = -1;
+    info->done = false;
 }
 
 void jobqueue_add_file(JobQueue* jq, const char* path) {
-    size_t len = strlen("EXEC ") + strlen(path) + 1;
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    jobqueue_add_job(jq, path, &info);
+}
+
+void jobqueue_add_job(JobQueue* jq, const char* path, const JobInfo* info) {
+    // EXEC <comma-separated attributes or -> <path>
+    char attrs[160];
+    uint64_t key_hash = 0;
+    if (info->order_key) {
+        key_hash = xxh64(info->order_key, strlen(info->order_key), 0);
+    }
+    format_job_attributes(info, key_hash, attrs, sizeof(attrs));
+    size_t len = strlen("EXEC ") + strlen(attrs) + 1 + strlen(path) + 1;
     char* cmd = alloca(len);
-    strcpy(cmd, "EXEC ");
-    strcpy(cmd + strlen("EXEC "), path);
+    snprintf(cmd, len, "EXEC %s %s", attrs, path);
+
+    int index = choose_shard(jq, path, info->order_key ? &key_hash : NULL);
+    Shard* shard = &jq->shards[index];
+    // Counted before sending so that the shard never sees them go negative.
+    __sync_fetch_and_add(&jq->shared->shards[index].load, 1);
+    if (info->bytes > 0) {
+        __sync_fetch_and_add(&jq->shared->shards[index].bytes, info->bytes);
+    }
+    if (info->stdin_fd != -1) {
+        __sync_fetch_and_add(&jq->shared->shards[index].stdin_fds, 1);
+        if (info->bytes > 0) {
+            __sync_fetch_and_add(&jq->shared->shards[index].stdin_bytes, info->bytes);
+        }
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    send_command(shard, cmd, len, info->stdin_fd);
+    pthread_mutex_unlock(&shard->mutex);
 
-    pthread_mutex_lock(&jq->mutex);
-    send_command(jq, cmd, len);
-    pthread_mutex_unlock(&jq->mutex);
+    DPRINTF("Added to job queue shard %d: %s", index, path);
+}
+
+void jobqueue_cancel(JobQueue* jq, const char* path) {
+    size_t len = strlen("CANCEL ") + strlen(path) + 1;
+    char* cmd = alloca(len);
+    snprintf(cmd, len, "CANCEL %s", path);
 
-    DPRINTF("Added to job queue: %s", path);
+    // The job may have spilled over to any shard.
+    for (int i = 0; i < jq->num_shards; ++i) {
+        Shard* shard = &jq->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        send_command(shard, cmd, len, -1);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    DPRINTF("Canceled jobs for %s", path);
+}
+
+void jobqueue_get_backlog(JobQueue* jq, long* jobs, long long* bytes) {
+    *jobs = 0;
+    *bytes = 0;
+    for (int i = 0; i < jq->num_shards; ++i) {
+        *jobs += jq->shared->shards[i].load;
+        *bytes += __sync_fetch_and_add(&jq->shared->shards[i].bytes, 0);
+    }
+}
+
+void jobqueue_get_stdin_fds(JobQueue* jq, int* fds, long long* bytes) {
+    *fds = 0;
+    *bytes = 0;
+    for (int i = 0; i < jq->num_shards; ++i) {
+        *fds += jq->shared->shards[i].stdin_fds;
+        *bytes += __sync_fetch_and_add(&jq->shared->shards[i].stdin_bytes, 0);
+    }
 }
 
 void jobqueue_flush(JobQueue* jq)
 {
-    pthread_mutex_lock(&jq->mutex);
+    jobqueue_barrier_wait(jq, jobqueue_barrier(jq, NULL));
+}
 
-    DPRINT("Sending FLUSH command to job queue");
-    send_command(jq, "FLUSH", strlen("FLUSH") + 1);
+long long jobqueue_barrier(JobQueue* jq, const char* const* scope) {
+    lock_all_shards(jq);
 
-    char buf;
-    int ret = read(jq->child_output_fd, &buf, 1);
-    if (ret == 0 || (ret == -1 && errno != EINTR)) {
-        DPRINT("Failed to read from jobqueue.");
-        abort();
+    if (jq->exported) {
+        DPRINT("Not starting a barrier on a job queue that was handed over");
+        unlock_all_shards(jq);
+        return -1;
+    }
+
+    // All shards work on the barrier in parallel.
+    long long id = ++jq->last_barrier_id;
+    DPRINTF("Sending barrier %lld to job queue", id);
+    for (const char* const* path = scope; path && *path; ++path) {
+        size_t len = strlen("SCOPE ") + strlen(*path) + 1;
+        char* cmd = malloc(len);
+        snprintf(cmd, len, "SCOPE %s", *path);
+        for (int i = 0; i < jq->num_shards; ++i) {
+            send_command(&jq->shards[i], cmd, len, -1);
+        }
+        free(cmd);
+    }
+    char cmd[32];
+    size_t len = snprintf(cmd, sizeof(cmd), "BARRIER %lld", id) + 1;
+    for (int i = 0; i < jq->num_shards; ++i) {
+        send_command(&jq->shards[i], cmd, len, -1);
+    }
+
+    unlock_all_shards(jq);
+    return id;
+}
+
+/*
+ * Waiters take turns reading a shard's replies, recording every barrier
+ * reached. The others sleep meanwhile and look for theirs after each read,
+ * so a barrier that's reached returns even while the reader's isn't.
+ */
+void jobqueue_barrier_wait(JobQueue* jq, long long id) {
+    if (id < 0) {
+        return;
+    }
+    for (int i = 0; i < jq->num_shards; ++i) {
+        Shard* shard = &jq->shards[i];
+        pthread_mutex_lock(&shard->reply_mutex);
+        // After a handover the replies are the new owner's.
+        while (!jq->exported && !take_done_id(shard, id)) {
+            if (shard->reading) {
+                pthread_cond_wait(&shard->reply_cond, &shard->reply_mutex);
+            } else {
+                shard->reading = true;
+                read_replies(shard);
+                shard->reading = false;
+                pthread_cond_broadcast(&shard->reply_cond);
+            }
+        }
+        pthread_mutex_unlock(&shard->reply_mutex);
+    }
+}
+
+void jobqueue_export(JobQueue* jq, JobQueueExport* exp) {
+    lock_all_shards(jq);
+    for (int i = 0; i < jq->num_shards; ++i) {
+        pthread_mutex_lock(&jq->shards[i].reply_mutex);
+    }
+    jq->exported = true;
+    exp->num_shards = jq->num_shards;
+    for (int i = 0; i < jq->num_shards; ++i) {
+        exp->pids[i] = jq->shards[i].pid;
+        exp->input_fds[i] = jq->shards[i].input_fd;
+        exp->output_fds[i] = jq->shards[i].output_fd;
+    }
+    exp->shared_fd = jq->shared_fd;
+    for (int i = jq->num_shards - 1; i >= 0; --i) {
+        pthread_cond_broadcast(&jq->shards[i].reply_cond);
+        pthread_mutex_unlock(&jq->shards[i].reply_mutex);
     }
+    unlock_all_shards(jq);
+}
+
+void jobqueue_reclaim(JobQueue* jq) {
+    lock_all_shards(jq);
+    jq->exported = false;
+    unlock_all_shards(jq);
+}
 
-    pthread_mutex_unlock(&jq->mutex);
+JobQueue* jobqueue_adopt(const JobQueueExport* exp) {
+    if (exp->num_shards < 1 || exp->num_shards > JOBQUEUE_MAX_SHARDS) {
+        return NULL;
+    }
+    JobQueue* jq = alloc_jobqueue(exp->num_shards);
+    if (!jq) {
+        return NULL;
+    }
+    jq->adopted = true;
+    // The settings stay with the job queue processes.
+    for (int i = 0; i < exp->num_shards; ++i) {
+        jq->shards[i].pid = exp->pids[i];
+        jq->shards[i].input_fd = exp->input_fds[i];
+        jq->shards[i].output_fd = exp->output_fds[i];
+    }
+    jq->shared_fd = exp->shared_fd;
+    jq->shared = map_shared(jq->shared_fd);
+    if (!jq->shared) {
+        jobqueue_destroy(jq);
+        return NULL;
+    }
+    DPRINTF("Adopted job queue with %d shard(s)", exp->num_shards);
+    return jq;
 }
 
 int jobqueue_destroy(JobQueue* jq) {
-    close(jq->child_input_fd);
-    close(jq->child_output_fd);
-    DPRINT("Closed pipe to job queue");
+    for (int i = 0; i < jq->num_shards; ++i) {
+        if (jq->shards[i].input_fd != -1) {
+            close(jq->shards[i].input_fd);
+            jq->shards[i].input_fd = -1;
+        }
+    }
+    DPRINT("Closed pipes to job queue");
+
+    int ret = 0;
+    if (!jq->exported) {
+        for (int i = 0; i < jq->num_shards; ++i) {
+            int shard_ret = wait_for_shard(jq, &jq->shards[i]);
+            if (ret == 0) {
+                ret = shard_ret;
+            }
+        }
+    }
+
+    free_jobqueue(jq);
+    return ret;
+}
+
+static JobQueue* alloc_jobqueue(int num_shards) {
+    JobQueue* jq = calloc(1, sizeof(JobQueue));
+    if (!jq) {
+        return NULL;
+    }
+    jobqueue_settings_init(&jq->settings);
+    jq->num_shards = num_shards;
+    for (int i = 0; i < num_shards; ++i) {
+        pthread_mutex_init(&jq->shards[i].mutex, NULL);
+        pthread_mutex_init(&jq->shards[i].reply_mutex, NULL);
+        pthread_cond_init(&jq->shards[i].reply_cond, NULL);
+        jq->shards[i].pid = -1;
+        jq->shards[i].input_fd = -1;
+        jq->shards[i].output_fd = -1;
+    }
+    jq->shared_fd = -1;
+    jq->shared = NULL;
+    jq->adopted = false;
+    jq->exported = false;
+    jq->last_barrier_id = 0;
+    return jq;
+}
+
+static void free_jobqueue(JobQueue* jq) {
+    for (int i = 0; i < jq->num_shards; ++i) {
+        if (jq->shards[i].input_fd != -1) {
+            close(jq->shards[i].input_fd);
+        }
+        if (jq->shards[i].output_fd != -1) {
+            close(jq->shards[i].output_fd);
+        }
+        pthread_mutex_destroy(&jq->shards[i].mutex);
+        pthread_mutex_destroy(&jq->shards[i].reply_mutex);
+        pthread_cond_destroy(&jq->shards[i].reply_cond);
+        free(jq->shards[i].done_ids);
+    }
+    if (jq->shared) {
+        munmap(jq->shared, sizeof(JobQueueShared));
+    }
+    if (jq->shared_fd != -1) {
+        close(jq->shared_fd);
+    }
+    free_settings(&jq->settings);
+    free(jq);
+}
+
+static JobQueueShared* map_shared(int fd) {
+    void* p = mmap(NULL, sizeof(JobQueueShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        DPRINTF("Failed to map job queue shared memory: %d", errno);
+        return NULL;
+    }
+    return p;
+}
+
+static bool start_shard(JobQueue* jq, int index, const int* wake_fds) {
+    Shard* shard = &jq->shards[index];
+
+    // Commands go over a socket so that file descriptors can be passed with jobs.
+    int input_pipe[2] = {-1, -1};
+    int output_pipe[2] = {-1, -1};
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, input_pipe) == -1) {
+        return false;
+    }
+    if (pipe(output_pipe) == -1) {
+        close(input_pipe[0]);
+        close(input_pipe[1]);
+        return false;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        DPRINTF("Job queue shard %d forked", index);
+        close(input_pipe[1]);
+        close(output_pipe[0]);
+        // Other shards must see EOF when we close their command pipes.
+        for (int i = 0; i < index; ++i) {
+            close(jq->shards[i].input_fd);
+            close(jq->shards[i].output_fd);
+        }
+        jobqueue_process_main(&jq->settings, input_pipe[0], output_pipe[1],
+                              jq->shared, index, wake_fds);
+        _exit(0);
+    }
+
+    close(input_pipe[0]);
+    close(output_pipe[1]);
+    if (pid == -1) {
+        DPRINTF("Failed to fork jobqueue: %d", errno);
+        close(input_pipe[1]);
+        close(output_pipe[0]);
+        return false;
+    }
+
+    shard->pid = pid;
+    shard->input_fd = input_pipe[1];
+    shard->output_fd = output_pipe[0];
+    return true;
+}
+
+static int wait_for_shard(JobQueue* jq, Shard* shard) {
+    if (shard->pid == -1) {
+        return 0;
+    }
+
+    if (jq->adopted) {
+        // We can't wait for a process that is not our child, but it closes
+        // its end of the reply pipe when it exits. Any previous owner must
+        // have closed its end of the command pipe too for it to exit.
+        char buf;
+        ssize_t amt;
+        do {
+            amt = read(shard->output_fd, &buf, 1);
+        } while (amt > 0 || (amt == -1 && errno == EINTR));
+    }
 
     int status = 0;
     int ret = 0;
-    if (waitpid(jq->child_pid, &status, 0) == jq->child_pid) {
+    pid_t waited = waitpid(shard->pid, &status, 0);
+    if (waited == -1 && errno == ECHILD && jq->adopted) {
+        ret = 0;
+    } else if (waited == shard->pid) {
         if (WIFSIGNALED(status)) {
             ret = -WTERMSIG(status);
             DPRINTF("Job queue process was killed by signal %d", -ret);
@@ -157,22 +553,190 @@ int jobqueue_destroy(JobQueue* jq) {
     } else {
         ret = -2000;
     }
-
-    pthread_mutex_destroy(&jq->mutex);
-    free((char*)jq->settings.cmd_template);
-    free(jq);
     return ret;
 }
 
-static void send_command(JobQueue* jq, const char* cmd, size_t len) {
-    assert(pthread_mutex_trylock(&jq->mutex) == EBUSY);
+static int choose_shard(JobQueue* jq, const char* path, const uint64_t* key_hash) {
+    if (jq->num_shards == 1) {
+        return 0;
+    }
+
+    // All jobs with the same key must go to the same shard to be ordered.
+    if (key_hash) {
+        return *key_hash % jq->num_shards;
+    }
+
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (const char* p = path; *p; ++p) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    int home = hash % jq->num_shards;
+
+    JobQueueShardState* states = jq->shared->shards;
+    int share = (jq->shared->max_workers + jq->num_shards - 1) / jq->num_shards;
+    if (share < 1) {
+        share = 1;
+    }
+    int best = home;
+    int best_load = states[home].load;
+    if (best_load < share) {
+        return home;
+    }
+    for (int i = 0; i < jq->num_shards; ++i) {
+        int load = states[i].load;
+        if (load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+static void format_job_attributes(const JobInfo* info, uint64_t key_hash, char* buf, size_t size) {
+    size_t len = 0;
+    if (info->bytes >= 0) {
+        len += snprintf(buf + len, size - len, "%sbytes=%lld", len ? "," : "", info->bytes);
+    }
+    if (info->hash) {
+        len += snprintf(buf + len, size - len, "%shash=%s", len ? "," : "", info->hash);
+    }
+    if (info->stdin_fd != -1) {
+        len += snprintf(buf + len, size - len, "%sstdin", len ? "," : "");
+    }
+    if (info->order_key) {
+        // Keys can be arbitrarily long. Equal hashes just order more jobs together.
+        len += snprintf(buf + len, size - len, "%skey=%016llx", len ? "," : "", (unsigned long long)key_hash);
+    }
+    if (info->numa_node >= 0) {
+        len += snprintf(buf + len, size - len, "%snode=%d", len ? "," : "", info->numa_node);
+    }
+    if (info->done) {
+        len += snprintf(buf + len, size - len, "%sdone", len ? "," : "");
+    }
+    if (len == 0) {
+        snprintf(buf, size, "-");
+    }
+}
+
+static bool take_done_id(Shard* shard, long long id) {
+    for (int i = 0; i < shard->num_done; ++i) {
+        if (shard->done_ids[i] == id) {
+            shard->done_ids[i] = shard->done_ids[--shard->num_done];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Blocks until at least some replies come.
+// Called by the reader with reply_mutex held, which is released while blocking.
+static void read_replies(Shard* shard) {
+    pthread_mutex_unlock(&shard->reply_mutex);
+    ssize_t ret;
+    do {
+        ret = read(shard->output_fd, shard->reply_buf + shard->reply_len,
+                   sizeof(shard->reply_buf) - shard->reply_len);
+    } while (ret == -1 && errno == EINTR);
+    pthread_mutex_lock(&shard->reply_mutex);
+    if (ret <= 0) {
+        DPRINT("Failed to read from jobqueue.");
+        abort();
+    }
+    shard->reply_len += ret;
+
+    // DONE <id>, NUL-terminated
+    char* start = shard->reply_buf;
+    char* end;
+    while ((end = memchr(start, '\0', shard->reply_buf + shard->reply_len - start)) != NULL) {
+        if (strncmp(start, "DONE ", strlen("DONE ")) == 0) {
+            if (shard->num_done == shard->done_capacity) {
+                shard->done_capacity = shard->done_capacity ? 2 * shard->done_capacity : 8;
+                shard->done_ids = realloc(shard->done_ids, shard->done_capacity * sizeof(long long));
+            }
+            shard->done_ids[shard->num_done++] = strtoll(start + strlen("DONE "), NULL, 10);
+        } else {
+            DPRINTF("Unknown reply from job queue: %s", start);
+        }
+        start = end + 1;
+    }
+    shard->reply_len -= start - shard->reply_buf;
+    memmove(shard->reply_buf, start, shard->reply_len);
+}
+
+static void lock_all_shards(JobQueue* jq) {
+    for (int i = 0; i < jq->num_shards; ++i) {
+        pthread_mutex_lock(&jq->shards[i].mutex);
+    }
+}
+
+static void unlock_all_shards(JobQueue* jq) {
+    for (int i = jq->num_shards - 1; i >= 0; --i) {
+        pthread_mutex_unlock(&jq->shards[i].mutex);
+    }
+}
+
+static bool copy_settings(JobQueueSettings* dest, const JobQueueSettings* src) {
+    *dest = *src;
+    // Each copy is attempted so that free_settings() can be called on failure.
+    bool ok = true;
+    ok &= copy_string_setting(&dest->cmd_template, src->cmd_template);
+    ok &= copy_string_setting(&dest->source_dir, src->source_dir);
+    ok &= copy_string_setting(&dest->trace_file, src->trace_file);
+    ok &= copy_string_setting(&dest->record_file, src->record_file);
+    ok &= copy_string_setting(&dest->job_log_dir, src->job_log_dir);
+    ok &= copy_string_setting(&dest->job_log_file, src->job_log_file);
+    ok &= copy_string_setting(&dest->dedup_index, src->dedup_index);
+    ok &= copy_string_setting(&dest->move_on_finish_dir, src->move_on_finish_dir);
+    ok &= copy_string_setting(&dest->claim_dir, src->claim_dir);
+    ok &= copy_string_setting(&dest->queue_cpus, src->queue_cpus);
+    ok &= copy_string_setting(&dest->worker_cpus, src->worker_cpus);
+    return ok;
+}
+
+static void free_settings(JobQueueSettings* settings) {
+    free((char*)settings->cmd_template);
+    free((char*)settings->source_dir);
+    free((char*)settings->trace_file);
+    free((char*)settings->record_file);
+    free((char*)settings->job_log_dir);
+    free((char*)settings->job_log_file);
+    free((char*)settings->dedup_index);
+    free((char*)settings->move_on_finish_dir);
+    free((char*)settings->claim_dir);
+    free((char*)settings->queue_cpus);
+    free((char*)settings->worker_cpus);
+}
+
+static bool copy_string_setting(const char** dest, const char* src) {
+    if (src) {
+        *dest = strdup(src);
+        return *dest != NULL;
+    } else {
+        *dest = NULL;
+        return true;
+    }
+}
+
+/* If fd is not -1, it's passed along with the first byte of the command. */
+static void send_command(Shard* shard, const char* cmd, size_t len, int fd) {
+    assert(pthread_mutex_trylock(&shard->mutex) == EBUSY);
+    TRACE_PROBE2(send_command, cmd, len);
 
     size_t amt_written = 0;
     while (amt_written < len) {
         size_t remaining = len - amt_written;
-        ssize_t ret = write(jq->child_input_fd, &cmd[amt_written], remaining);
+        ssize_t ret;
+        if (fd != -1) {
+            ret = send_with_fd(shard->input_fd, &cmd[amt_written], remaining, fd);
+        } else {
+            ret = write(shard->input_fd, &cmd[amt_written], remaining);
+        }
         if (ret > 0) {
             amt_written += ret;
+            fd = -1;
+        } else if (ret == -1 && errno == EINTR) {
+            continue;
         } else {
             if (ret == -1) {
                 DPRINTF("Error writing to job queue: %d", errno);
@@ -182,5 +746,5 @@ static void send_command(JobQueue* jq, const char* cmd, size_t len) {
             abort();
         }
     }
-    fsync(jq->child_input_fd);
+    fsync(shard->input_fd);
 }
@@ -24,16 +24,107 @@
 #ifndef INC_QUEUEFS_JOBQUEUE_H
 #define INC_QUEUEFS_JOBQUEUE_H
 
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Limited by how many file descriptors fit in one SCM_RIGHTS message. */
+#define JOBQUEUE_MAX_SHARDS 64
+
 struct JobQueue;
 typedef struct JobQueue JobQueue;
 
+/* How workers are spread over worker_cpus. */
+typedef enum JobQueuePlacement {
+    JOBQUEUE_PLACE_ANY,  /* Anywhere in worker_cpus */
+    JOBQUEUE_PLACE_CPU,  /* Each on one CPU, the least busy one */
+    JOBQUEUE_PLACE_NODE, /* Each on the CPUs of one NUMA node, the least busy one */
+    JOBQUEUE_PLACE_LOCAL /* On the NUMA node the file was written from, else like NODE */
+} JobQueuePlacement;
+
+/*
+ * Lets tests and benchmarks run the scheduler without waiting on real time
+ * or real jobs.
+ *
+ * With virtual_clock, time starts at 0 and jumps to the next retry, start,
+ * timeout or simulated job end whenever a shard has nothing else to do and
+ * no real worker is running. Use one shard, since shards don't share the
+ * clock but do share the start rate limiter. Trace timestamps stay real.
+ *
+ * With run_job, no worker is forked. The job's run "takes" *duration_us
+ * and exits with the returned code, or ends with -SIGTERM etc. if it's
+ * timed out or canceled first. A negative duration makes it run until
+ * then, like a hung job. attempt counts from 0.
+ */
+typedef struct JobQueueSimulation {
+    bool virtual_clock;
+    int (*run_job)(const char* path, int attempt, long long* duration_us);
+} JobQueueSimulation;
+
 typedef struct JobQueueSettings {
-    const char* cmd_template;
-    int max_workers;
+    const char* cmd_template; /* See template.h */
+    const char* source_dir;   /* What {rel} in cmd_template is relative to, or NULL */
+    int max_workers; /* Across all shards */
+    long long max_running_bytes; /* Total size of the files of running jobs across all shards, or 0 for no limit.
+                                    A bigger job runs when no other job of known size is. */
+    int shards;      /* Number of job queue processes */
     int retry_wait_ms;
+    int timeout_ms;    /* Wall-clock limit for one run of a job, or 0 for none */
+    int kill_grace_ms; /* Time between SIGTERM and SIGKILL on timeout */
+    const char* trace_file; /* Chrome trace event output, or NULL */
+    const char* record_file; /* Record of jobs for replaying (see record.h), or NULL */
+
+    /* Where to capture jobs' stdout and stderr. See joblog.h. */
+    const char* job_log_dir;  /* One file per job, or NULL */
+    const char* job_log_file; /* Shared log, or NULL */
+    long job_log_max_bytes;   /* Size cap for both, or 0 for none */
+
+    const char* dedup_index; /* Where to record hashes of succeeded jobs. See dedup.h. */
+
+    bool stdin_file; /* Give each worker the file as stdin */
+
+    /* What to do with the file of a job that succeeded. At most one may be set. */
+    bool delete_on_finish;
+    const char* move_on_finish_dir; /* Must be on the same file system, or NULL */
+    double max_start_rate; /* Job starts per second across all shards, or 0 for no limit.
+                              Rates over 1000000 count as 1000000. */
+    int start_burst; /* Starts allowed at once after being idle */
+    /* Let jobs estimated to run shorter go ahead of ones that became due up to
+       this many times their estimated run time before them, or 0 for strict order.
+       Run times per byte of file are learned from successful runs. */
+    double smallest_first;
+    const char* claim_dir; /* Where claims of succeeded jobs are deleted from (see claim.h), or NULL */
+
+    /* CPU lists like "0-3,8". See cpuset.h. */
+    const char* queue_cpus;  /* For the job queue processes, or NULL to not pin them */
+    const char* worker_cpus; /* For workers, or NULL for the CPUs the job queue was started on */
+    JobQueuePlacement worker_placement;
+
+    const JobQueueSimulation* simulation; /* Not copied; must outlive the job queue. NULL normally. */
 } JobQueueSettings;
 
 
+/* Optional facts about a job, passed along to the job queue. */
+typedef struct JobInfo {
+    long long bytes; /* Size of the file, or -1 if unknown */
+    const char* hash; /* Content hash to record on success, or NULL */
+    int stdin_fd; /* The file's content, given to workers as stdin, or -1. Stays owned by the caller.
+                     If it's a pipe, only the first run gets it and retries get the file if stdin_file is set.
+                     A run that ends while the pipe is still open for writing doesn't count. The job
+                     queue discards the rest of the pipe and runs the job again when it's closed.
+                     Cancel the job before closing the pipe if the file is incomplete. */
+    const char* order_key; /* Jobs with the same key run one at a time, in order. May be NULL. */
+    int numa_node; /* Where the file was written from, or -1. See JOBQUEUE_PLACE_LOCAL. */
+    bool done; /* Already processed, e.g. a duplicate. Nothing is run, but the file is
+                  deleted or moved and its claim released as if the job had succeeded. */
+} JobInfo;
+
+
+/*
+ * Fills in default values for all settings.
+ * cmd_template must still be set by the caller.
+ */
+void jobqueue_settings_init(JobQueueSettings* settings);
+
 /*
  * cmd_template must be a NULL-terminated array where the substring "{}"
  * will be replaced with the shell-quoted file name.
@@ -43,16 +134,110 @@ JobQueue* jobqueue_create(const JobQueueSettings* settings);
 /*
  * Adds a file to be processed in the background when a worker becomes available.
  *
+ * A file's finish action is taken, and its claim released, when a job for
+ * it succeeds and no other job for it is left unfinished.
+ *
+ * With several shards, the file goes to the shard its path hashes to,
+ * unless that shard has more than its share of max_workers in jobs
+ * and another shard has fewer.
+ *
  * This function is thread-safe.
  */
 void jobqueue_add_file(JobQueue* jq, const char* path);
 
+/* Like jobqueue_add_file() but with more information about the job. */
+void jobqueue_add_job(JobQueue* jq, const char* path, const JobInfo* info);
+
+void jobqueue_job_info_init(JobInfo* info);
+
+/*
+ * Drops the queued jobs for path and stops any running ones
+ * with SIGTERM and, after kill_grace_ms, SIGKILL.
+ * They leave the backlog and count as run for barriers,
+ * but their files are left alone and aren't released from claims.
+ * Jobs added after this are unaffected.
+ *
+ * This function is thread-safe.
+ */
+void jobqueue_cancel(JobQueue* jq, const char* path);
+
+/*
+ * Gets the number of jobs added and not yet finished successfully,
+ * and the total size of their files where known.
+ *
+ * This function is thread-safe.
+ */
+void jobqueue_get_backlog(JobQueue* jq, long* jobs, long long* bytes);
+
+/*
+ * Gets the number of stdin_fds passed with jobs that the job queue
+ * still holds, and the total size of those jobs' files where known.
+ * A job's stdin_fd is held until it succeeds or is canceled.
+ *
+ * This function is thread-safe.
+ */
+void jobqueue_get_stdin_fds(JobQueue* jq, int* fds, long long* bytes);
+
 /*
  * Waits for the job queue to run all currently queued jobs at least once.
  * This is defined like this to account for failing jobs.
+ * Jobs can be added meanwhile.
  */
 void jobqueue_flush(JobQueue* jq);
 
+/*
+ * Starts a barrier on the jobs queued now, without waiting for it.
+ * If scope is not NULL, it's a NULL-terminated array of paths and only
+ * jobs for those paths or paths under them are included.
+ * A job waiting behind a failed one with the same ordering key counts
+ * as run. Returns an ID for jobqueue_barrier_wait().
+ *
+ * This function is thread-safe.
+ */
+long long jobqueue_barrier(JobQueue* jq, const char* const* scope);
+
+/*
+ * Waits until every job of a barrier has run at least once.
+ * Each barrier must be waited for exactly once.
+ *
+ * This function is thread-safe. Any number of threads may wait for
+ * different barriers at the same time.
+ */
+void jobqueue_barrier_wait(JobQueue* jq, long long id);
+
+/* What another instance needs to take over a job queue. */
+typedef struct JobQueueExport {
+    int num_shards;
+    pid_t pids[JOBQUEUE_MAX_SHARDS];
+    int input_fds[JOBQUEUE_MAX_SHARDS];  /* Command sockets (AF_UNIX, SOCK_STREAM) */
+    int output_fds[JOBQUEUE_MAX_SHARDS]; /* Reply pipes */
+    int shared_fd; /* Memory shared by the shards */
+} JobQueueExport;
+
+/*
+ * Hands the job queue processes over to another queuefs instance.
+ * The file descriptors are still owned by jq. The caller sends them to
+ * the new owner (see handoff.h).
+ *
+ * After this, jobqueue_add_file() still works on the command sockets
+ * shared with the new owner. Its commands don't interleave with ours
+ * because each command, with any file descriptor, goes in a single small
+ * write() or sendmsg(), which the socket queues whole.
+ * jobqueue_flush() and barriers return immediately since their replies
+ * would go to whoever reads them first, and jobqueue_destroy() leaves
+ * the job queue processes to the new owner.
+ */
+void jobqueue_export(JobQueue* jq, JobQueueExport* exp);
+
+/* Undoes jobqueue_export() if the handover failed. */
+void jobqueue_reclaim(JobQueue* jq);
+
+/*
+ * Takes over job queue processes exported by another instance.
+ * Takes ownership of the file descriptors.
+ */
+JobQueue* jobqueue_adopt(const JobQueueExport* exp);
+
 /*
  * Destroys a job queue and kills its manager process.
  * Child processes get a SIGHUP.
@@ -25,83 +25,254 @@
 #include "jobqueue_process.h"
 #include "debug.h"
 #include "misc.h"
+#include "trace.h"
+#include "record.h"
+#include "joblog.h"
+#include "dedup.h"
+#include "claim.h"
+#include "cpuset.h"
+#include "hash.h"
+#include "template.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <poll.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <sys/time.h>
 #include <signal.h>
 #include <alloca.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #include <glib.h>
 
 
 typedef struct WorkUnit {
+    long long id; // Sequence number; breaks ties in work_queue ordering
     char* path;
-    pid_t worker_pid;
+    pid_t worker_pid; // -1 unless running
 
     int attempts;
     int last_exit_code;
-    struct timeval next_execution_time;
+    long long bytes; // Size of the file when it was added, or -1
+    gchar* hash; // Content hash to record on success, or NULL
+    int stdin_fd; // Content of the file passed by the parent, or -1
+    bool done; // Nothing to run, only the finish actions to take. See JobInfo.
+    bool stdin_once; // stdin_fd is a pipe, which only the first run gets
+    gchar* order_key; // Hash of the ordering key, or NULL
+    int numa_node; // Where the file was written from, or -1
+    int placement; // Index into placements while a worker runs pinned, or -1
+    GSList* barriers; // Barrier*s waiting for this unit to run
+    long long next_execution_us; // In now_us() time, like all times below
+    long long sort_us; // Its place in work_queue once due. See queue_work_unit().
+    long long run_start_us;
+    long long trace_start_us; // Real time even with a virtual clock
+
+    // When the worker is sent SIGTERM or, if that was already done, SIGKILL.
+    // Only used if there is a timeout.
+    long long deadline_us;
+    bool term_sent;
+    bool kill_sent;
+    bool canceled; // Stopped because its file is gone. Not run again.
+
+    int output_fd; // Read end of the worker's stdout/stderr pipe or -1
+    JobLog* log;
+
+    // A simulated run (see JobQueueSimulation) has a worker_pid below -1
+    // and ends at this time with this exit code.
+    long long simulated_end_us;
+    int simulated_exit_code;
 } WorkUnit;
 
+// A BARRIER command, waiting for the jobs queued when it came to run once.
+typedef struct Barrier {
+    long long id;
+    int remaining; // Units yet to run
+} Barrier;
+
 static const JobQueueSettings* settings;
 static int input_fd;
 static int output_fd;
 
+static JobQueueShared* shared;
+static int shard_index;
+static const int* wake_fds; // Read and write end of a pipe per shard
+
 static int readbuf_capacity;
+// File descriptors passed with commands, in the order they came.
+static GQueue received_fds;
 static int readbuf_size;
 static char* readbuf;
+static GByteArray* cmdbuf; // Partially received command
 
-// The following may only be accessed while SIGCHLD is blocked
-// since it is also accessed in the SIGCHLD handler.
-static long long workers_started_ever;
-static long long workers_waited_ever;
-static int active_workers;
+static long long units_created_ever;
+static int active_workers; // In this shard
 static GHashTable* active_work_units; // of pid to WorkUnit*
-static GTree* work_queue;             // of WorkUnit*
+static GTree* work_queue;             // of WorkUnit* that are due, by sort_us
+static GTree* delayed_queue;          // of WorkUnit* waiting to be due, by next_execution_us
+// Units whose worker exited before the end of their stdin pipe, while the file
+// was still being written. They run again once the writer closes the pipe.
+static GSList* cut_streams;
+
+// Jobs with an ordering key run one at a time. The first job of a key is
+// in work_queue or running and the rest wait here until it succeeds.
+static GHashTable* key_queues; // of order_key to GQueue of WorkUnit*
+static GHashTable* units_by_path; // of path to GQueue of unfinished WorkUnit*
+
+// Set when the start rate limit was hit, in now_us() time.
+static long long throttled_until_us;
+
+// Moving averages of how long successful runs took, for estimating run times.
+static double us_per_byte; // Of jobs with a known, nonzero size
+static double us_per_run;  // Of the rest
+
+// With a virtual clock, now_us() returns this. See JobQueueSimulation.
+static bool virtual_clock;
+static long long virtual_now_us;
+static pid_t last_simulated_pid; // Simulated runs count down from -2
+static int simulated_workers; // Of active_workers
+
+static GSList* barriers; // of Barrier* not yet reached
+static GSList* reached_barriers; // of Barrier* to reply to
+static GSList* barrier_scope; // Paths given by SCOPE commands for the next BARRIER
+
+// The SIGCHLD handler writes a byte here to wake up poll().
+static int sigchld_pipe[2];
+
+// Rebuilt for each poll(). Entries 0, 1 and 2 are input_fd,
+// the SIGCHLD pipe and our wake pipe. The rest are worker outputs.
+static struct pollfd* pollfds;
+static WorkUnit** pollfd_units;
+static int pollfds_count;
+static int pollfds_capacity;
 
-static sigset_t sigchld_set;
+// Appended to with the hashes of succeeded jobs, or -1.
+static int dedup_fd;
+
+// Where workers are pinned, in shared->placement_load order. Empty if they aren't.
+static CpuSet** placements;
+static int* placement_nodes; // NUMA node of each placement, or -1
+static int num_placements;
+
+// Files of jobs that succeeded, to be deleted or moved together after reaping.
+static GQueue finished_files;
+static bool finish_actions; // Whether files are deleted or moved at all
+static int move_dir_fd; // Where to move them, or -1 to delete them
+
+// The command template, compiled at startup, and a buffer to expand it into.
+static CommandTemplate* command_template;
+static GString* command_buf;
 
 /*
- * Calls wait_away_finished_workers() and start_queued_work().
+ * Wakes up the main loop, which waits away finished workers.
  */
 static void handle_sigchld(int signum);
 static void register_sigchld_handler();
 
-static int process_input();
+static int process_input(); // returns 0 if the pipe from the parent was closed
 static void handle_incoming_command(const char* buf);
+static bool parse_job_attributes(WorkUnit* unit, const char* attrs); // returns false if stdin was lost
 static int take_from_readbuf(GByteArray* buf); // returns 1 if encountered '\0'
+static void cancel_jobs(const char* path);
+static void cancel_work_unit(WorkUnit* unit);
+static void start_barrier(long long id);
+static void add_barrier(WorkUnit* unit, Barrier* barrier);
+static gboolean traverse_add_barrier(gpointer key, gpointer value, gpointer barrier);
+static bool in_barrier_scope(const char* path);
+static void settle_barriers(WorkUnit* unit);
+static void barrier_reached(Barrier* barrier);
+static void reply_to_barriers();
 
 static void wait_away_finished_workers();
+static void finish_files();
 static bool wait_away_worker(bool nohang);
-static void start_queued_work(bool nodelay);
-static void start_worker(WorkUnit* unit);
-static gchar* make_command(const char* file_path);
+static void finish_simulated_workers();
+static void worker_exited(WorkUnit* unit, int code);
+static bool stream_cut(WorkUnit* unit);
+static void drain_cut_stream(WorkUnit* unit);
+static void start_queued_work();
+static bool start_worker(WorkUnit* unit);
+static bool start_simulated_worker(WorkUnit* unit);
+static void worker_started(WorkUnit* unit, pid_t pid);
+static bool worker_slot_free(long long bytes);
+static bool acquire_worker_slot(bool force, long long bytes);
+static long long take_start_token(); // returns microseconds to wait if none is available
+static long long now_us();
+static void release_worker_slot(long long bytes);
+static long long budget_bytes(const WorkUnit* unit);
+static bool fits_byte_budget(long long running, long long bytes);
+static gchar* shard_file_name(const char* path);
+static void init_placements();
+static void add_placement(CpuSet* set, int node);
+static int choose_placement(const WorkUnit* unit);
 
+static int wait_for_events(); // returns like poll()
+static int poll_events(int timeout_ms);
+static long long next_timer_us(); // -1 if nothing is to happen without input
+static bool has_deadline(const WorkUnit* unit);
+static void enforce_timeouts();
+static void signal_worker(WorkUnit* unit, int signum);
+static void drain_worker_output(WorkUnit* unit);
+static void finish_worker_output(WorkUnit* unit, bool keep_log);
+
+static void add_work_unit(WorkUnit* unit);
+static void queue_work_unit(WorkUnit* unit);
+static long long estimate_run_us(const WorkUnit* unit);
+static void learn_run_time(const WorkUnit* unit, long long duration_us);
+static void retire_work_unit(WorkUnit* unit, bool succeeded);
+static void index_work_unit(WorkUnit* unit);
+static void unindex_work_unit(WorkUnit* unit);
+static void release_order_key(WorkUnit* unit);
+static void release_claim(WorkUnit* unit);
+static void close_stdin(WorkUnit* unit);
 static void free_work_unit(gpointer unit);
+static void free_key_queue(gpointer queue);
 static gint compare_work_unit(gconstpointer a, gconstpointer b, gpointer data);
+static gint compare_due_time(gconstpointer a, gconstpointer b, gpointer data);
+static WorkUnit* first_work_unit(GTree* queue);
 static gboolean traverse_get_first_key(gpointer key, gpointer value, gpointer dest);
-static bool wait_for_sigchld(long ms_to_wait);
 
 
-void jobqueue_process_main(JobQueueSettings* settings_, int input_fd_, int output_fd_) {
+void jobqueue_process_main(JobQueueSettings* settings_, int input_fd_, int output_fd_,
+                           JobQueueShared* shared_, int shard_, const int* wake_fds_) {
     settings = settings_;
+    shared = shared_;
+    shard_index = shard_;
+    wake_fds = wake_fds_;
+
+    // Other shards' wake pipes are only written to.
+    for (int i = 0; i < shared->num_shards; ++i) {
+        if (i != shard_index) {
+            close(wake_fds[2 * i]);
+        }
+    }
+
+    init_placements();
 
     input_fd = input_fd_;
     output_fd = output_fd_;
     readbuf_capacity = 4096;
     readbuf_size = 0;
     readbuf = alloca(readbuf_capacity);
+    g_queue_init(&received_fds);
+    cmdbuf = g_byte_array_new();
+
+    // Workers shouldn't inherit these
+    fcntl(input_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(output_fd, F_SETFD, FD_CLOEXEC);
 
-    workers_started_ever = 0;
-    workers_waited_ever = 0;
+    units_created_ever = 0;
     active_workers = 0;
     active_work_units = g_hash_table_new_full(&g_direct_hash,
                                               &g_direct_equal,
@@ -112,120 +283,330 @@ void jobqueue_process_main(JobQueueSettings* settings_, int input_fd_, int outpu
                                  NULL,
                                  NULL,
                                  &free_work_unit);
+    delayed_queue = g_tree_new_full(&compare_due_time,
+                                    NULL,
+                                    NULL,
+                                    &free_work_unit);
+    key_queues = g_hash_table_new_full(&g_str_hash,
+                                       &g_str_equal,
+                                       &g_free,
+                                       &free_key_queue);
+    units_by_path = g_hash_table_new_full(&g_str_hash,
+                                          &g_str_equal,
+                                          &g_free,
+                                          (GDestroyNotify)&g_queue_free);
 
-    sigemptyset(&sigchld_set);
-    sigaddset(&sigchld_set, SIGCHLD);
+    throttled_until_us = 0;
+    us_per_byte = 0;
+    us_per_run = 0;
+    virtual_clock = settings->simulation && settings->simulation->virtual_clock;
+    virtual_now_us = 0;
+    last_simulated_pid = -1;
+    simulated_workers = 0;
+    barriers = NULL;
+    reached_barriers = NULL;
+    barrier_scope = NULL;
+    cut_streams = NULL;
 
-    register_sigchld_handler();
+    pollfds_count = 0;
+    pollfds_capacity = 16;
+    pollfds = g_malloc(pollfds_capacity * sizeof(struct pollfd));
+    pollfd_units = g_malloc(pollfds_capacity * sizeof(WorkUnit*));
 
-    while (1) {
-        if (!process_input()) {
-            break;
+    gchar* trace_file = shard_file_name(settings->trace_file);
+    if (trace_file && !trace_open(trace_file)) {
+        fprintf(stderr, "Failed to open trace file %s\n", trace_file);
+    }
+    g_free(trace_file);
+    gchar* record_path = shard_file_name(settings->record_file);
+    if (record_path && !record_open(record_path)) {
+        fprintf(stderr, "Failed to open record %s\n", record_path);
+    }
+    g_free(record_path);
+    gchar* job_log_file = shard_file_name(settings->job_log_file);
+    if (!joblog_init(settings->job_log_dir, job_log_file, settings->job_log_max_bytes)) {
+        joblog_shutdown(); // Let workers write to our stdout/stderr instead
+    }
+    g_free(job_log_file);
+    g_queue_init(&finished_files);
+    finish_actions = settings->delete_on_finish;
+    move_dir_fd = -1;
+    if (settings->move_on_finish_dir) {
+        move_dir_fd = open(settings->move_on_finish_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (move_dir_fd == -1) {
+            fprintf(stderr, "Failed to open %s: %s\n", settings->move_on_finish_dir, strerror(errno));
+        } else {
+            finish_actions = true;
+        }
+    }
+    command_template = template_compile(settings->cmd_template, settings->source_dir);
+    command_buf = g_string_sized_new(256);
+    dedup_fd = -1;
+    if (settings->dedup_index) {
+        dedup_fd = dedup_open_for_append(settings->dedup_index);
+        if (dedup_fd == -1) {
+            fprintf(stderr, "Failed to open dedup index %s\n", settings->dedup_index);
         }
+    }
+
+    if (pipe(sigchld_pipe) == -1) {
+        DPRINTF("Failed to create SIGCHLD pipe: %d", errno);
+        abort();
+    }
+    for (int i = 0; i < 2; ++i) {
+        fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    register_sigchld_handler();
 
-        sigprocmask(SIG_BLOCK, &sigchld_set, NULL);
+#ifdef PR_SET_CHILD_SUBREAPER
+    // Orphaned grandchildren of workers are reparented to us instead of init,
+    // so they are reaped (and ignored) by wait_away_worker().
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+#endif
 
-        if (g_tree_nnodes(work_queue) > 0) {
-            if (active_workers < settings->max_workers) {
-                start_queued_work(true);
+    bool input_open = true;
+    while (input_open) {
+        wait_away_finished_workers();
+        enforce_timeouts();
+        reply_to_barriers();
+        start_queued_work();
+
+        if (wait_for_events() <= 0) {
+            continue; // Timeout, SIGCHLD or error
+        }
+
+        for (int i = 0; i < pollfds_count; ++i) {
+            if (pollfds[i].revents == 0) {
+                continue;
+            }
+            if (pollfd_units[i] && pollfd_units[i]->worker_pid == -1) {
+                drain_cut_stream(pollfd_units[i]);
+            } else if (pollfd_units[i]) {
+                drain_worker_output(pollfd_units[i]);
+            } else if (pollfds[i].fd == sigchld_pipe[0] || pollfds[i].fd == wake_fds[2 * shard_index]) {
+                char buf[64];
+                while (read(pollfds[i].fd, buf, sizeof(buf)) > 0) {
+                }
             } else {
-                DPRINT("No more worker slots - work is left queued");
+                if (!process_input()) {
+                    input_open = false;
+                }
+                // Commands may have retired the units polled for. They're polled again.
+                break;
             }
         }
-
-        sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
     }
 
     // Live children will be inherited by the init process
-    sigprocmask(SIG_BLOCK, &sigchld_set, NULL);
+    signal(SIGCHLD, SIG_DFL);
 
     DPRINT("Job queue process cleaning up");
+    trace_close();
+    record_close();
+    joblog_shutdown();
+    if (dedup_fd != -1) {
+        close(dedup_fd);
+    }
+    finish_files();
+    if (move_dir_fd != -1) {
+        close(move_dir_fd);
+    }
+    template_free(command_template);
+    g_string_free(command_buf, true);
     g_tree_destroy(work_queue);
+    g_tree_destroy(delayed_queue);
+    g_slist_free_full(cut_streams, &free_work_unit);
+    g_hash_table_destroy(key_queues);
+    g_hash_table_destroy(units_by_path);
+    g_slist_free_full(barriers, &g_free);
+    g_slist_free_full(reached_barriers, &g_free);
+    g_slist_free_full(barrier_scope, &g_free);
     g_hash_table_destroy(active_work_units);
+    g_byte_array_free(cmdbuf, true);
+    while (!g_queue_is_empty(&received_fds)) {
+        close(GPOINTER_TO_INT(g_queue_pop_head(&received_fds)));
+    }
+    for (int i = 0; i < num_placements; ++i) {
+        cpuset_free(placements[i]);
+    }
+    g_free(placements);
+    g_free(placement_nodes);
+    g_free(pollfds);
+    g_free(pollfd_units);
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
     close(input_fd);
+    for (int i = 0; i < shared->num_shards; ++i) {
+        if (i == shard_index) {
+            close(wake_fds[2 * i]);
+        }
+        close(wake_fds[2 * i + 1]);
+    }
 }
 
 static void handle_sigchld(int signum) {
     (void)signum;
-    wait_away_finished_workers();
-    start_queued_work(true);
+    int saved_errno = errno;
+    if (write(sigchld_pipe[1], "", 1) == -1) {
+        // Pipe is full so the main loop will wake up anyway
+    }
+    errno = saved_errno;
 }
 
 static void register_sigchld_handler() {
     struct sigaction sa;
     sa.sa_handler = &handle_sigchld;
     sa.sa_flags = SA_NOCLDSTOP | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
     sigaction(SIGCHLD, &sa, NULL);
 }
 
 static int process_input() {
-    GByteArray* buf = g_byte_array_new();
+    DPRINT("Buffering input from parent process");
+    int fds[16];
+    int num_fds;
+    ssize_t ret = recv_with_fds(input_fd, readbuf, readbuf_capacity, fds, 16, &num_fds);
+    DPRINTF("read() from parent process returned %d bytes", (int)ret);
+    for (int i = 0; i < num_fds; ++i) {
+        g_queue_push_tail(&received_fds, GINT_TO_POINTER(fds[i]));
+    }
+    if (num_fds == -1) {
+        // Fails the job the descriptor came with
+        g_queue_push_tail(&received_fds, GINT_TO_POINTER(-1));
+    }
+    if (ret == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return 1;
+    } else if (ret == -1 || ret == 0) { // error or eof
+        DPRINT("Pipe from parent process was closed");
+        readbuf_size = 0;
+        return 0;
+    }
+    readbuf_size = ret;
 
-    DPRINT("Reading work unit from parent process");
-    while (1) {
-        if (take_from_readbuf(buf)) {
-            // If we go here, we found the null byte that separates commands.
+    while (readbuf_size > 0) {
+        if (take_from_readbuf(cmdbuf)) {
+            // Found the null byte that separates commands.
             // Some data may have been left in readbuf.
-            break;
-        }
-        assert(readbuf_size == 0);
-
-        DPRINT("Buffering input from parent process");
-        ssize_t ret = read(input_fd, readbuf, readbuf_capacity);
-        DPRINTF("read() from parent process returned %d bytes", ret);
-        if (ret == -1 || ret == 0) { // error or eof
-            DPRINT("Pipe from parent process was closed");
-            readbuf_size = 0;
-            return 0;
-        } else {
-            readbuf_size = ret;
+            handle_incoming_command((const char*)cmdbuf->data);
+            g_byte_array_set_size(cmdbuf, 0);
         }
     }
 
-    handle_incoming_command((const char*)buf->data);
-    g_byte_array_free(buf, true);
-
     return 1;
 }
 
 static void handle_incoming_command(const char* buf) {
     DPRINTF("Received command: '%s'", buf);
+    TRACE_PROBE1(command, buf);
 
-    sigset_t oldmask;
-    sigprocmask(SIG_BLOCK, &sigchld_set, &oldmask);
-    
     if (g_str_has_prefix(buf, "EXEC ")) {
+        // EXEC <comma-separated attributes or -> <path>
+        const char* attrs = buf + strlen("EXEC ");
+        const char* path = strchr(attrs, ' ');
+        if (!path) {
+            DPRINT("Malformed EXEC command");
+            return;
+        }
+
         WorkUnit* unit = g_malloc(sizeof(WorkUnit));
-        unit->path = g_strdup(buf + strlen("EXEC "));
+        // Unique across shards
+        unit->id = units_created_ever++ * shared->num_shards + shard_index;
+        unit->path = g_strdup(path + 1);
+        unit->bytes = -1;
+        unit->hash = NULL;
+        unit->stdin_fd = -1;
+        unit->order_key = NULL;
+        unit->numa_node = -1;
+        unit->placement = -1;
+        unit->barriers = NULL;
+        unit->done = false;
+        gchar* attrs_copy = g_strndup(attrs, path - attrs);
+        bool stdin_ok = parse_job_attributes(unit, attrs_copy);
+        g_free(attrs_copy);
+        struct stat st;
+        unit->stdin_once = unit->stdin_fd != -1 && fstat(unit->stdin_fd, &st) == 0 && S_ISFIFO(st.st_mode);
         unit->worker_pid = -1;
-        gettimeofday(&unit->next_execution_time, NULL);
+        unit->next_execution_us = now_us();
         unit->attempts = 0;
         unit->last_exit_code = -1;
-        g_tree_insert(work_queue, unit, unit);
-    } else if (g_str_equal(buf, "FLUSH")) {
-        DPRINT("Handling FLUSH command");
-        
-        long long terminations_expected = workers_started_ever + g_tree_nnodes(work_queue);
-        while (workers_waited_ever < terminations_expected) {
-            if (active_workers == 0) {
-                start_queued_work(false);
+        unit->run_start_us = 0;
+        unit->trace_start_us = 0;
+        unit->simulated_end_us = 0;
+        unit->simulated_exit_code = 0;
+        unit->output_fd = -1;
+        unit->log = NULL;
+        unit->term_sent = false;
+        unit->kill_sent = false;
+        unit->canceled = false;
+        if (unit->done) {
+            DPRINTF("Finishing without a run: %s", unit->path);
+            index_work_unit(unit);
+            retire_work_unit(unit, true);
+            return;
+        }
+        trace_job_begin(unit->id, unit->path);
+        record_enqueue(unit->id, unit->bytes, unit->path);
+        index_work_unit(unit);
+        if (!stdin_ok) {
+            // Running it without its stdin would give the command the wrong input.
+            fprintf(stderr, "Job queue lost the stdin of %s, probably to the file descriptor limit. Skipping it.\n",
+                    unit->path);
+            __sync_fetch_and_sub(&shared->shards[shard_index].stdin_fds, 1);
+            if (unit->bytes > 0) {
+                __sync_fetch_and_sub(&shared->shards[shard_index].stdin_bytes, unit->bytes);
             }
-            DPRINTF("QUEUED: %d   ACTIVE: %d   EVER:  %lld / %lld",
-                    g_tree_nnodes(work_queue), active_workers,
-                    workers_waited_ever, workers_started_ever);
-            DPRINT("Waiting for SIGCHLD");
-            sigsuspend(&oldmask);
-            // start_queued_work() is called by SIGCHLD handler automatically
+            record_cancel(unit->id);
+            trace_job_end(unit->id, "canceled");
+            retire_work_unit(unit, false);
+            return;
         }
+        add_work_unit(unit);
+    } else if (g_str_has_prefix(buf, "CANCEL ")) {
+        // CANCEL <path>, for jobs whose file was deleted or replaced
+        cancel_jobs(buf + strlen("CANCEL "));
+    } else if (g_str_has_prefix(buf, "SCOPE ")) {
+        // SCOPE <path>, limiting the next BARRIER to path and anything under it
+        barrier_scope = g_slist_prepend(barrier_scope, g_strdup(buf + strlen("SCOPE ")));
+    } else if (g_str_has_prefix(buf, "BARRIER ")) {
+        // BARRIER <id>, answered with DONE <id>
+        start_barrier(g_ascii_strtoll(buf + strlen("BARRIER "), NULL, 10));
+        g_slist_free_full(barrier_scope, &g_free);
+        barrier_scope = NULL;
+    }
+}
 
-        while (true) {
-            if (write(output_fd, "1", 1) == 1) {
-                break;
+static bool parse_job_attributes(WorkUnit* unit, const char* attrs) {
+    if (g_str_equal(attrs, "-")) {
+        return true;
+    }
+    bool stdin_ok = true;
+    gchar** parts = g_strsplit(attrs, ",", 0);
+    for (gchar** part = parts; *part; ++part) {
+        if (g_str_has_prefix(*part, "bytes=")) {
+            unit->bytes = g_ascii_strtoll(*part + strlen("bytes="), NULL, 10);
+        } else if (g_str_has_prefix(*part, "hash=") && strlen(*part) == strlen("hash=") + HASH_HEX_LEN) {
+            g_free(unit->hash);
+            unit->hash = g_strdup(*part + strlen("hash="));
+        } else if (g_str_equal(*part, "stdin")) {
+            if (!g_queue_is_empty(&received_fds)) {
+                unit->stdin_fd = GPOINTER_TO_INT(g_queue_pop_head(&received_fds));
             }
+            stdin_ok = unit->stdin_fd != -1;
+        } else if (g_str_equal(*part, "done")) {
+            unit->done = true;
+        } else if (g_str_has_prefix(*part, "key=")) {
+            g_free(unit->order_key);
+            unit->order_key = g_strdup(*part + strlen("key="));
+        } else if (g_str_has_prefix(*part, "node=")) {
+            unit->numa_node = atoi(*part + strlen("node="));
+        } else {
+            DPRINTF("Unknown job attribute: %s", *part);
         }
     }
-    
-    sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
+    g_strfreev(parts);
+    return stdin_ok;
 }
 
 static int take_from_readbuf(GByteArray* buf) {
@@ -246,111 +627,1023 @@ static int take_from_readbuf(GByteArray* buf) {
     return false;
 }
 
+// Cancels every unfinished unit of the path, queued or running.
+static void cancel_jobs(const char* path) {
+    // Copied since canceling removes units from it.
+    GQueue* units = g_hash_table_lookup(units_by_path, path);
+    if (!units) {
+        return;
+    }
+    units = g_queue_copy(units);
+    for (GList* item = units->head; item; item = item->next) {
+        cancel_work_unit(item->data);
+    }
+    g_queue_free(units);
+}
+
+static void cancel_work_unit(WorkUnit* unit) {
+    DPRINTF("Canceling work unit: %s", unit->path);
+    TRACE_PROBE2(job_cancel, unit->id, unit->path);
+    if (!unit->canceled) {
+        record_cancel(unit->id);
+    }
+    if (unit->worker_pid != -1) {
+        // Retired by worker_exited() once it stops.
+        if (!unit->canceled && !unit->term_sent) {
+            signal_worker(unit, SIGTERM);
+            unit->term_sent = true;
+            unit->deadline_us = now_us() + settings->kill_grace_ms * 1000LL;
+        }
+        unit->canceled = true;
+        return;
+    }
+
+    // A cut stream's unit is in no queue and still holds its key.
+    cut_streams = g_slist_remove(cut_streams, unit);
+    GQueue* followers = unit->order_key ? g_hash_table_lookup(key_queues, unit->order_key) : NULL;
+    if (followers && g_queue_remove(followers, unit)) {
+        // Waiting behind another job with its key, which it doesn't hold
+    } else {
+        if (!g_tree_steal(work_queue, unit)) {
+            g_tree_steal(delayed_queue, unit);
+        }
+        release_order_key(unit);
+    }
+    // It won't run, which is as good as having run for a barrier.
+    settle_barriers(unit);
+    trace_job_end(unit->id, "canceled");
+    retire_work_unit(unit, false);
+}
+
+/*
+ * A barrier is attached to every unit in its scope, wherever the unit is,
+ * and counts them down as they run. Replies can come in any order, so
+ * the parent can wait for several barriers at once.
+ */
+static void start_barrier(long long id) {
+    DPRINTF("Starting barrier %lld", id);
+    Barrier* barrier = g_malloc(sizeof(Barrier));
+    barrier->id = id;
+    barrier->remaining = 0;
+    barriers = g_slist_prepend(barriers, barrier);
+
+    g_tree_foreach(work_queue, &traverse_add_barrier, barrier);
+    g_tree_foreach(delayed_queue, &traverse_add_barrier, barrier);
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, active_work_units);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        add_barrier(value, barrier);
+    }
+    g_hash_table_iter_init(&iter, key_queues);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        for (GList* item = ((GQueue*)value)->head; item; item = item->next) {
+            add_barrier(item->data, barrier);
+        }
+    }
+    for (GSList* item = cut_streams; item; item = item->next) {
+        add_barrier(item->data, barrier);
+    }
+
+    if (barrier->remaining == 0) {
+        barrier_reached(barrier);
+    }
+}
+
+static void add_barrier(WorkUnit* unit, Barrier* barrier) {
+    if (barrier_scope && !in_barrier_scope(unit->path)) {
+        return;
+    }
+    unit->barriers = g_slist_prepend(unit->barriers, barrier);
+    barrier->remaining++;
+}
+
+static gboolean traverse_add_barrier(gpointer key, gpointer value, gpointer barrier) {
+    (void)value;
+    add_barrier(key, barrier);
+    return FALSE;
+}
+
+static bool in_barrier_scope(const char* path) {
+    for (GSList* item = barrier_scope; item; item = item->next) {
+        const char* scope = item->data;
+        size_t len = strlen(scope);
+        if (strncmp(path, scope, len) == 0 &&
+                (path[len] == '\0' || path[len] == '/' || (len > 0 && scope[len - 1] == '/'))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Called when a unit has run, or can't run until a failed one is retried.
+static void settle_barriers(WorkUnit* unit) {
+    for (GSList* item = unit->barriers; item; item = item->next) {
+        Barrier* barrier = item->data;
+        if (--barrier->remaining == 0) {
+            barrier_reached(barrier);
+        }
+    }
+    g_slist_free(unit->barriers);
+    unit->barriers = NULL;
+}
+
+static void barrier_reached(Barrier* barrier) {
+    DPRINTF("Barrier %lld reached", barrier->id);
+    barriers = g_slist_remove(barriers, barrier);
+    reached_barriers = g_slist_prepend(reached_barriers, barrier);
+}
+
+// Done after finished workers are waited away so that their results are in.
+static void reply_to_barriers() {
+    if (!reached_barriers) {
+        return;
+    }
+    trace_flush();
+    record_flush();
+    for (GSList* item = reached_barriers; item; item = item->next) {
+        Barrier* barrier = item->data;
+        char reply[32];
+        size_t len = snprintf(reply, sizeof(reply), "DONE %lld", barrier->id) + 1;
+        // Written atomically since it's shorter than PIPE_BUF.
+        while (write(output_fd, reply, len) == -1 && errno == EINTR) {
+        }
+    }
+    g_slist_free_full(reached_barriers, &g_free);
+    reached_barriers = NULL;
+}
+
 static void wait_away_finished_workers() {
     int ret;
     do {
         ret = wait_away_worker(true);
     } while (ret > 0);
+    finish_simulated_workers();
+    finish_files();
+}
+
+static void finish_files() {
+    while (!g_queue_is_empty(&finished_files)) {
+        gchar* path = g_queue_pop_head(&finished_files);
+        if (move_dir_fd != -1) {
+            if (renameat(AT_FDCWD, path, move_dir_fd, my_basename(path)) == -1) {
+                DPRINTF("Failed to move %s: %d", path, errno);
+            }
+        } else if (unlink(path) == -1 && errno != ENOENT) {
+            DPRINTF("Failed to delete %s: %d", path, errno);
+        }
+        g_free(path);
+    }
 }
 
 static bool wait_away_worker(bool nohang) {
     int status;
 
-    bool ret = false;
     pid_t pid = waitpid(-1, &status, nohang ? WNOHANG : 0);
-    if (pid > 0) {
-        gpointer key = GINT_TO_POINTER(pid);
-        WorkUnit* unit = g_hash_table_lookup(active_work_units, key);
-        g_hash_table_steal(active_work_units, key);
-        active_workers--;
-        workers_waited_ever++;
-
-        int code = wait_status_to_code(status);
-        if (code == 0) {
-            DPRINTF("Work unit finished successfully: %s", unit->path);
-            // Could move or delete the file or something
-            free_work_unit(unit);
-        } else {
-            DPRINTF("Work unit failed: %s (%d)", unit->path, code);
-            unit->attempts++;
-            unit->last_exit_code = code;
-            gettimeofday(&unit->next_execution_time, NULL);
-            timeval_add_ms(&unit->next_execution_time, settings->retry_wait_ms);
-            g_tree_insert(work_queue, unit, unit);
+    if (pid <= 0) {
+        return false;
+    }
+    WorkUnit* unit = g_hash_table_lookup(active_work_units, GINT_TO_POINTER(pid));
+    if (!unit) {
+        DPRINTF("Waited away unknown child %d", (int)pid);
+        return true;
+    }
+    worker_exited(unit, wait_status_to_code(status));
+    return true;
+}
+
+// Ends the simulated runs that are due, earliest first so that results don't depend on hashing.
+static void finish_simulated_workers() {
+    while (simulated_workers > 0) {
+        WorkUnit* first = NULL;
+        GHashTableIter iter;
+        gpointer value;
+        g_hash_table_iter_init(&iter, active_work_units);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            WorkUnit* unit = value;
+            if (unit->worker_pid < -1 && unit->simulated_end_us <= now_us() &&
+                    (!first || unit->simulated_end_us < first->simulated_end_us ||
+                     (unit->simulated_end_us == first->simulated_end_us && unit->id < first->id))) {
+                first = unit;
+            }
         }
+        if (!first) {
+            break;
+        }
+        worker_exited(first, first->simulated_exit_code);
+    }
+}
 
-        ret = true;
+static void worker_exited(WorkUnit* unit, int code) {
+    pid_t pid = unit->worker_pid;
+    g_hash_table_steal(active_work_units, GINT_TO_POINTER(pid));
+    active_workers--;
+    if (pid < -1) {
+        simulated_workers--;
+    }
+    release_worker_slot(budget_bytes(unit));
+    if (unit->placement != -1) {
+        __sync_fetch_and_sub(&shared->placement_load[unit->placement], 1);
+        unit->placement = -1;
     }
 
-    return ret;
+    bool timed_out = unit->term_sent;
+    if (timed_out) {
+        // Take down anything the worker left behind in its process group.
+        signal_worker(unit, SIGKILL);
+    }
+    unit->worker_pid = -1;
+    TRACE_PROBE4(job_exit, unit->id, pid, code, unit->path);
+    trace_job_run(unit->id, pid, unit->trace_start_us, code);
+    if (!unit->canceled && stream_cut(unit)) {
+        // The file isn't complete, so this wasn't a run of its job at all.
+        DPRINTF("Worker exited before the end of its stream: %s", unit->path);
+        finish_worker_output(unit, code != 0 || timed_out);
+        cut_streams = g_slist_prepend(cut_streams, unit);
+        return;
+    }
+    if (unit->stdin_once) {
+        // Retries read the file.
+        close_stdin(unit);
+        unit->stdin_once = false;
+    }
+    settle_barriers(unit);
+    long long duration_us = now_us() - unit->run_start_us;
+    record_run(unit->id, duration_us, timed_out && code == 0 ? -1 : code);
+    finish_worker_output(unit, !unit->canceled && (code != 0 || timed_out));
+    if (unit->canceled) {
+        DPRINTF("Canceled work unit stopped: %s", unit->path);
+        trace_job_end(unit->id, "canceled");
+        release_order_key(unit);
+        retire_work_unit(unit, false);
+    } else if (code == 0 && !timed_out) {
+        DPRINTF("Work unit finished successfully: %s", unit->path);
+        trace_job_end(unit->id, "success");
+        learn_run_time(unit, duration_us);
+        if (unit->hash && dedup_fd != -1) {
+            dedup_record(dedup_fd, unit->hash);
+        }
+        release_order_key(unit);
+        retire_work_unit(unit, true);
+    } else {
+        DPRINTF("Work unit failed: %s (%d%s)", unit->path, code, timed_out ? ", timed out" : "");
+        // Jobs behind it with the same key can't run before it succeeds.
+        GQueue* followers = unit->order_key ? g_hash_table_lookup(key_queues, unit->order_key) : NULL;
+        if (followers) {
+            for (GList* item = followers->head; item; item = item->next) {
+                settle_barriers(item->data);
+            }
+        }
+        unit->attempts++;
+        unit->last_exit_code = code;
+        unit->next_execution_us = now_us() + settings->retry_wait_ms * 1000LL;
+        TRACE_PROBE4(job_retry, unit->id, unit->attempts, settings->retry_wait_ms, unit->path);
+        trace_job_instant(unit->id, "retry", unit->attempts);
+        queue_work_unit(unit);
+    }
 }
 
-static void start_queued_work(bool wait) {
-    WorkUnit* unit = NULL;
-    g_tree_foreach(work_queue, &traverse_get_first_key, &unit);
-    if (unit) {
-        bool can_execute = true;
-        if (wait) {
-            long ms_to_wait = ms_to_timeval(&unit->next_execution_time);
-            if (ms_to_wait > 0) {
-                can_execute = !wait_for_sigchld(ms_to_wait);
+// Whether a unit's stdin pipe was still open for writing when its worker exited.
+static bool stream_cut(WorkUnit* unit) {
+    if (!unit->stdin_once) {
+        return false;
+    }
+    // A pipe without writers reports POLLHUP.
+    struct pollfd pfd = { .fd = unit->stdin_fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) >= 0 && !(pfd.revents & POLLHUP);
+}
+
+// Discards what's written to a cut stream so the writer isn't held up,
+// and queues the job again once the file is closed.
+static void drain_cut_stream(WorkUnit* unit) {
+    char buf[4096];
+    ssize_t ret = read(unit->stdin_fd, buf, sizeof(buf));
+    if (ret > 0 || (ret == -1 && errno == EINTR)) {
+        return;
+    }
+    DPRINTF("Stream ended, queuing its job again: %s", unit->path);
+    cut_streams = g_slist_remove(cut_streams, unit);
+    close_stdin(unit);
+    unit->stdin_once = false;
+    unit->next_execution_us = now_us();
+    queue_work_unit(unit);
+}
+
+static void start_queued_work() {
+    // Units that came due take their place among the others.
+    WorkUnit* unit;
+    while ((unit = first_work_unit(delayed_queue)) && unit->next_execution_us <= now_us()) {
+        g_tree_steal(delayed_queue, unit);
+        queue_work_unit(unit);
+    }
+
+    while (true) {
+        // A pending barrier runs jobs one at a time even if they're not due
+        // or there are no worker slots, so that it is guaranteed to be reached.
+        // This may exceed max_workers by one per shard.
+        bool forced = barriers != NULL && active_workers == 0;
+        GTree* queue = work_queue;
+        unit = first_work_unit(work_queue);
+        if (!unit && forced) {
+            queue = delayed_queue;
+            unit = first_work_unit(delayed_queue);
+        }
+        if (!unit) {
+            break;
+        }
+        if (throttled_until_us > now_us()) {
+            break;
+        }
+        if (!acquire_worker_slot(forced, budget_bytes(unit))) {
+            DPRINT("No more worker slots or bytes - work is left queued");
+            break;
+        }
+        long long wait_us = take_start_token();
+        if (wait_us > 0) {
+            DPRINTF("Start rate limit reached - waiting %lld us", wait_us);
+            release_worker_slot(budget_bytes(unit));
+            throttled_until_us = now_us() + wait_us;
+            break;
+        }
+
+        g_tree_steal(queue, unit);
+        if (!start_worker(unit)) {
+            release_worker_slot(budget_bytes(unit));
+            break;
+        }
+    }
+}
+
+/*
+ * The worker slots are shared by all shards. A shard that finds them all
+ * taken sets its waiting_for_slot flag and is sent a byte on its wake pipe
+ * by the next shard to free one. Meanwhile, the other shards' jobs take
+ * up its share of the slots, and vice versa.
+ *
+ * The byte budget is shared the same way. A job needs a slot and room
+ * for the size of its file.
+ */
+static bool worker_slot_free(long long bytes) {
+    if (shared->active_workers < shared->max_workers && fits_byte_budget(shared->running_bytes, bytes)) {
+        return true;
+    }
+    shared->shards[shard_index].waiting_for_slot = 1;
+    __sync_synchronize();
+    // A slot may have been freed before the flag was seen.
+    return shared->active_workers < shared->max_workers && fits_byte_budget(shared->running_bytes, bytes);
+}
+
+static bool acquire_worker_slot(bool force, long long bytes) {
+    while (true) {
+        int active = shared->active_workers;
+        if (!force && active >= shared->max_workers) {
+            if (!worker_slot_free(bytes)) {
+                return false;
+            }
+            continue;
+        }
+        if (__sync_bool_compare_and_swap(&shared->active_workers, active, active + 1)) {
+            break;
+        }
+    }
+    while (true) {
+        // Unlike the worker limit, this holds for forced starts too:
+        // with bytes in use, a job is running and will make room.
+        long long running = shared->running_bytes;
+        if (!fits_byte_budget(running, bytes)) {
+            if (!worker_slot_free(bytes)) {
+                // Nor do others need waking. That job wakes them when it exits.
+                __sync_fetch_and_sub(&shared->active_workers, 1);
+                return false;
+            }
+            continue;
+        }
+        if (__sync_bool_compare_and_swap(&shared->running_bytes, running, running + bytes)) {
+            return true;
+        }
+    }
+}
+
+static long long budget_bytes(const WorkUnit* unit) {
+    return unit->bytes > 0 ? unit->bytes : 0;
+}
+
+// A job bigger than the whole budget may still run alone.
+static bool fits_byte_budget(long long running, long long bytes) {
+    return shared->max_running_bytes <= 0 || running == 0 || running + bytes <= shared->max_running_bytes;
+}
+
+/*
+ * The token bucket is kept as the time the next start would be due at
+ * the steady rate, as in GCRA. A start is allowed if that's no more than
+ * the burst's worth of intervals in the future, and pushes the time on
+ * by one interval. This takes one compare-and-swap and no refill timer.
+ */
+static long long take_start_token() {
+    if (shared->start_interval_us <= 0) {
+        return 0;
+    }
+    while (true) {
+        long long now = now_us();
+        long long next = shared->next_start_us;
+        long long due = next > now ? next : now;
+        long long wait_us = due - shared->start_tolerance_us - now;
+        if (wait_us > 0) {
+            return wait_us;
+        }
+        if (__sync_bool_compare_and_swap(&shared->next_start_us, next, due + shared->start_interval_us)) {
+            return 0;
+        }
+    }
+}
+
+// The scheduler's clock. Only differences between its times mean anything.
+static long long now_us() {
+    if (virtual_clock) {
+        return virtual_now_us;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void release_worker_slot(long long bytes) {
+    __sync_fetch_and_sub(&shared->running_bytes, bytes);
+    __sync_fetch_and_sub(&shared->active_workers, 1);
+    for (int i = 0; i < shared->num_shards; ++i) {
+        JobQueueShardState* state = &shared->shards[i];
+        if (i != shard_index && state->waiting_for_slot &&
+                __sync_bool_compare_and_swap(&state->waiting_for_slot, 1, 0)) {
+            if (write(wake_fds[2 * i + 1], "", 1) == -1) {
+                // Pipe is full so the shard will wake up anyway
+            }
+        }
+    }
+}
+
+/* With several shards, each one gets its own file with the shard number appended. */
+static gchar* shard_file_name(const char* path) {
+    if (!path) {
+        return NULL;
+    } else if (shared->num_shards == 1) {
+        return g_strdup(path);
+    } else {
+        return g_strdup_printf("%s.%d", path, shard_index);
+    }
+}
+
+static void init_placements() {
+    placements = g_malloc(JOBQUEUE_MAX_PLACEMENTS * sizeof(CpuSet*));
+    placement_nodes = g_malloc(JOBQUEUE_MAX_PLACEMENTS * sizeof(int));
+    num_placements = 0;
+    if (!settings->queue_cpus && !settings->worker_cpus && settings->worker_placement == JOBQUEUE_PLACE_ANY) {
+        return;
+    }
+
+    // Taken before pinning ourselves so that workers don't default to our CPUs.
+    CpuSet* worker_cpus = settings->worker_cpus ? cpuset_parse(settings->worker_cpus) : cpuset_current();
+    if (settings->queue_cpus) {
+        CpuSet* own_cpus = cpuset_parse(settings->queue_cpus);
+        if (!own_cpus || !cpuset_pin_thread(own_cpus)) {
+            fprintf(stderr, "Failed to run the job queue on CPUs %s\n", settings->queue_cpus);
+        }
+        cpuset_free(own_cpus);
+    }
+    if (!worker_cpus) {
+        fprintf(stderr, "Failed to find CPUs for workers\n");
+        return;
+    }
+
+    switch (settings->worker_placement) {
+    case JOBQUEUE_PLACE_CPU:
+        for (int i = 0; i < cpuset_count(worker_cpus); ++i) {
+            add_placement(cpuset_single(worker_cpus, i), -1);
+        }
+        break;
+    case JOBQUEUE_PLACE_NODE:
+    case JOBQUEUE_PLACE_LOCAL:
+    {
+        int max_node = cpuset_max_node();
+        for (int node = 0; node <= max_node; ++node) {
+            CpuSet* node_cpus = cpuset_on_node(worker_cpus, node);
+            if (node_cpus) {
+                add_placement(node_cpus, node);
             }
         }
-        g_tree_steal(work_queue, unit);
-        start_worker(unit);
+        break;
+    }
+    case JOBQUEUE_PLACE_ANY:
+        break;
     }
+    // Without NUMA information, there is just the one node.
+    if (num_placements == 0) {
+        add_placement(worker_cpus, -1);
+    } else {
+        cpuset_free(worker_cpus);
+    }
+    DPRINTF("Workers are placed in %d set(s) of CPUs", num_placements);
+}
+
+static void add_placement(CpuSet* set, int node) {
+    if (num_placements == JOBQUEUE_MAX_PLACEMENTS) {
+        cpuset_free(set);
+        return;
+    }
+    placements[num_placements] = set;
+    placement_nodes[num_placements] = node;
+    num_placements++;
 }
 
-static void start_worker(WorkUnit* unit) {
+static int choose_placement(const WorkUnit* unit) {
+    if (settings->worker_placement == JOBQUEUE_PLACE_LOCAL && unit->numa_node >= 0) {
+        for (int i = 0; i < num_placements; ++i) {
+            if (placement_nodes[i] == unit->numa_node) {
+                return i;
+            }
+        }
+    }
+
+    // The least busy relative to its size. The starting point rotates so that ties
+    // and races between shards spread workers around instead of piling them up.
+    unsigned start = __sync_fetch_and_add(&shared->next_placement, 1);
+    int best = -1;
+    long long best_load = 0;
+    long long best_size = 1;
+    for (int j = 0; j < num_placements; ++j) {
+        int i = (start + j) % num_placements;
+        long long load = shared->placement_load[i];
+        long long size = cpuset_count(placements[i]);
+        if (best == -1 || load * best_size < best_load * size) {
+            best = i;
+            best_load = load;
+            best_size = size;
+        }
+    }
+    return best;
+}
+
+static bool start_worker(WorkUnit* unit) {
     DPRINTF("Starting worker for '%s'", unit->path);
+    if (settings->simulation && settings->simulation->run_job) {
+        return start_simulated_worker(unit);
+    }
 
     const char* shell = "/bin/sh";
-    gchar* cmd = make_command(unit->path);
+    template_expand(command_template, command_buf, unit->path, unit->attempts + 1, unit->id);
+    const char* cmd = command_buf->str;
     DPRINTF("Command: %s", cmd);
 
+    int output_pipe[2] = {-1, -1};
+    if (joblog_enabled()) {
+        if (pipe(output_pipe) == -1) {
+            DPRINTF("Failed to create output pipe: %d", errno);
+            output_pipe[0] = output_pipe[1] = -1;
+        } else {
+            fcntl(output_pipe[0], F_SETFD, FD_CLOEXEC);
+            fcntl(output_pipe[1], F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    if (unit->stdin_fd != -1 && !unit->stdin_once) {
+        // The worker shares the offset with us. Rewind it for a retry.
+        lseek(unit->stdin_fd, 0, SEEK_SET);
+    }
+
+    int placement = num_placements > 0 ? choose_placement(unit) : -1;
+
     pid_t pid = fork();
     if (pid == 0) {
-        sigprocmask(SIG_UNBLOCK, &sigchld_set, NULL);
+        if (placement != -1) {
+            cpuset_pin_thread(placements[placement]);
+        }
+        if (output_pipe[1] != -1) {
+            dup2(output_pipe[1], STDOUT_FILENO);
+            dup2(output_pipe[1], STDERR_FILENO);
+        }
+        if (unit->stdin_fd != -1) {
+            dup2(unit->stdin_fd, STDIN_FILENO);
+        } else if (settings->stdin_file) {
+            int fd = open(unit->path, O_RDONLY);
+            if (fd == -1) {
+                fprintf(stderr, "queuefs: cannot open %s: %s\n", unit->path, strerror(errno));
+                _exit(1);
+            }
+            if (fd != STDIN_FILENO) {
+                dup2(fd, STDIN_FILENO);
+                close(fd);
+            }
+        }
+        // Own process group so that a timeout can kill everything the job started.
+        setpgid(0, 0);
+        signal(SIGCHLD, SIG_DFL);
         execlp(shell, shell, "-c", cmd, NULL);
         _exit(1);
     }
 
-    g_free(cmd);
+    if (output_pipe[1] != -1) {
+        close(output_pipe[1]);
+    }
+
+    if (pid == -1) {
+        DPRINTF("Failed to fork worker: %d", errno);
+        if (output_pipe[0] != -1) {
+            close(output_pipe[0]);
+        }
+        unit->next_execution_us = now_us() + settings->retry_wait_ms * 1000LL;
+        queue_work_unit(unit);
+        return false;
+    }
+
+    // Also done here so that the group exists before we might signal it.
+    setpgid(pid, pid);
+
+    if (output_pipe[0] != -1) {
+        fcntl(output_pipe[0], F_SETFL, O_NONBLOCK);
+        unit->output_fd = output_pipe[0];
+        unit->log = joblog_open(unit->id, unit->attempts, unit->path);
+    }
 
+    if (placement != -1) {
+        unit->placement = placement;
+        __sync_fetch_and_add(&shared->placement_load[placement], 1);
+    }
+
+    worker_started(unit, pid);
+    return true;
+}
+
+// Asks the simulation how the run goes instead of running anything.
+static bool start_simulated_worker(WorkUnit* unit) {
+    long long duration_us = 0;
+    int code = settings->simulation->run_job(unit->path, unit->attempts, &duration_us);
+    worker_started(unit, --last_simulated_pid);
+    unit->simulated_end_us = duration_us < 0 ? LLONG_MAX : unit->run_start_us + duration_us;
+    unit->simulated_exit_code = code;
+    simulated_workers++;
+    return true;
+}
+
+static void worker_started(WorkUnit* unit, pid_t pid) {
     unit->worker_pid = pid;
+    unit->run_start_us = now_us();
+    unit->trace_start_us = trace_now_us();
+    unit->term_sent = false;
+    unit->kill_sent = false;
+    if (settings->timeout_ms > 0) {
+        unit->deadline_us = unit->run_start_us + settings->timeout_ms * 1000LL;
+    }
+    TRACE_PROBE3(job_start, unit->id, pid, unit->path);
 
     g_hash_table_insert(active_work_units, GINT_TO_POINTER(pid), unit);
     active_workers++;
-    workers_started_ever++;
 }
 
-static gchar* make_command(const char* file_path) {
-    char* quoted_path = g_shell_quote(file_path);
-    gchar** parts = g_strsplit(settings->cmd_template, "{}", 0);
-    gchar* cmd = g_strjoinv(quoted_path, parts);
-    g_strfreev(parts);
-    g_free(quoted_path);
-    return cmd;
+static int wait_for_events() {
+    int needed = 3 + g_hash_table_size(active_work_units) + g_slist_length(cut_streams);
+    if (needed > pollfds_capacity) {
+        pollfds_capacity = needed * 2;
+        pollfds = g_realloc(pollfds, pollfds_capacity * sizeof(struct pollfd));
+        pollfd_units = g_realloc(pollfd_units, pollfds_capacity * sizeof(WorkUnit*));
+    }
+
+    pollfds[0].fd = input_fd;
+    pollfds[0].events = POLLIN;
+    pollfd_units[0] = NULL;
+    pollfds[1].fd = sigchld_pipe[0];
+    pollfds[1].events = POLLIN;
+    pollfd_units[1] = NULL;
+    pollfds[2].fd = wake_fds[2 * shard_index];
+    pollfds[2].events = POLLIN;
+    pollfd_units[2] = NULL;
+    pollfds_count = 3;
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, active_work_units);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        WorkUnit* unit = value;
+        if (unit->output_fd != -1) {
+            pollfds[pollfds_count].fd = unit->output_fd;
+            pollfds[pollfds_count].events = POLLIN;
+            pollfd_units[pollfds_count] = unit;
+            pollfds_count++;
+        }
+    }
+    for (GSList* item = cut_streams; item; item = item->next) {
+        WorkUnit* unit = item->data;
+        pollfds[pollfds_count].fd = unit->stdin_fd;
+        pollfds[pollfds_count].events = POLLIN;
+        pollfd_units[pollfds_count] = unit;
+        pollfds_count++;
+    }
+
+    long long next_us = next_timer_us();
+    int timeout_ms = -1;
+    if (virtual_clock) {
+        // Time passes in a jump to the next timer whenever there's nothing
+        // else to do, unless a real worker could finish before it.
+        int ret = poll_events(0);
+        if (ret != 0) {
+            return ret;
+        }
+        if (next_us != -1 && simulated_workers == active_workers) {
+            virtual_now_us = MAX(virtual_now_us, next_us);
+            return 0;
+        }
+    } else if (next_us != -1) {
+        long long wait_ms = (next_us - now_us() + 999) / 1000;
+        timeout_ms = wait_ms < 0 ? 0 : (wait_ms > INT_MAX ? INT_MAX : (int)wait_ms);
+    }
+    DPRINTF("Waiting for input, SIGCHLD or %d ms", timeout_ms);
+    return poll_events(timeout_ms);
+}
+
+static int poll_events(int timeout_ms) {
+    int ret = poll(pollfds, pollfds_count, timeout_ms);
+    if (ret == -1 && errno != EINTR) {
+        // Likely to fail again at once, so don't spin on it.
+        fprintf(stderr, "Job queue poll() failed: %s\n", strerror(errno));
+        usleep(100 * 1000);
+    }
+    return ret;
+}
+
+// The earliest time a job may be started, a deadline passes or a simulated run ends.
+static long long next_timer_us() {
+    long long next_us = -1;
+    WorkUnit* unit = first_work_unit(work_queue);
+    if (unit && worker_slot_free(budget_bytes(unit))) {
+        next_us = MAX(now_us(), throttled_until_us);
+    }
+    unit = first_work_unit(delayed_queue);
+    if (unit && worker_slot_free(budget_bytes(unit)) && (next_us == -1 || unit->next_execution_us < next_us)) {
+        next_us = unit->next_execution_us;
+    }
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, active_work_units);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        WorkUnit* unit = value;
+        if (!unit->kill_sent && has_deadline(unit) && (next_us == -1 || unit->deadline_us < next_us)) {
+            next_us = unit->deadline_us;
+        }
+        if (unit->worker_pid < -1 && unit->simulated_end_us != LLONG_MAX &&
+                (next_us == -1 || unit->simulated_end_us < next_us)) {
+            next_us = unit->simulated_end_us;
+        }
+    }
+    return next_us;
+}
+
+// Running units have one if there is a timeout or they're being stopped.
+static bool has_deadline(const WorkUnit* unit) {
+    return settings->timeout_ms > 0 || unit->term_sent;
+}
+
+static void enforce_timeouts() {
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, active_work_units);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        WorkUnit* unit = value;
+        if (unit->kill_sent || !has_deadline(unit) || unit->deadline_us > now_us()) {
+            continue;
+        }
+        if (!unit->term_sent) {
+            DPRINTF("Work unit timed out: %s", unit->path);
+            TRACE_PROBE3(job_timeout, unit->id, unit->worker_pid, unit->path);
+            trace_job_instant(unit->id, "timeout", unit->attempts);
+            signal_worker(unit, SIGTERM);
+            unit->term_sent = true;
+            unit->deadline_us = now_us() + settings->kill_grace_ms * 1000LL;
+        } else {
+            DPRINTF("Work unit did not stop after SIGTERM: %s", unit->path);
+            signal_worker(unit, SIGKILL);
+            unit->kill_sent = true;
+        }
+    }
+}
+
+static void signal_worker(WorkUnit* unit, int signum) {
+    if (unit->worker_pid < -1) {
+        // Simulated jobs stop at once.
+        if (unit->simulated_end_us > now_us()) {
+            unit->simulated_end_us = now_us();
+            unit->simulated_exit_code = -signum;
+        }
+        return;
+    }
+    if (kill(-unit->worker_pid, signum) == -1 && errno != ESRCH) {
+        DPRINTF("Failed to send signal %d to process group %d: %d", signum, (int)unit->worker_pid, errno);
+    }
+}
+
+static void drain_worker_output(WorkUnit* unit) {
+    char buf[65536];
+    while (unit->output_fd != -1) {
+        ssize_t ret = read(unit->output_fd, buf, sizeof(buf));
+        if (ret > 0) {
+            joblog_write(unit->log, buf, ret);
+        } else if (ret == -1 && errno == EINTR) {
+            continue;
+        } else {
+            if (ret == 0 || errno != EAGAIN) {
+                // EOF. The worker may still be running but has closed its output.
+                close(unit->output_fd);
+                unit->output_fd = -1;
+            }
+            break;
+        }
+    }
+}
+
+static void finish_worker_output(WorkUnit* unit, bool keep_log) {
+    // Whatever is in the pipe now was written before the worker exited.
+    // Processes left behind by the worker may keep the pipe open,
+    // but their output is not the job's concern any more.
+    drain_worker_output(unit);
+    if (unit->output_fd != -1) {
+        close(unit->output_fd);
+        unit->output_fd = -1;
+    }
+    if (unit->log) {
+        joblog_close(unit->log, keep_log);
+        unit->log = NULL;
+    }
+}
+
+// For a unit that won't run again. Its order key must be released first if it holds it.
+// Claims of canceled units are left to the parent, which may claim the path again.
+static void retire_work_unit(WorkUnit* unit, bool succeeded) {
+    __sync_fetch_and_sub(&shared->shards[shard_index].load, 1);
+    if (unit->bytes > 0) {
+        __sync_fetch_and_sub(&shared->shards[shard_index].bytes, unit->bytes);
+    }
+    unindex_work_unit(unit);
+    // Another job for the file still needs it, and finishes it in turn.
+    if (succeeded && !g_hash_table_contains(units_by_path, unit->path)) {
+        release_claim(unit);
+        if (finish_actions) {
+            g_queue_push_tail(&finished_files, unit->path);
+            unit->path = NULL;
+        }
+    }
+    free_work_unit(unit);
+}
+
+static void index_work_unit(WorkUnit* unit) {
+    GQueue* units = g_hash_table_lookup(units_by_path, unit->path);
+    if (!units) {
+        units = g_queue_new();
+        g_hash_table_insert(units_by_path, g_strdup(unit->path), units);
+    }
+    g_queue_push_tail(units, unit);
+}
+
+static void unindex_work_unit(WorkUnit* unit) {
+    GQueue* units = g_hash_table_lookup(units_by_path, unit->path);
+    g_queue_remove(units, unit);
+    if (g_queue_is_empty(units)) {
+        g_hash_table_remove(units_by_path, unit->path);
+    }
+}
+
+static void add_work_unit(WorkUnit* unit) {
+    if (unit->order_key) {
+        GQueue* followers = g_hash_table_lookup(key_queues, unit->order_key);
+        if (followers) {
+            DPRINTF("Work unit waits for an earlier one with the same key: %s", unit->path);
+            g_queue_push_tail(followers, unit);
+            return;
+        }
+        g_hash_table_insert(key_queues, g_strdup(unit->order_key), g_queue_new());
+    }
+    queue_work_unit(unit);
+}
+
+/*
+ * Jobs that are due are started in order of when they became due, or with
+ * smallest_first, of that plus smallest_first times their estimated run time.
+ * Shorter jobs thus go first, but only past jobs that became due less than
+ * that long before them, so long jobs are delayed by a bounded amount.
+ * Jobs not yet due wait in delayed_queue so that they hold up none that are.
+ */
+static void queue_work_unit(WorkUnit* unit) {
+    if (unit->next_execution_us > now_us()) {
+        g_tree_insert(delayed_queue, unit, unit);
+        return;
+    }
+    unit->sort_us = unit->next_execution_us;
+    if (settings->smallest_first > 0) {
+        unit->sort_us += (long long)(settings->smallest_first * estimate_run_us(unit));
+    }
+    g_tree_insert(work_queue, unit, unit);
+}
+
+// 0 until a job has succeeded, so that jobs stay in order until then.
+static long long estimate_run_us(const WorkUnit* unit) {
+    if (unit->bytes > 0 && us_per_byte > 0) {
+        return (long long)(unit->bytes * us_per_byte);
+    }
+    return (long long)us_per_run;
+}
+
+// Weighs new runs by 1/8, so the estimate follows changes in the workload.
+static void learn_run_time(const WorkUnit* unit, long long duration_us) {
+    if (unit->bytes > 0) {
+        double rate = (double)duration_us / unit->bytes;
+        us_per_byte = us_per_byte > 0 ? us_per_byte + (rate - us_per_byte) / 8 : rate;
+    } else {
+        us_per_run = us_per_run > 0 ? us_per_run + (duration_us - us_per_run) / 8 : duration_us;
+    }
+}
+
+// A failed job keeps its key and is retried before any later job with it.
+static void release_order_key(WorkUnit* unit) {
+    if (!unit->order_key) {
+        return;
+    }
+    GQueue* followers = g_hash_table_lookup(key_queues, unit->order_key);
+    WorkUnit* next = followers ? g_queue_pop_head(followers) : NULL;
+    if (next) {
+        // Keeps its place among other keys' jobs by the time it was added.
+        queue_work_unit(next);
+    } else {
+        g_hash_table_remove(key_queues, unit->order_key);
+    }
+}
+
+// Claims are named after the path relative to the source directory.
+static void release_claim(WorkUnit* unit) {
+    if (!settings->claim_dir || !settings->source_dir) {
+        return;
+    }
+    const char* rel_path = unit->path;
+    size_t len = strlen(settings->source_dir);
+    if (strncmp(rel_path, settings->source_dir, len) == 0 &&
+            (rel_path[len] == '/' || (len > 0 && settings->source_dir[len - 1] == '/'))) {
+        rel_path += len;
+        while (*rel_path == '/') {
+            rel_path++;
+        }
+    }
+    gchar* claim_file = claim_file_name(settings->claim_dir, rel_path);
+    if (unlink(claim_file) == -1 && errno != ENOENT) {
+        DPRINTF("Failed to delete claim %s: %d", claim_file, errno);
+    }
+    g_free(claim_file);
 }
 
 static void free_work_unit(gpointer unit) {
+    // Only runs still going at shutdown have a log open here. Keep it.
+    finish_worker_output((WorkUnit*)unit, true);
     g_free(((WorkUnit*)unit)->path);
+    g_free(((WorkUnit*)unit)->hash);
+    g_free(((WorkUnit*)unit)->order_key);
+    g_slist_free(((WorkUnit*)unit)->barriers);
+    if (((WorkUnit*)unit)->stdin_fd != -1) {
+        close_stdin(unit);
+    }
     g_free(unit);
 }
 
+// Accounted for by jobqueue_add_job() when it was passed.
+static void close_stdin(WorkUnit* unit) {
+    close(unit->stdin_fd);
+    unit->stdin_fd = -1;
+    __sync_fetch_and_sub(&shared->shards[shard_index].stdin_fds, 1);
+    if (unit->bytes > 0) {
+        __sync_fetch_and_sub(&shared->shards[shard_index].stdin_bytes, unit->bytes);
+    }
+}
+
+static void free_key_queue(gpointer queue) {
+    while (!g_queue_is_empty(queue)) {
+        free_work_unit(g_queue_pop_head(queue));
+    }
+    g_queue_free(queue);
+}
+
 static gint compare_work_unit(gconstpointer a, gconstpointer b, gpointer data) {
     WorkUnit* wu1 = (WorkUnit*)a;
     WorkUnit* wu2 = (WorkUnit*)b;
-    struct timeval* tv1 = &wu1->next_execution_time;
-    struct timeval* tv2 = &wu2->next_execution_time;
-    if (tv1->tv_sec == tv2->tv_sec) {
-        if (tv1->tv_usec == tv2->tv_usec) {
-            return wu1->worker_pid - wu2->worker_pid;
-        } else {
-            return tv1->tv_usec - tv2->tv_usec;
-        }
+    if (wu1->sort_us == wu2->sort_us) {
+        // Units enqueued within the same microsecond must not compare
+        // equal or g_tree_insert would replace one with the other.
+        return (wu1->id > wu2->id) - (wu1->id < wu2->id);
     } else {
-        return tv1->tv_sec - tv2->tv_sec;
+        return (wu1->sort_us > wu2->sort_us) - (wu1->sort_us < wu2->sort_us);
+    }
+}
+
+// Like compare_work_unit() but by when units are due.
+static gint compare_due_time(gconstpointer a, gconstpointer b, gpointer data) {
+    WorkUnit* wu1 = (WorkUnit*)a;
+    WorkUnit* wu2 = (WorkUnit*)b;
+    if (wu1->next_execution_us == wu2->next_execution_us) {
+        return (wu1->id > wu2->id) - (wu1->id < wu2->id);
+    } else {
+        return (wu1->next_execution_us > wu2->next_execution_us) - (wu1->next_execution_us < wu2->next_execution_us);
     }
 }
 
@@ -359,15 +1652,11 @@ static gboolean traverse_get_first_key(gpointer key, gpointer value, gpointer de
     return TRUE;
 }
 
-static bool wait_for_sigchld(long ms_to_wait) {
-    //FIXIME: this is no good - we can't accept new jobs while waiting
-    struct timespec ts;
-    ts.tv_sec = ms_to_wait / 1000;
-    ts.tv_nsec = (ms_to_wait % 1000) * 1000000;
-    DPRINTF("Waiting for %ld ms or SIGCHLD", ms_to_wait);
-    if (sigtimedwait(&sigchld_set, NULL, &ts) == -1) {
-        return true;
-    } else {
-        return false;
+// NULL if the queue is empty.
+static WorkUnit* first_work_unit(GTree* queue) {
+    WorkUnit* unit = NULL;
+    if (g_tree_nnodes(queue) > 0) {
+        g_tree_foreach(queue, &traverse_get_first_key, &unit);
     }
+    return unit;
 }
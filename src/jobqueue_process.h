@@ -26,6 +26,45 @@
 
 #include "jobqueue.h"
 
-void jobqueue_process_main(JobQueueSettings* settings, int input_fd, int output_fd);
+/* Most CPUs or NUMA nodes workers are spread over. */
+#define JOBQUEUE_MAX_PLACEMENTS 1024
+
+/*
+ * Memory shared by the shards of a job queue and their owner.
+ * Updated with atomic builtins.
+ */
+typedef struct JobQueueShardState {
+    int load;             /* Jobs sent to the shard and not yet finished */
+    long long bytes;      /* Known sizes of those jobs' files */
+    int waiting_for_slot; /* Set while the shard has due work but no worker slot */
+    int stdin_fds;        /* Stdin descriptors passed with those jobs and still held */
+    long long stdin_bytes; /* Known sizes of those jobs' files */
+} __attribute__((aligned(64))) JobQueueShardState;
+
+typedef struct JobQueueShared {
+    int num_shards;
+    int max_workers;
+    int active_workers; /* Across all shards */
+    long long max_running_bytes; /* Limit on running_bytes, or 0 for none */
+    long long running_bytes;     /* Total size of the files of running jobs */
+
+    /* Job starts across all shards are limited by a token bucket (GCRA). */
+    long long start_interval_us;  /* Time one token takes to refill, or 0 for no limit */
+    long long start_tolerance_us; /* How far ahead starts may run, (burst - 1) intervals */
+    long long next_start_us;      /* Theoretical time of the next start at the steady rate */
+    JobQueueShardState shards[JOBQUEUE_MAX_SHARDS];
+
+    /* Workers running on each CPU or node that workers are pinned to. */
+    int placement_load[JOBQUEUE_MAX_PLACEMENTS];
+    unsigned next_placement; /* Where to start looking for the least busy one */
+} JobQueueShared;
+
+/*
+ * Runs one shard of a job queue.
+ * wake_fds has a pipe for each shard, read end first,
+ * for telling a shard waiting for a worker slot that one was freed.
+ */
+void jobqueue_process_main(JobQueueSettings* settings, int input_fd, int output_fd,
+                           JobQueueShared* shared, int shard, const int* wake_fds);
 
 #endif /* INC_QUEUEFS_JOBQUEUE_PROCESS_H */
@@ -26,9 +26,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <fcntl.h>
 
 const char *my_basename(const char* path) {
     const char* p;
@@ -43,11 +48,67 @@ const char *my_basename(const char* path) {
         return path;
 }
 
+char *make_absolute(const char* path) {
+    if (path[0] == '/') {
+        return strdup(path);
+    }
+
+    size_t cwd_size = 256;
+    char* cwd = NULL;
+    while (1) {
+        cwd = realloc(cwd, cwd_size);
+        if (!cwd) {
+            return NULL;
+        }
+        if (getcwd(cwd, cwd_size) != NULL) {
+            break;
+        }
+        if (errno != ERANGE) {
+            free(cwd);
+            return NULL;
+        }
+        cwd_size *= 2;
+    }
+
+    size_t cwd_len = strlen(cwd);
+    char* result = malloc(cwd_len + 1 + strlen(path) + 1);
+    if (result) {
+        strcpy(result, cwd);
+        result[cwd_len] = '/';
+        strcpy(result + cwd_len + 1, path);
+    }
+    free(cwd);
+    return result;
+}
+
+bool parse_size(const char* str, long long* result) {
+    char* end;
+    errno = 0;
+    long long value = strtoll(str, &end, 10);
+    if (end == str || value < 0 || errno != 0) {
+        return false;
+    }
+    int shift = 0;
+    switch (*end) {
+    case 'T': case 't': shift += 10; /* fall through */
+    case 'G': case 'g': shift += 10; /* fall through */
+    case 'M': case 'm': shift += 10; /* fall through */
+    case 'K': case 'k': shift += 10;
+        ++end;
+        break;
+    }
+    if (*end != '\0' || value > (LLONG_MAX >> shift)) {
+        return false;
+    }
+    *result = value << shift;
+    return true;
+}
+
 int wait_status_to_code(int status) {
     if (WIFEXITED(status)) {
         return WEXITSTATUS(status);
     } else if (WIFSIGNALED(status)) {
-        return -WSTOPSIG(status);
+        return -WTERMSIG(status);
     } else {
         DPRINT("Warning: wait_status_to_code code called with invalid status");
         return -1;
@@ -57,6 +118,10 @@ int wait_status_to_code(int status) {
 void timeval_add_ms(struct timeval* tv, int ms) {
     tv->tv_sec += ms / 1000;
     tv->tv_usec += (ms % 1000) * 1000;
+    if (tv->tv_usec >= 1000000) {
+        tv->tv_sec++;
+        tv->tv_usec -= 1000000;
+    }
 }
 
 long ms_to_timeval(struct timeval* tv) {
@@ -66,3 +131,69 @@ long ms_to_timeval(struct timeval* tv) {
     d += (tv->tv_usec - now.tv_usec) / 1000;
     return d;
 }
+
+ssize_t send_with_fd(int sock, const void* buf, size_t len, int fd) {
+    struct iovec iov = { (void*)buf, len };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+ssize_t recv_with_fds(int sock, void* buf, size_t len, int* fds, int max_fds, int* num_fds) {
+    struct iovec iov = { buf, len };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(16 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    *num_fds = 0;
+    ssize_t ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (ret < 0) {
+        return ret;
+    }
+    bool lost = (msg.msg_flags & MSG_CTRUNC) != 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; ++i) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (*num_fds < max_fds) {
+                fds[(*num_fds)++] = fd;
+            } else {
+                close(fd);
+                lost = true;
+            }
+        }
+    }
+    if (lost) {
+        // Which command a descriptor belonged to can't be told anymore.
+        for (int i = 0; i < *num_fds; ++i) {
+            close(fds[i]);
+        }
+        *num_fds = -1;
+    }
+    return ret;
+}
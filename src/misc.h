@@ -24,6 +24,9 @@
 #ifndef INC_QUEUEFS_MISC_H
 #define INC_QUEUEFS_MISC_H
 
+#include <stdbool.h>
+#include <sys/types.h>
+
 /* Returns a pointer to the first character after the
    final slash of path, or path itself if it contains no slashes.
    If the path ends with a slash, then the result is an empty
@@ -31,12 +34,30 @@
    Returns NULL if path is NULL. */
 const char *my_basename(const char* path);
 
+/* Returns a malloc'ed copy of path made absolute with respect to
+   the current working directory. The path need not exist.
+   Returns NULL on error. */
+char *make_absolute(const char* path);
+
 /* Takes a status written by waitpid() and returns
  * 0 if the process was successful or its exit code
  * or -N if it was killed by signal N.
  */
 int wait_status_to_code(int status);
 
+/* Parses a non-negative number with an optional suffix
+   K, M, G or T (powers of 1024). Returns false if the string is invalid. */
+bool parse_size(const char* str, long long* result);
+
+/* Like write() on a Unix socket, but also passes a copy of fd. */
+ssize_t send_with_fd(int sock, const void* buf, size_t len, int fd);
+
+/* Like read() on a Unix socket, but also receives up to max_fds
+   file descriptors, setting *num_fds. They are made close-on-exec.
+   If any were lost, e.g. to the descriptor limit, the ones received
+   are closed and *num_fds is set to -1. The data is still returned. */
+ssize_t recv_with_fds(int sock, void* buf, size_t len, int* fds, int max_fds, int* num_fds);
+
 struct timeval;
 void timeval_add_ms(struct timeval* tv, int ms);
 
@@ -0,0 +1,263 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#include "opstats.h"
+#include "trace.h"
+#include "debug.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <glib.h>
+
+/* Bucket 0 counts latencies under 1us, bucket i>0 those in [2^(i-1), 2^i) us. */
+#define NUM_BUCKETS 32
+
+/* How many of the latest slow operations a report lists. */
+#define MAX_SLOW_OPS 16
+
+typedef struct Histogram {
+    unsigned long long count;
+    unsigned long long total_us;
+    unsigned long long max_us;
+    unsigned long long buckets[NUM_BUCKETS];
+} Histogram;
+
+/* Written only by its own thread. */
+typedef struct ThreadStats {
+    struct ThreadStats* next;
+    Histogram ops[]; /* num_ops of them */
+} ThreadStats;
+
+typedef struct SlowOp {
+    int op;
+    long long duration_us;
+    time_t when;
+    gchar* path;
+} SlowOp;
+
+static bool stats_enabled = false;
+static int num_ops = 0;
+static const char* const* op_names = NULL;
+static long slow_us = 0;
+static pthread_key_t thread_key;
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER; /* Protects the rest */
+static ThreadStats* threads = NULL; /* Of live threads */
+static Histogram* retired = NULL;   /* Merged from threads that have exited */
+static SlowOp slow_ops[MAX_SLOW_OPS]; /* A ring of the latest ones */
+static unsigned long long slow_op_count = 0;
+
+static ThreadStats* thread_stats();
+static void retire_thread(void* data);
+static void merge(Histogram* dest, const Histogram* src);
+static int bucket_of(long long us);
+static long long percentile(const Histogram* h, double fraction);
+static void record_slow_op(int op, long long duration_us, const char* path);
+
+
+bool opstats_init(int num_ops_, const char* const* op_names_, long slow_us_) {
+    if (pthread_key_create(&thread_key, &retire_thread) != 0) {
+        return false;
+    }
+    num_ops = num_ops_;
+    op_names = op_names_;
+    slow_us = slow_us_;
+    retired = g_malloc0(num_ops * sizeof(Histogram));
+    memset(slow_ops, 0, sizeof(slow_ops));
+    slow_op_count = 0;
+    stats_enabled = true;
+    return true;
+}
+
+void opstats_shutdown() {
+    if (!stats_enabled) {
+        return;
+    }
+    stats_enabled = false;
+    pthread_key_delete(thread_key);
+    pthread_mutex_lock(&stats_mutex);
+    while (threads) {
+        ThreadStats* next = threads->next;
+        g_free(threads);
+        threads = next;
+    }
+    g_free(retired);
+    retired = NULL;
+    for (int i = 0; i < MAX_SLOW_OPS; ++i) {
+        g_free(slow_ops[i].path);
+        slow_ops[i].path = NULL;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+bool opstats_enabled() {
+    return stats_enabled;
+}
+
+long long opstats_start() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void opstats_finish(int op, long long start, const char* path) {
+    long long duration_us = opstats_start() - start;
+    ThreadStats* ts = thread_stats();
+    Histogram* h = &ts->ops[op];
+    h->count++;
+    h->total_us += duration_us;
+    if ((unsigned long long)duration_us > h->max_us) {
+        h->max_us = duration_us;
+    }
+    h->buckets[bucket_of(duration_us)]++;
+
+    if (slow_us > 0 && duration_us >= slow_us) {
+        record_slow_op(op, duration_us, path);
+    }
+}
+
+char* opstats_report() {
+    GString* out = g_string_new("");
+    Histogram* total = g_malloc0(num_ops * sizeof(Histogram));
+
+    pthread_mutex_lock(&stats_mutex);
+    for (int op = 0; op < num_ops; ++op) {
+        merge(&total[op], &retired[op]);
+        for (ThreadStats* ts = threads; ts; ts = ts->next) {
+            merge(&total[op], &ts->ops[op]);
+        }
+    }
+
+    g_string_append_printf(out, "%-12s %10s %10s %10s %10s %10s %10s\n",
+                           "op", "count", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (int op = 0; op < num_ops; ++op) {
+        const Histogram* h = &total[op];
+        if (h->count == 0) {
+            continue;
+        }
+        g_string_append_printf(out, "%-12s %10llu %10llu %10lld %10lld %10lld %10llu\n",
+                               op_names[op], h->count, h->total_us / h->count,
+                               percentile(h, 0.5), percentile(h, 0.99), percentile(h, 0.999),
+                               h->max_us);
+    }
+
+    if (slow_us > 0) {
+        g_string_append_printf(out, "\nslow ops (at least %ld us): %llu\n", slow_us, slow_op_count);
+        unsigned long long first = slow_op_count > MAX_SLOW_OPS ? slow_op_count - MAX_SLOW_OPS : 0;
+        for (unsigned long long i = first; i < slow_op_count; ++i) {
+            const SlowOp* slow = &slow_ops[i % MAX_SLOW_OPS];
+            char when[32];
+            struct tm tm;
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&slow->when, &tm));
+            g_string_append_printf(out, "%s %s %lld us %s\n",
+                                   when, op_names[slow->op], slow->duration_us, slow->path);
+        }
+    }
+    pthread_mutex_unlock(&stats_mutex);
+
+    g_free(total);
+    return g_string_free(out, FALSE);
+}
+
+static ThreadStats* thread_stats() {
+    ThreadStats* ts = pthread_getspecific(thread_key);
+    if (!ts) {
+        ts = g_malloc0(sizeof(ThreadStats) + num_ops * sizeof(Histogram));
+        pthread_mutex_lock(&stats_mutex);
+        ts->next = threads;
+        threads = ts;
+        pthread_mutex_unlock(&stats_mutex);
+        pthread_setspecific(thread_key, ts);
+    }
+    return ts;
+}
+
+/* Called when a thread exits, e.g. when FUSE has too many idle threads. */
+static void retire_thread(void* data) {
+    ThreadStats* ts = data;
+    pthread_mutex_lock(&stats_mutex);
+    ThreadStats** link = &threads;
+    while (*link != ts) {
+        link = &(*link)->next;
+    }
+    *link = ts->next;
+    for (int op = 0; op < num_ops; ++op) {
+        merge(&retired[op], &ts->ops[op]);
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    g_free(ts);
+}
+
+static void merge(Histogram* dest, const Histogram* src) {
+    dest->count += src->count;
+    dest->total_us += src->total_us;
+    if (src->max_us > dest->max_us) {
+        dest->max_us = src->max_us;
+    }
+    for (int i = 0; i < NUM_BUCKETS; ++i) {
+        dest->buckets[i] += src->buckets[i];
+    }
+}
+
+static int bucket_of(long long us) {
+    if (us <= 0) {
+        return 0;
+    }
+    int bucket = 64 - __builtin_clzll((unsigned long long)us);
+    return bucket < NUM_BUCKETS ? bucket : NUM_BUCKETS - 1;
+}
+
+/* The upper bound of the bucket holding the given fraction of operations. */
+static long long percentile(const Histogram* h, double fraction) {
+    unsigned long long target = (unsigned long long)(fraction * h->count);
+    if (target < 1) {
+        target = 1;
+    }
+    unsigned long long seen = 0;
+    for (int i = 0; i < NUM_BUCKETS - 1; ++i) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            long long bound = 1LL << i;
+            return bound < (long long)h->max_us ? bound : (long long)h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+static void record_slow_op(int op, long long duration_us, const char* path) {
+    TRACE_PROBE3(slow_op, op_names[op], path, duration_us);
+    fprintf(stderr, "queuefs: slow %s of %s: %lld us\n", op_names[op], path ? path : "", duration_us);
+
+    pthread_mutex_lock(&stats_mutex);
+    SlowOp* slow = &slow_ops[slow_op_count % MAX_SLOW_OPS];
+    g_free(slow->path);
+    slow->op = op;
+    slow->duration_us = duration_us;
+    slow->when = time(NULL);
+    slow->path = g_strdup(path ? path : "");
+    slow_op_count++;
+    pthread_mutex_unlock(&stats_mutex);
+}
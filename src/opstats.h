@@ -0,0 +1,62 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#ifndef INC_QUEUEFS_OPSTATS_H
+#define INC_QUEUEFS_OPSTATS_H
+
+#include <stdbool.h>
+
+/*
+ * Latency histograms of FUSE operations.
+ *
+ * Each thread counts into its own histograms, so timing an operation
+ * takes two clock reads and a few increments without any locking.
+ * A report merges the histograms of all threads, including ones that
+ * have exited. It reads them without locking, so operations finishing
+ * meanwhile may or may not be counted.
+ *
+ * Buckets are powers of two in microseconds, so percentiles in a report
+ * are upper bounds within a factor of two.
+ */
+
+/*
+ * Starts counting. op_names gives the names of operations 0..num_ops-1
+ * and must stay valid. Operations taking at least slow_us microseconds
+ * are logged to stderr and kept for the report. 0 disables that.
+ */
+bool opstats_init(int num_ops, const char* const* op_names, long slow_us);
+
+void opstats_shutdown();
+
+bool opstats_enabled();
+
+/* Returns a timestamp to pass to opstats_finish(). */
+long long opstats_start();
+
+/* Counts one operation that began at start. path is used for logging. */
+void opstats_finish(int op, long long start, const char* path);
+
+/* A human-readable summary. Free with g_free(). */
+char* opstats_report();
+
+#endif
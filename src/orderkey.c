@@ -0,0 +1,137 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#include <config.h>
+
+#include "orderkey.h"
+#include "debug.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#ifdef HAVE_LGETXATTR
+#include <sys/xattr.h>
+#endif
+
+typedef enum OrderKeyType {
+    ORDER_KEY_DIR,
+    ORDER_KEY_REGEX,
+    ORDER_KEY_XATTR
+} OrderKeyType;
+
+struct OrderKeySpec {
+    OrderKeyType type;
+    GRegex* regex;
+    gchar* xattr_name;
+};
+
+static gchar* get_xattr_key(const char* name, const char* rel_path);
+
+
+OrderKeySpec* orderkey_parse(const char* spec) {
+    OrderKeySpec* result = g_malloc0(sizeof(OrderKeySpec));
+    if (g_str_equal(spec, "dir")) {
+        result->type = ORDER_KEY_DIR;
+    } else if (g_str_has_prefix(spec, "regex:")) {
+        result->type = ORDER_KEY_REGEX;
+        GError* error = NULL;
+        result->regex = g_regex_new(spec + strlen("regex:"), G_REGEX_OPTIMIZE, 0, &error);
+        if (!result->regex) {
+            DPRINTF("Invalid ordering regex: %s", error->message);
+            g_error_free(error);
+            g_free(result);
+            return NULL;
+        }
+    } else if (g_str_has_prefix(spec, "xattr:") && spec[strlen("xattr:")] != '\0') {
+#ifdef HAVE_LGETXATTR
+        result->type = ORDER_KEY_XATTR;
+        result->xattr_name = g_strdup(spec + strlen("xattr:"));
+#else
+        DPRINT("Extended attributes are not supported on this platform");
+        g_free(result);
+        return NULL;
+#endif
+    } else {
+        g_free(result);
+        return NULL;
+    }
+    return result;
+}
+
+void orderkey_free(OrderKeySpec* spec) {
+    if (spec) {
+        if (spec->regex) {
+            g_regex_unref(spec->regex);
+        }
+        g_free(spec->xattr_name);
+        g_free(spec);
+    }
+}
+
+gchar* orderkey_get(const OrderKeySpec* spec, const char* rel_path) {
+    switch (spec->type) {
+    case ORDER_KEY_DIR: {
+        const char* slash = strrchr(rel_path, '/');
+        return slash ? g_strndup(rel_path, slash - rel_path) : g_strdup(".");
+    }
+    case ORDER_KEY_REGEX: {
+        GMatchInfo* match_info;
+        gchar* key = NULL;
+        if (g_regex_match(spec->regex, rel_path, 0, &match_info)) {
+            int group = g_regex_get_capture_count(spec->regex) > 0 ? 1 : 0;
+            key = g_match_info_fetch(match_info, group);
+        }
+        g_match_info_free(match_info);
+        return key;
+    }
+    case ORDER_KEY_XATTR:
+        return get_xattr_key(spec->xattr_name, rel_path);
+    }
+    return NULL;
+}
+
+static gchar* get_xattr_key(const char* name, const char* rel_path) {
+#ifdef HAVE_LGETXATTR
+    // The attribute may change between the calls. Retry if it grew.
+    while (true) {
+        ssize_t size = lgetxattr(rel_path, name, NULL, 0);
+        if (size < 0) {
+            return NULL;
+        }
+        gchar* key = g_malloc(size + 1);
+        ssize_t len = lgetxattr(rel_path, name, key, size);
+        if (len >= 0) {
+            key[len] = '\0';
+            return key;
+        }
+        g_free(key);
+        if (errno != ERANGE) {
+            return NULL;
+        }
+    }
+#else
+    (void)name;
+    (void)rel_path;
+    return NULL;
+#endif
+}
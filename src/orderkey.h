@@ -0,0 +1,59 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#ifndef INC_QUEUEFS_ORDERKEY_H
+#define INC_QUEUEFS_ORDERKEY_H
+
+#include <glib.h>
+
+/*
+ * Derives an ordering key from a file. Jobs with the same key run one
+ * at a time in the order their files were added (see JobInfo).
+ *
+ * Specs:
+ *   dir          the directory the file is in
+ *   regex:RE     the first capture group of RE matched against the
+ *                path relative to the source directory, or the whole
+ *                match if RE has no groups
+ *   xattr:NAME   the value of the extended attribute NAME
+ *
+ * Files that yield no key (no match, no attribute) are not ordered.
+ */
+
+struct OrderKeySpec;
+typedef struct OrderKeySpec OrderKeySpec;
+
+/* Returns NULL if spec is invalid. */
+OrderKeySpec* orderkey_parse(const char* spec);
+
+void orderkey_free(OrderKeySpec* spec);
+
+/*
+ * Gets the key of a file given relative to the current directory,
+ * or NULL. The result must be freed with g_free().
+ *
+ * This function is thread-safe.
+ */
+gchar* orderkey_get(const OrderKeySpec* spec, const char* rel_path);
+
+#endif
@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #ifdef HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
@@ -38,6 +39,7 @@
 #include <sys/stat.h>
 #endif
 #include <sys/statvfs.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
@@ -48,6 +50,17 @@
 #include <grp.h>
 #include <signal.h>
 #include <alloca.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/syscall.h>
+#endif
 
 #include <fuse.h>
 #include <fuse_opt.h>
@@ -55,6 +68,15 @@
 #include "debug.h"
 #include "jobqueue.h"
 #include "misc.h"
+#include "trace.h"
+#include "handoff.h"
+#include "admission.h"
+#include "hash.h"
+#include "dedup.h"
+#include "orderkey.h"
+#include "claim.h"
+#include "cpuset.h"
+#include "opstats.h"
 
 /* SETTINGS */
 static struct Settings {
@@ -66,13 +88,149 @@ static struct Settings {
 
     char* cmd_template;
     int max_workers;
+    int shards;
+    double max_start_rate;
+    int start_burst;
+    double smallest_first;
+    long long max_running_bytes;
     long retry_wait_ms;
+    long timeout_ms;
+    long kill_grace_ms;
+    char* trace_file;
+    char* record_file;
+    char* job_log_dir;
+    char* job_log_file;
+    long job_log_max_bytes;
+
+    char* handoff_socket;     /* NULL if handoff is disabled */
+    char* handoff_mountpoint; /* Absolute path of mntdest */
+    int handoff_fd;           /* Connection to the instance we took over from, or -1 */
+    JobQueueExport handoff_jq;
+
+    AdmissionSettings admission;
+
+    char* dedup_index; /* NULL if deduplication is disabled */
+
+    bool stdin_file;          /* Workers get the file as stdin */
+    long long stdin_memfd_max; /* Largest file to keep in memory for workers, or 0 */
+    long long stdin_memfd_total; /* Bytes in memfds, open or held by the job queue, at once */
+    int stdin_memfd_count;       /* Number of those memfds */
+    bool stream;              /* Jobs of new files start at once, reading a pipe */
+    long stream_wait_ms;      /* How long a write may wait for the job to read */
+
+    bool enqueue_on_rename; /* Enqueue files renamed or linked into place instead of closed ones */
+    bool delete_on_finish;
+    char* move_on_finish_dir;
+    char** ignore_patterns; /* NULL-terminated globs of files to never enqueue, or NULL */
+    OrderKeySpec* order_key; /* NULL if jobs are not ordered */
+
+    char* claim_dir;        /* Shared with other instances, or NULL */
+    char* claim_mountpoint; /* Absolute path of mntdest, identifies our claims */
+    long claim_lease_ms;
+
+    CpuSet* fuse_cpus; /* For FUSE request threads, or NULL to not pin them */
+    char* queue_cpus;
+    char* worker_cpus;
+    JobQueuePlacement worker_placement;
+
+    char* stats_file; /* Path of the virtual stats file in the mount, e.g. "/.stats", or NULL */
+    long slow_op_us;  /* Log operations taking this long, or 0 */
 
     int mntsrc_fd;
 
     JobQueue* jobqueue;
 } settings;
 
+/*
+ * An open regular file. Stored in fi->fh.
+ *
+ * With deduplication, the content is hashed as it's written. The hash
+ * is only trusted if the file was empty when opened and was then
+ * written sequentially, which is what producers delivering files do.
+ *
+ * With --stdin-memfd, a file that was empty when opened is also copied
+ * to a memfd as it's written, as long as it stays small enough.
+ * Workers then read it from there instead of from the disk.
+ * The job queue holds a memfd until the job succeeds, so the memfds of
+ * open files and queued jobs together have a budget. Files over it are
+ * read from the disk as with plain --stdin.
+ *
+ * With --stream, a new file's job is queued when it's created, with the
+ * read end of a pipe as its stdin. Sequential writes are copied into the
+ * pipe, spliced from the file where possible. If the stream can't keep
+ * up, the job is canceled and queued again normally when the file is closed.
+ */
+/* Pipe size to ask for with --stream. 1 MiB is what Linux allows unprivileged users. */
+#define STREAM_PIPE_SIZE (1024 * 1024)
+
+typedef struct OpenFile {
+    int fd;
+    pthread_mutex_t mutex; /* Protects the rest */
+    bool hashing; /* Whether hash covers the first hashed_bytes of the file */
+    off_t hashed_bytes;
+    HashState hash;
+    int memfd; /* Copy of the file's content, or -1 */
+    long long memfd_bytes; /* Counted against the budget for memfd */
+    int numa_node; /* Where it was last written from, with --worker-placement=local */
+    char *stream_path;   /* Mount path of the job streamed to, or NULL */
+    int stream_pipe;     /* Write end of the job's stdin, or -1 once the stream ended */
+    int stream_src;      /* The file opened for splicing into the pipe, or -1 */
+    off_t streamed_bytes;
+    bool stream_broken;  /* The streamed job was canceled */
+    char *stats;         /* The report when this is the stats file, whose fd is -1 */
+    size_t stats_len;
+} OpenFile;
+
+/* The part of the memfd budget taken by open files. */
+static int memfds_open = 0;
+static long long memfd_bytes_open = 0;
+
+/*
+ * FUSE operations whose latency is counted for --stats-file and --slow-op.
+ * When either is given, the handlers in queuefs_oper are called through
+ * the timing wrappers in queuefs_timed_oper.
+ */
+enum Op {
+    OP_GETATTR, OP_FGETATTR, OP_READLINK, OP_OPENDIR, OP_READDIR, OP_RELEASEDIR,
+    OP_MKDIR, OP_SYMLINK, OP_UNLINK, OP_RMDIR, OP_RENAME, OP_LINK, OP_CHMOD,
+    OP_CHOWN, OP_TRUNCATE, OP_FTRUNCATE, OP_UTIMENS, OP_CREATE, OP_OPEN, OP_READ,
+    OP_WRITE, OP_STATFS, OP_RELEASE, OP_FSYNC,
+    NUM_OPS
+};
+
+static const char *const op_names[NUM_OPS] = {
+    "getattr", "fgetattr", "readlink", "opendir", "readdir", "releasedir",
+    "mkdir", "symlink", "unlink", "rmdir", "rename", "link", "chmod",
+    "chown", "truncate", "ftruncate", "utimens", "create", "open", "read",
+    "write", "statfs", "release", "fsync"
+};
+
+#ifdef __linux__
+/* Bytes of directory entries to fetch at once. */
+#define DIR_BUF_SIZE (128 * 1024)
+
+/*
+ * An open directory, read with getdents64 in large batches.
+ * The offsets given to FUSE are the file system's own d_off cookies,
+ * so a listing continues from the buffer without seeking.
+ */
+typedef struct DirHandle {
+    int fd;
+    off_t next_offset; /* Offset of the entry at buf_pos */
+    size_t buf_pos;
+    size_t buf_len;
+    char buf[DIR_BUF_SIZE];
+} DirHandle;
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
 /* PROTOTYPES */
 
 /* Processes the virtual path to a real path. Don't free() the result. */
@@ -87,7 +245,21 @@ static int queuefs_fgetattr(const char *path,
                             struct fuse_file_info *fi);
 static int queuefs_readlink(const char *path, char *buf, size_t size);
 static int queuefs_opendir(const char *path, struct fuse_file_info *fi);
+#ifdef __linux__
+static inline DirHandle *get_dir(struct fuse_file_info *fi);
+#else
 static inline DIR *get_dirp(struct fuse_file_info *fi);
+#endif
+static inline OpenFile *get_file(struct fuse_file_info *fi);
+static void set_file(struct fuse_file_info *fi, int fd, bool empty);
+static bool reserve_memfd(int fds, long long bytes);
+static void unreserve_memfd(int fds, long long bytes);
+static bool grow_memfd(OpenFile *of, off_t size);
+static void copy_to_memfd(OpenFile *of, const char *buf, size_t size, off_t offset);
+static void drop_memfd(OpenFile *of);
+static void start_stream(OpenFile *of, const char *path);
+static void stream_to_job(OpenFile *of, const char *buf, size_t size, off_t offset);
+static void end_stream(OpenFile *of, bool broken);
 static int queuefs_readdir(const char *path,
                            void *buf,
                            fuse_fill_dir_t filler,
@@ -129,6 +301,17 @@ static int queuefs_fsync(const char *path,
 
 static void handle_sigusr(int signum, siginfo_t* info, void* unused);
 
+static bool is_stats_file(const char *path);
+static void stats_file_attr(struct stat *stbuf);
+static int open_stats_file(struct fuse_file_info *fi);
+
+/* Adds a job for a file given by its path in the mount, unless it's ignored. */
+static bool enqueue_file(const char *path, JobInfo *info);
+static void cancel_file(const char *path, bool keep_claim);
+static bool is_ignored(const char *path);
+static void enqueue_linked_file(const char *path);
+static void enqueue_claimed_file(const char *rel_path);
+
 static void print_usage(const char *progname);
 static void atexit_func();
 static int process_option(void *data,
@@ -155,14 +338,54 @@ static void *queuefs_init() {
     DPRINTF("queuefs daemon pid is %d", (int)getpid());
 
     JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
     jqs.cmd_template = settings.cmd_template;
+    jqs.source_dir = settings.mntsrc;
     jqs.max_workers = settings.max_workers;
+    jqs.shards = settings.shards;
+    jqs.max_start_rate = settings.max_start_rate;
+    jqs.start_burst = settings.start_burst;
+    jqs.smallest_first = settings.smallest_first;
+    jqs.max_running_bytes = settings.max_running_bytes;
     jqs.retry_wait_ms = settings.retry_wait_ms;
-    settings.jobqueue = jobqueue_create(&jqs);
+    jqs.timeout_ms = settings.timeout_ms;
+    jqs.kill_grace_ms = settings.kill_grace_ms;
+    jqs.trace_file = settings.trace_file;
+    jqs.record_file = settings.record_file;
+    jqs.job_log_dir = settings.job_log_dir;
+    jqs.job_log_file = settings.job_log_file;
+    jqs.job_log_max_bytes = settings.job_log_max_bytes;
+    jqs.dedup_index = settings.dedup_index;
+    jqs.stdin_file = settings.stdin_file;
+    jqs.delete_on_finish = settings.delete_on_finish;
+    jqs.move_on_finish_dir = settings.move_on_finish_dir;
+    jqs.claim_dir = settings.claim_dir;
+    jqs.queue_cpus = settings.queue_cpus;
+    jqs.worker_cpus = settings.worker_cpus;
+    jqs.worker_placement = settings.worker_placement;
+    bool adopted = settings.handoff_fd != -1;
+    if (adopted) {
+        settings.jobqueue = jobqueue_adopt(&settings.handoff_jq);
+        handoff_complete(settings.handoff_fd);
+        settings.handoff_fd = -1;
+    } else {
+        settings.jobqueue = jobqueue_create(&jqs);
+    }
     if (!settings.jobqueue) {
         fprintf(stderr, "Failed to create job queue.\n");
         fuse_exit(fuse_get_context()->fuse);
     }
+
+    /* After the job queue is started so that it doesn't inherit this. New threads do. */
+    if (settings.fuse_cpus && !cpuset_pin_process(settings.fuse_cpus)) {
+        fprintf(stderr, "Failed to pin FUSE threads: %s\n", strerror(errno));
+    }
+
+    if (settings.jobqueue && settings.handoff_socket) {
+        if (!handoff_listen(settings.handoff_socket, settings.handoff_mountpoint, settings.jobqueue)) {
+            fprintf(stderr, "Failed to listen on %s: %s\n", settings.handoff_socket, strerror(errno));
+        }
+    }
     
     if (fchdir(settings.mntsrc_fd) != 0) {
         fprintf(stderr, "Could not change working directory to '%s': %s\n",
@@ -170,6 +393,23 @@ static void *queuefs_init() {
         fuse_exit(fuse_get_context()->fuse);
     }
 
+    if (settings.jobqueue) {
+        admission_init(&settings.admission, settings.jobqueue);
+    }
+
+    if (settings.dedup_index && !dedup_init(settings.dedup_index)) {
+        fprintf(stderr, "Failed to open dedup index %s: %s\n", settings.dedup_index, strerror(errno));
+        fuse_exit(fuse_get_context()->fuse);
+    }
+
+    /* Claims left over from a crash are ours to queue again, unless the queue was handed over. */
+    if (settings.jobqueue && settings.claim_dir &&
+            !claim_init(settings.claim_dir, settings.claim_mountpoint, settings.claim_lease_ms,
+                        !adopted, &enqueue_claimed_file)) {
+        fprintf(stderr, "Failed to use claim directory %s: %s\n", settings.claim_dir, strerror(errno));
+        fuse_exit(fuse_get_context()->fuse);
+    }
+
     struct sigaction sa;
     sa.sa_sigaction = &handle_sigusr;
     sa.sa_flags = SA_SIGINFO | SA_RESTART;
@@ -186,10 +426,19 @@ static void queuefs_destroy(void *private_data) {
     sigaction(SIGUSR1, &sa, NULL);
     sigaction(SIGUSR2, &sa, NULL);
 
+    claim_shutdown();
+    opstats_shutdown();
     jobqueue_destroy(settings.jobqueue);
+    dedup_shutdown();
+    orderkey_free(settings.order_key);
+    settings.order_key = NULL;
 }
 
 static int queuefs_getattr(const char *path, struct stat *stbuf) {
+    if (is_stats_file(path)) {
+        stats_file_attr(stbuf);
+        return 0;
+    }
     path = process_path(path);
 
     if (lstat(path, stbuf) == -1)
@@ -202,7 +451,12 @@ static int queuefs_fgetattr(const char *path,
                             struct fuse_file_info *fi) {
     path = process_path(path);
 
-    if (fstat(fi->fh, stbuf) == -1)
+    OpenFile *of = get_file(fi);
+    if (of->stats) {
+        stats_file_attr(stbuf);
+        return 0;
+    }
+    if (fstat(of->fd, stbuf) == -1)
         return -errno;
     return 0;
 }
@@ -218,6 +472,82 @@ static int queuefs_readlink(const char *path, char *buf, size_t size) {
     return 0;
 }
 
+#ifdef __linux__
+static int queuefs_opendir(const char *path, struct fuse_file_info *fi) {
+    path = process_path(path);
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return -errno;
+
+    DirHandle *dh = malloc(sizeof(DirHandle));
+    if (dh == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    dh->fd = fd;
+    dh->next_offset = 0;
+    dh->buf_pos = 0;
+    dh->buf_len = 0;
+    fi->fh = (uintptr_t) dh;
+    return 0;
+}
+
+static inline DirHandle *get_dir(struct fuse_file_info *fi) {
+    return (DirHandle *) (uintptr_t) fi->fh;
+}
+
+static int queuefs_readdir(const char *path,
+                           void *buf,
+                           fuse_fill_dir_t filler,
+                           off_t offset,
+                           struct fuse_file_info *fi) {
+    DirHandle *dh = get_dir(fi);
+    (void) path;
+
+    /* Only a rewind or a seek by the client needs the buffer refilled */
+    if (offset != dh->next_offset) {
+        if (lseek(dh->fd, offset, SEEK_SET) == -1)
+            return -errno;
+        dh->next_offset = offset;
+        dh->buf_pos = 0;
+        dh->buf_len = 0;
+    }
+
+    while (1) {
+        if (dh->buf_pos >= dh->buf_len) {
+            long res = syscall(SYS_getdents64, dh->fd, dh->buf, sizeof(dh->buf));
+            if (res == -1)
+                return -errno;
+            if (res == 0)
+                break;
+            dh->buf_pos = 0;
+            dh->buf_len = res;
+        }
+
+        struct linux_dirent64 *de = (struct linux_dirent64 *) (dh->buf + dh->buf_pos);
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = de->d_ino;
+        st.st_mode = de->d_type << 12;
+        /* When FUSE's buffer is full, this entry is the first one next time */
+        if (filler(buf, de->d_name, &st, de->d_off))
+            break;
+        dh->buf_pos += de->d_reclen;
+        dh->next_offset = de->d_off;
+    }
+
+    return 0;
+}
+
+static int queuefs_releasedir(const char *path, struct fuse_file_info *fi) {
+    DirHandle *dh = get_dir(fi);
+    (void) path;
+    close(dh->fd);
+    free(dh);
+    return 0;
+}
+#else
 static int queuefs_opendir(const char *path, struct fuse_file_info *fi) {
     path = process_path(path);
 
@@ -261,8 +591,11 @@ static int queuefs_releasedir(const char *path, struct fuse_file_info *fi) {
     closedir(dp);
     return 0;
 }
+#endif
 
 static int queuefs_mkdir(const char *path, mode_t mode) {
+    if (is_stats_file(path))
+        return -EEXIST;
     path = process_path(path);
 
     int res = mkdir(path, mode & 0777);
@@ -273,16 +606,22 @@ static int queuefs_mkdir(const char *path, mode_t mode) {
 }
 
 static int queuefs_unlink(const char *path) {
+    if (is_stats_file(path))
+        return -EACCES;
+    const char *mount_path = path;
     path = process_path(path);
 
     int res = unlink(path);
     if (res == -1)
         return -errno;
 
+    cancel_file(mount_path, false);
     return 0;
 }
 
 static int queuefs_rmdir(const char *path) {
+    if (is_stats_file(path))
+        return -ENOTDIR;
     path = process_path(path);
 
     int res = rmdir(path);
@@ -293,6 +632,8 @@ static int queuefs_rmdir(const char *path) {
 }
 
 static int queuefs_symlink(const char *from, const char *to) {
+    if (is_stats_file(to))
+        return -EEXIST;
     to = process_path(to);
 
     int res = symlink(from, to);
@@ -303,6 +644,9 @@ static int queuefs_symlink(const char *from, const char *to) {
 }
 
 static int queuefs_rename(const char *from, const char *to) {
+    if (is_stats_file(from) || is_stats_file(to))
+        return -EACCES;
+    const char *mount_path = to;
     from = process_path(from);
     to = process_path(to);
 
@@ -310,10 +654,20 @@ static int queuefs_rename(const char *from, const char *to) {
     if (res == -1)
         return -errno;
 
+    /* Any job for the file it replaced is for content that's gone.
+       In rename mode, the claim is still good for the new file. */
+    cancel_file(mount_path, settings.enqueue_on_rename);
+    if (settings.enqueue_on_rename)
+        enqueue_linked_file(mount_path);
     return 0;
 }
 
 static int queuefs_link(const char *from, const char *to) {
+    if (is_stats_file(to))
+        return -EEXIST;
+    if (is_stats_file(from))
+        return -EACCES;
+    const char *mount_path = to;
     from = process_path(from);
     to = process_path(to);
 
@@ -321,10 +675,14 @@ static int queuefs_link(const char *from, const char *to) {
     if (res == -1)
         return -errno;
 
+    if (settings.enqueue_on_rename)
+        enqueue_linked_file(mount_path);
     return 0;
 }
 
 static int queuefs_chmod(const char *path, mode_t mode) {
+    if (is_stats_file(path))
+        return -EACCES;
     path = process_path(path);
 
     if (chmod(path, mode) == -1)
@@ -334,6 +692,8 @@ static int queuefs_chmod(const char *path, mode_t mode) {
 }
 
 static int queuefs_chown(const char *path, uid_t uid, gid_t gid) {
+    if (is_stats_file(path))
+        return -EACCES;
     path = process_path(path);
     int res = lchown(path, uid, gid);
     if (res == -1)
@@ -343,6 +703,8 @@ static int queuefs_chown(const char *path, uid_t uid, gid_t gid) {
 }
 
 static int queuefs_truncate(const char *path, off_t size) {
+    if (is_stats_file(path))
+        return -EACCES;
     path = process_path(path);
 
     int res = truncate(path, size);
@@ -357,14 +719,28 @@ static int queuefs_ftruncate(const char *path,
                              struct fuse_file_info *fi) {
     (void) path;
 
-    int res = ftruncate(fi->fh, size);
+    OpenFile *of = get_file(fi);
+    if (of->stats)
+        return -EACCES;
+    int res = ftruncate(of->fd, size);
     if (res == -1)
         return -errno;
 
+    pthread_mutex_lock(&of->mutex);
+    if (size != of->hashed_bytes)
+        of->hashing = false;
+    if (of->memfd != -1 && (!grow_memfd(of, size) || ftruncate(of->memfd, size) == -1))
+        drop_memfd(of);
+    if (size != of->streamed_bytes)
+        end_stream(of, true);
+    pthread_mutex_unlock(&of->mutex);
+
     return 0;
 }
 
 static int queuefs_utimens(const char *path, const struct timespec tv[2]) {
+    if (is_stats_file(path))
+        return -EACCES;
     path = process_path(path);
 
     int res = utimensat(settings.mntsrc_fd, path, tv, 0);
@@ -377,34 +753,248 @@ static int queuefs_utimens(const char *path, const struct timespec tv[2]) {
 static int queuefs_create(const char *path,
                           mode_t mode,
                           struct fuse_file_info *fi) {
+    if (is_stats_file(path))
+        return -EEXIST;
+    const char *mount_path = path;
     path = process_path(path);
 
+    int res = admission_check();
+    if (res != 0)
+        return res;
+
     int fd = open(path, fi->flags, mode & 0777);
+    TRACE_PROBE2(create, path, fd);
     if (fd == -1)
         return -errno;
 
-    fi->fh = fd;
+    struct stat st;
+    bool empty = fstat(fd, &st) == 0 && st.st_size == 0;
+    set_file(fi, fd, empty);
+    if (settings.stream && empty)
+        start_stream(get_file(fi), mount_path);
     return 0;
 }
 
 static int queuefs_open(const char *path, struct fuse_file_info *fi) {
+    if (is_stats_file(path))
+        return open_stats_file(fi);
     path = process_path(path);
 
     int fd = open(path, fi->flags);
     if (fd == -1)
         return -errno;
 
-    fi->fh = fd;
+    set_file(fi, fd, (fi->flags & O_TRUNC) != 0);
     return 0;
 }
 
+static inline OpenFile *get_file(struct fuse_file_info *fi) {
+    return (OpenFile *) (uintptr_t) fi->fh;
+}
+
+static void set_file(struct fuse_file_info *fi, int fd, bool empty) {
+    OpenFile *of = malloc(sizeof(OpenFile));
+    of->fd = fd;
+    pthread_mutex_init(&of->mutex, NULL);
+    of->hashing = settings.dedup_index != NULL && empty;
+    of->hashed_bytes = 0;
+    if (of->hashing)
+        hash_init(&of->hash);
+    of->memfd = -1;
+    of->memfd_bytes = 0;
+    of->numa_node = -1;
+    of->stream_path = NULL;
+    of->stream_pipe = -1;
+    of->stream_src = -1;
+    of->streamed_bytes = 0;
+    of->stream_broken = false;
+    of->stats = NULL;
+    of->stats_len = 0;
+#ifdef HAVE_MEMFD_CREATE
+    if (settings.stdin_memfd_max > 0 && empty && reserve_memfd(1, 0)) {
+        of->memfd = memfd_create("queuefs", MFD_CLOEXEC);
+        if (of->memfd == -1)
+            unreserve_memfd(1, 0);
+    }
+#endif
+    fi->fh = (uintptr_t) of;
+}
+
+/* Returns false if the budget has no room for fds more memfds and bytes more in them. */
+static bool reserve_memfd(int fds, long long bytes) {
+    int held_fds;
+    long long held_bytes;
+    jobqueue_get_stdin_fds(settings.jobqueue, &held_fds, &held_bytes);
+    int open_fds = __sync_add_and_fetch(&memfds_open, fds);
+    long long open_bytes = __sync_add_and_fetch(&memfd_bytes_open, bytes);
+    if (open_fds + held_fds > settings.stdin_memfd_count ||
+        open_bytes + held_bytes > settings.stdin_memfd_total) {
+        unreserve_memfd(fds, bytes);
+        return false;
+    }
+    return true;
+}
+
+static void unreserve_memfd(int fds, long long bytes) {
+    __sync_fetch_and_sub(&memfds_open, fds);
+    __sync_fetch_and_sub(&memfd_bytes_open, bytes);
+}
+
+/* Must be called with of->mutex held. Returns false if the memfd may not be size bytes. */
+static bool grow_memfd(OpenFile *of, off_t size) {
+    if (size <= of->memfd_bytes)
+        return true;
+    if (size > settings.stdin_memfd_max || !reserve_memfd(0, size - of->memfd_bytes))
+        return false;
+    of->memfd_bytes = size;
+    return true;
+}
+
+/* Must be called with of->mutex held. */
+static void copy_to_memfd(OpenFile *of, const char *buf, size_t size, off_t offset) {
+    if (!grow_memfd(of, offset + (off_t)size)) {
+        drop_memfd(of);
+        return;
+    }
+    while (size > 0) {
+        ssize_t res = pwrite(of->memfd, buf, size, offset);
+        if (res <= 0) {
+            drop_memfd(of);
+            return;
+        }
+        buf += res;
+        size -= res;
+        offset += res;
+    }
+}
+
+/* Must be called with of->mutex held. */
+static void drop_memfd(OpenFile *of) {
+    close(of->memfd);
+    of->memfd = -1;
+    unreserve_memfd(1, of->memfd_bytes);
+    of->memfd_bytes = 0;
+}
+
+/* Queues the job of a new file with a pipe as its stdin. */
+static void start_stream(OpenFile *of, const char *path) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) {
+        DPRINTF("Failed to create stream pipe: %d", errno);
+        return;
+    }
+    for (int i = 0; i < 2; ++i)
+        fcntl(pipe_fds[i], F_SETFD, FD_CLOEXEC);
+    fcntl(pipe_fds[1], F_SETFL, O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, STREAM_PIPE_SIZE); /* Best effort */
+#endif
+
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    info.stdin_fd = pipe_fds[0];
+    bool queued = enqueue_file(path, &info);
+    close(pipe_fds[0]); /* The job queue has its own copy */
+    if (!queued) {
+        close(pipe_fds[1]);
+        return;
+    }
+
+    of->stream_path = strdup(path);
+    of->stream_pipe = pipe_fds[1];
+#ifdef HAVE_SPLICE
+    of->stream_src = openat(settings.mntsrc_fd, process_path(path), O_RDONLY | O_CLOEXEC);
+#endif
+    if (of->memfd != -1)
+        drop_memfd(of);
+}
+
+/* Must be called with of->mutex held. */
+static void stream_to_job(OpenFile *of, const char *buf, size_t size, off_t offset) {
+    if (offset != of->streamed_bytes) {
+        end_stream(of, true);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long deadline_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000 + settings.stream_wait_ms;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t res;
+#ifdef HAVE_SPLICE
+        if (of->stream_src != -1) {
+            /* Moves the pages just written from the page cache without copying them. */
+            loff_t src_offset = offset + done;
+            res = splice(of->stream_src, &src_offset, of->stream_pipe, NULL, size - done, SPLICE_F_NONBLOCK);
+            if (res == 0 || (res == -1 && errno == EINVAL)) {
+                close(of->stream_src);
+                of->stream_src = -1;
+                continue;
+            }
+        } else
+#endif
+        res = write(of->stream_pipe, buf + done, size - done);
+        if (res > 0) {
+            done += res;
+        } else if (errno == EAGAIN) {
+            /* The job is slow or hasn't started. Wait for it a while. */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long wait_ms = deadline_ms - (now.tv_sec * 1000LL + now.tv_nsec / 1000000);
+            struct pollfd pfd = { .fd = of->stream_pipe, .events = POLLOUT };
+            if (wait_ms <= 0 || (poll(&pfd, 1, wait_ms) == 0)) {
+                DPRINTF("Job of %s didn't keep up with the stream", of->stream_path);
+                break;
+            }
+        } else if (errno != EINTR) {
+            break; /* EPIPE if the job is gone */
+        }
+    }
+
+    if (done < size)
+        end_stream(of, true);
+    else
+        of->streamed_bytes += size;
+}
+
+/*
+ * Closes the pipe, which the job sees as the end of the file. If the stream
+ * is incomplete, the job is canceled so that it's queued again at close.
+ * The cancel goes first, since a job whose worker exited early is queued
+ * again by the job queue when the pipe is closed (see JobInfo).
+ * Must be called with of->mutex held or when the file is closed.
+ */
+static void end_stream(OpenFile *of, bool broken) {
+    if (of->stream_pipe == -1)
+        return;
+    if (broken) {
+        of->stream_broken = true;
+        cancel_file(of->stream_path, true);
+    }
+    close(of->stream_pipe);
+    of->stream_pipe = -1;
+    if (of->stream_src != -1) {
+        close(of->stream_src);
+        of->stream_src = -1;
+    }
+}
+
 static int queuefs_read(const char *path,
                         char *buf,
                         size_t size,
                         off_t offset,
                         struct fuse_file_info *fi) {
     (void) path;
-    int res = pread(fi->fh, buf, size, offset);
+    OpenFile *of = get_file(fi);
+    if (of->stats) {
+        if (offset >= (off_t)of->stats_len)
+            return 0;
+        if (size > of->stats_len - offset)
+            size = of->stats_len - offset;
+        memcpy(buf, of->stats + offset, size);
+        return size;
+    }
+    int res = pread(of->fd, buf, size, offset);
     if (res == -1)
         res = -errno;
 
@@ -417,10 +1007,31 @@ static int queuefs_write(const char *path,
                          off_t offset,
                          struct fuse_file_info *fi) {
     (void) path;
-    int res = pwrite(fi->fh, buf, size, offset);
+    OpenFile *of = get_file(fi);
+    TRACE_PROBE3(write, of->fd, size, offset);
+    int res = pwrite(of->fd, buf, size, offset);
     if (res == -1)
         res = -errno;
 
+    /* The page cache pages are normally allocated on the writing CPU's node. */
+    if (settings.worker_placement == JOBQUEUE_PLACE_LOCAL)
+        of->numa_node = cpuset_current_node();
+
+    if (res > 0 && (of->hashing || of->memfd != -1 || of->stream_pipe != -1)) {
+        pthread_mutex_lock(&of->mutex);
+        if (of->hashing && offset == of->hashed_bytes) {
+            hash_update(&of->hash, buf, res);
+            of->hashed_bytes += res;
+        } else {
+            of->hashing = false;
+        }
+        if (of->memfd != -1)
+            copy_to_memfd(of, buf, res, offset);
+        if (of->stream_pipe != -1)
+            stream_to_job(of, buf, res, offset);
+        pthread_mutex_unlock(&of->mutex);
+    }
+
     return res;
 }
 
@@ -431,21 +1042,173 @@ static int queuefs_statfs(const char *path, struct statvfs *stbuf) {
     if (res == -1)
         return -errno;
 
+    admission_adjust_statvfs(stbuf);
     return 0;
 }
 
 static int queuefs_release(const char *path, struct fuse_file_info *fi) {
     assert(path != NULL);
-    close(fi->fh);
+
+    OpenFile *of = get_file(fi);
+    if (of->stats) {
+        free(of->stats);
+        pthread_mutex_destroy(&of->mutex);
+        free(of);
+        return 0;
+    }
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    char hash[HASH_HEX_LEN + 1];
+    struct stat st;
+    bool have_size = fstat(of->fd, &st) == 0;
+    info.numa_node = of->numa_node;
+    if (have_size) {
+        info.bytes = st.st_size;
+        /* A size mismatch means something else wrote to the file.
+           Empty files are often markers, so they're never skipped. */
+        if (of->hashing && of->hashed_bytes == st.st_size && st.st_size > 0) {
+            hash_final(&of->hash, hash);
+            info.hash = hash;
+        }
+        /* Likewise, only a memfd matching the file's size is used. */
+        struct stat memfd_st;
+        if (of->memfd != -1 && fstat(of->memfd, &memfd_st) == 0 && memfd_st.st_size == st.st_size) {
+            info.stdin_fd = of->memfd;
+            of->memfd = -1;
+        }
+    }
+    if (of->memfd != -1)
+        drop_memfd(of);
+    /* Counted as open until the job queue has counted it as held. */
+    long long memfd_bytes = of->memfd_bytes;
+    /* The job of a complete stream is already queued and gets EOF now. */
+    bool streamed = false;
+    if (of->stream_path) {
+        streamed = of->stream_pipe != -1 && have_size && of->streamed_bytes == st.st_size;
+        end_stream(of, !streamed);
+        free(of->stream_path);
+    }
+    close(of->fd);
+    pthread_mutex_destroy(&of->mutex);
+    free(of);
+
+    TRACE_PROBE1(release, path);
+    if (!settings.enqueue_on_rename && !streamed)
+        enqueue_file(path, &info);
+    if (info.stdin_fd != -1) {
+        close(info.stdin_fd);
+        unreserve_memfd(1, memfd_bytes);
+    }
+
+    return 0;
+}
+
+/* Returns false if the file was skipped. */
+static bool enqueue_file(const char *path, JobInfo *info) {
+    if (is_ignored(path)) {
+        DPRINTF("Ignoring %s", path);
+        return false;
+    }
 
     size_t mntsrc_pathlen = settings.mntsrc_pathlen;
     size_t pathlen = strlen(path);
     char* abs_path = alloca(mntsrc_pathlen + pathlen + 1);
     strcpy(abs_path, settings.mntsrc);
     strcpy(abs_path + mntsrc_pathlen, path);
-    jobqueue_add_file(settings.jobqueue, abs_path);
+    TRACE_PROBE1(enqueue, abs_path);
+    bool duplicate = info->hash && dedup_seen(info->hash);
+    bool finish_actions = settings.delete_on_finish || settings.move_on_finish_dir;
+    if (duplicate && !finish_actions) {
+        DPRINTF("Skipping %s: content %s was already processed", abs_path, info->hash);
+        return false;
+    }
+    if (settings.claim_dir && !claim_acquire(process_path(path))) {
+        DPRINTF("Skipping %s: another instance has claimed it", abs_path);
+        return false;
+    }
+    if (duplicate) {
+        /* Deleted or moved like a processed file, by the job queue so that
+           it's not done under a job still queued for an earlier version. */
+        DPRINTF("Skipping %s: content %s was already processed", abs_path, info->hash);
+        JobInfo done_info;
+        jobqueue_job_info_init(&done_info);
+        done_info.done = true;
+        jobqueue_add_job(settings.jobqueue, abs_path, &done_info);
+        return false;
+    }
+    gchar *order_key = NULL;
+    if (settings.order_key) {
+        order_key = orderkey_get(settings.order_key, process_path(path));
+        info->order_key = order_key;
+    }
+    jobqueue_add_job(settings.jobqueue, abs_path, info);
+    g_free(order_key);
+    return true;
+}
 
-    return 0;
+/* Drops or stops the jobs of a file that was deleted or replaced. */
+static void cancel_file(const char *path, bool keep_claim) {
+    if (!settings.jobqueue || is_ignored(path))
+        return;
+
+    size_t mntsrc_pathlen = settings.mntsrc_pathlen;
+    char* abs_path = alloca(mntsrc_pathlen + strlen(path) + 1);
+    strcpy(abs_path, settings.mntsrc);
+    strcpy(abs_path + mntsrc_pathlen, path);
+    TRACE_PROBE1(cancel, abs_path);
+    jobqueue_cancel(settings.jobqueue, abs_path);
+    if (settings.claim_dir && !keep_claim)
+        claim_release(process_path(path));
+}
+
+/* Patterns with a slash match the whole path, others just the file name. */
+static bool is_ignored(const char *path) {
+    if (settings.ignore_patterns == NULL)
+        return false;
+
+    const char *rel_path = process_path(path);
+    const char *name = my_basename(rel_path);
+    for (char **pattern = settings.ignore_patterns; *pattern; ++pattern) {
+        if (strchr(*pattern, '/')) {
+            if (fnmatch(*pattern, rel_path, FNM_PATHNAME) == 0)
+                return true;
+        } else if (fnmatch(*pattern, name, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Enqueues a file that was just renamed or linked to path, if it's a regular file. */
+static void enqueue_linked_file(const char *path) {
+    struct stat st;
+    if (lstat(process_path(path), &st) == -1 || !S_ISREG(st.st_mode))
+        return;
+
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    info.bytes = st.st_size;
+    enqueue_file(path, &info);
+}
+
+/* Enqueues a file whose claim we took over from a dead instance. */
+static void enqueue_claimed_file(const char *rel_path) {
+    struct stat st;
+    if (lstat(rel_path, &st) == -1 || !S_ISREG(st.st_mode)) {
+        /* Processed and deleted, but the claim outlived it */
+        gchar *claim_file = claim_file_name(settings.claim_dir, rel_path);
+        unlink(claim_file);
+        g_free(claim_file);
+        return;
+    }
+
+    char *path = alloca(strlen(rel_path) + 2);
+    path[0] = '/';
+    strcpy(path + 1, rel_path);
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    info.bytes = st.st_size;
+    enqueue_file(path, &info);
 }
 
 static int queuefs_fsync(const char *path,
@@ -458,10 +1221,10 @@ static int queuefs_fsync(const char *path,
     (void) isdatasync;
 #else
     if (isdatasync)
-    res = fdatasync(fi->fh);
+    res = fdatasync(get_file(fi)->fd);
     else
 #endif
-    res = fsync(fi->fh);
+    res = fsync(get_file(fi)->fd);
     if (res == -1)
         return -errno;
 
@@ -478,6 +1241,43 @@ static void handle_sigusr(int signum, siginfo_t* info, void* unused)
     }
 }
 
+/* The stats file hides whatever is at its path in the source directory, so nothing may change that. */
+static bool is_stats_file(const char *path) {
+    return settings.stats_file != NULL && strcmp(path, settings.stats_file) == 0;
+}
+
+/* Read-only and owned by whoever owns the source directory. The size is unknown until it's opened. */
+static void stats_file_attr(struct stat *stbuf) {
+    fstat(settings.mntsrc_fd, stbuf);
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = 0;
+    stbuf->st_blocks = 0;
+}
+
+/* Takes a snapshot of the statistics for the reader. */
+static int open_stats_file(struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+
+    char *ops = opstats_report();
+    long jobs;
+    long long bytes;
+    jobqueue_get_backlog(settings.jobqueue, &jobs, &bytes);
+    size_t len = strlen(ops) + 64;
+    char *report = malloc(len);
+    snprintf(report, len, "%s\nbacklog: %ld jobs, %lld bytes\n", ops, jobs, bytes);
+    g_free(ops);
+
+    set_file(fi, -1, false);
+    OpenFile *of = get_file(fi);
+    of->stats = report;
+    of->stats_len = strlen(report);
+    /* Reads must not stop at the size of 0 that getattr gave */
+    fi->direct_io = 1;
+    return 0;
+}
+
 static struct fuse_operations queuefs_oper = {
     .init = queuefs_init,
     .destroy = queuefs_destroy,
@@ -509,6 +1309,80 @@ static struct fuse_operations queuefs_oper = {
     .flag_nullpath_ok = 0  // We use the path in release()
 };
 
+/* Defines timed_<op>, which calls queuefs_<op> and counts how long it took. */
+#define TIMED_OP(op, index, params, args, path) \
+    static int timed_##op params { \
+        long long start = opstats_start(); \
+        int res = queuefs_##op args; \
+        opstats_finish(index, start, path); \
+        return res; \
+    }
+
+TIMED_OP(getattr, OP_GETATTR, (const char *path, struct stat *stbuf), (path, stbuf), path)
+TIMED_OP(fgetattr, OP_FGETATTR, (const char *path, struct stat *stbuf, struct fuse_file_info *fi),
+         (path, stbuf, fi), path)
+TIMED_OP(readlink, OP_READLINK, (const char *path, char *buf, size_t size), (path, buf, size), path)
+TIMED_OP(opendir, OP_OPENDIR, (const char *path, struct fuse_file_info *fi), (path, fi), path)
+TIMED_OP(readdir, OP_READDIR,
+         (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi),
+         (path, buf, filler, offset, fi), path)
+TIMED_OP(releasedir, OP_RELEASEDIR, (const char *path, struct fuse_file_info *fi), (path, fi), path)
+TIMED_OP(mkdir, OP_MKDIR, (const char *path, mode_t mode), (path, mode), path)
+TIMED_OP(symlink, OP_SYMLINK, (const char *from, const char *to), (from, to), to)
+TIMED_OP(unlink, OP_UNLINK, (const char *path), (path), path)
+TIMED_OP(rmdir, OP_RMDIR, (const char *path), (path), path)
+TIMED_OP(rename, OP_RENAME, (const char *from, const char *to), (from, to), to)
+TIMED_OP(link, OP_LINK, (const char *from, const char *to), (from, to), to)
+TIMED_OP(chmod, OP_CHMOD, (const char *path, mode_t mode), (path, mode), path)
+TIMED_OP(chown, OP_CHOWN, (const char *path, uid_t uid, gid_t gid), (path, uid, gid), path)
+TIMED_OP(truncate, OP_TRUNCATE, (const char *path, off_t size), (path, size), path)
+TIMED_OP(ftruncate, OP_FTRUNCATE, (const char *path, off_t size, struct fuse_file_info *fi),
+         (path, size, fi), path)
+TIMED_OP(utimens, OP_UTIMENS, (const char *path, const struct timespec tv[2]), (path, tv), path)
+TIMED_OP(create, OP_CREATE, (const char *path, mode_t mode, struct fuse_file_info *fi),
+         (path, mode, fi), path)
+TIMED_OP(open, OP_OPEN, (const char *path, struct fuse_file_info *fi), (path, fi), path)
+TIMED_OP(read, OP_READ,
+         (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+         (path, buf, size, offset, fi), path)
+TIMED_OP(write, OP_WRITE,
+         (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+         (path, buf, size, offset, fi), path)
+TIMED_OP(statfs, OP_STATFS, (const char *path, struct statvfs *stbuf), (path, stbuf), path)
+TIMED_OP(release, OP_RELEASE, (const char *path, struct fuse_file_info *fi), (path, fi), path)
+TIMED_OP(fsync, OP_FSYNC, (const char *path, int isdatasync, struct fuse_file_info *fi),
+         (path, isdatasync, fi), path)
+
+static struct fuse_operations queuefs_timed_oper = {
+    .init = queuefs_init,
+    .destroy = queuefs_destroy,
+    .getattr = timed_getattr,
+    .fgetattr = timed_fgetattr,
+    .readlink = timed_readlink,
+    .opendir = timed_opendir,
+    .readdir = timed_readdir,
+    .releasedir = timed_releasedir,
+    .mkdir = timed_mkdir,
+    .symlink = timed_symlink,
+    .unlink = timed_unlink,
+    .rmdir = timed_rmdir,
+    .rename = timed_rename,
+    .link = timed_link,
+    .chmod = timed_chmod,
+    .chown = timed_chown,
+    .truncate = timed_truncate,
+    .ftruncate = timed_ftruncate,
+    .utimens = timed_utimens,
+    .create = timed_create,
+    .open = timed_open,
+    .read = timed_read,
+    .write = timed_write,
+    .statfs = timed_statfs,
+    .release = timed_release,
+    .fsync = timed_fsync,
+    .flag_nullpath_ok = 0
+};
+
 static void print_usage(const char *progname) {
     if (progname == NULL)
         progname = "queuefs";
@@ -518,6 +1392,9 @@ static void print_usage(const char *progname) {
         "\n"
         "The command is executed by /bin/sh with each occurrence of {}\n"
         "replaced by the absolute path to the file that was written.\n"
+        "Also replaced are {rel} (the path relative to dir), {base}\n"
+        "(the file name), {stem} (the file name without its extension),\n"
+        "{attempt} (1 on the first run of a job) and {id} (the job's ID).\n"
         "\n"
         "Information:\n"
         "  -h      --help            Print this and exit.\n"
@@ -526,8 +1403,113 @@ static void print_usage(const char *progname) {
         "Options:\n"
         "  -r n    --retry-delay=n   Milliseconds to wait before retrying\n"
         "                            a failed job. Default: 30000\n"
+        "          --shards=n        Number of job queue processes, each with\n"
+        "                            its own queue. Default: 1\n"
+        "          --max-rate=n[:burst]\n"
+        "                            Start at most n jobs per second, or\n"
+        "                            burst at once after a pause. Default\n"
+        "                            burst: 1\n"
+        "          --smallest-first=n\n"
+        "                            Let jobs estimated to be shorter go\n"
+        "                            ahead of ones that came up to n times\n"
+        "                            their estimated run time before them.\n"
+        "          --max-running-bytes=size\n"
+        "                            Run jobs whose files add up to at most\n"
+        "                            size at once.\n"
+        "  -t n    --timeout=n       Milliseconds a job may run before it is\n"
+        "                            sent SIGTERM and counted as failed.\n"
+        "                            Default: 0 (no limit)\n"
+        "          --kill-grace=n    Milliseconds to wait after SIGTERM before\n"
+        "                            sending SIGKILL. Default: 5000\n"
+        "          --trace=file      Write a Chrome trace event file\n"
+        "                            of job lifecycles.\n"
+        "          --record=file     Append each job's arrival and runs to\n"
+        "                            file for replaying with different\n"
+        "                            settings.\n"
+        "          --handoff=socket  Take over from an instance listening on\n"
+        "                            socket, then listen for the next one.\n"
+        "          --job-log-dir=dir Save each job's output to dir/<id>.log.\n"
+        "                            Logs of successful runs are deleted.\n"
+        "          --job-log=file    Append all jobs' output to file, each\n"
+        "                            line prefixed with the job ID and path.\n"
+        "          --job-log-size=n  Maximum size of a job's own log and of\n"
+        "                            the shared log before it is rotated\n"
+        "                            to file.1. 0 for none. Default: 1048576\n"
+        "          --dedup-index=file\n"
+        "                            Skip files whose content has been\n"
+        "                            processed successfully before, recording\n"
+        "                            hashes of processed content in file.\n"
+        "          --stdin           Give each job the file as its stdin.\n"
+        "          --stdin-memfd=size[:total]\n"
+        "                            Like --stdin, but keep new files up to\n"
+        "                            size in memory for the job to read, and\n"
+        "                            up to total bytes of them at once.\n"
+        "                            Default total: 64 times size\n"
+        "          --stream          Start the job of a new file when it's\n"
+        "                            created and give it the data as it's\n"
+        "                            written on stdin. Implies --stdin.\n"
+        "          --stream-wait=n   Milliseconds a write may wait for the\n"
+        "                            job to read before the job is canceled\n"
+        "                            and queued normally. Default: 10000\n"
+        "          --claim-dir=dir   Share the source directory with other\n"
+        "                            instances using claims in dir.\n"
+        "          --claim-lease=n   Milliseconds after which an instance\n"
+        "                            that stopped sending heartbeats loses\n"
+        "                            its claims. Default: 30000\n"
+        "          --delete-on-finish\n"
+        "                            Delete each file when its job succeeds.\n"
+        "          --move-on-finish=dir\n"
+        "                            Move each file to dir when its job\n"
+        "                            succeeds. dir must be on the same\n"
+        "                            file system.\n"
+        "          --enqueue-on=close|rename\n"
+        "                            Whether a file gets a job when it's\n"
+        "                            closed after writing, or when it's\n"
+        "                            renamed or hard-linked into place.\n"
+        "                            Default: close\n"
+        "          --ignore=glob     Never make jobs for files whose name\n"
+        "                            matches glob, or whose path does if glob\n"
+        "                            contains a slash. May be repeated.\n"
+        "          --order-by=dir|regex:re|xattr:name\n"
+        "                            Run jobs with the same key one at a time\n"
+        "                            in the order their files came in. The key\n"
+        "                            is the file's directory, the first group\n"
+        "                            of re matched against its path, or the\n"
+        "                            value of an extended attribute.\n"
+        "          --fuse-cpus=list  Run FUSE request threads on the CPUs in\n"
+        "                            list, e.g. 0-3,8.\n"
+        "          --queue-cpus=list Run the job queue processes on list.\n"
+        "          --worker-cpus=list\n"
+        "                            Run jobs on list. Default: the CPUs\n"
+        "                            queuefs was started on.\n"
+        "          --worker-placement=any|cpu|node|local\n"
+        "                            Let each job run anywhere in its CPUs,\n"
+        "                            pin it to the least busy CPU or NUMA\n"
+        "                            node, or to the node the file was\n"
+        "                            written from. Default: any\n"
+        "          --stats-file=name Serve latency histograms of file system\n"
+        "                            operations and the backlog as the\n"
+        "                            read-only file name in the mount root.\n"
+        "          --slow-op=n       Log file system operations taking at\n"
+        "                            least n milliseconds to stderr.\n"
+        "          --max-queued=n[:m]\n"
+        "                            Refuse new files with EAGAIN while n jobs\n"
+        "                            are unfinished, until there are m.\n"
+        "                            Default m: 90%% of n\n"
+        "          --max-queued-bytes=size[:size]\n"
+        "                            The same for the total size of the\n"
+        "                            unfinished jobs' files.\n"
+        "          --min-free=size[:size]\n"
+        "                            Refuse new files with ENOSPC while less\n"
+        "                            than size is free in dir, until there is\n"
+        "                            the second size. Default: 110%% of the first\n"
+        "          --admission-wait=n\n"
+        "                            Milliseconds a new file may wait to be\n"
+        "                            admitted before failing. Default: 0\n"
         "  (TODO)\n"
         "\n"
+        "  Sizes may have a K, M, G or T suffix.\n"
+        "\n"
         "FUSE options:\n"
         "  -o opt[,opt,...]          Mount options.\n"
         "  -r      -o ro             Mount strictly read-only.\n"
@@ -540,11 +1522,95 @@ static void print_usage(const char *progname) {
 static void atexit_func() {
 }
 
+/* Takes ownership of a path given as an option and makes it absolute. */
+static char* absolute_option(char* path) {
+    if (path) {
+        char* result = make_absolute(path);
+        free(path);
+        return result;
+    } else {
+        return NULL;
+    }
+}
+
+/* The job queue parses CPU lists itself. Returns false after an error message. */
+static bool check_cpu_list(const char* option, const char* list) {
+    if (!list) {
+        return true;
+    }
+    CpuSet* set = cpuset_parse(list);
+    if (!set) {
+        fprintf(stderr, "Invalid %s: %s\n", option, list);
+        return false;
+    }
+    cpuset_free(set);
+    return true;
+}
+
+/*
+ * Parses "high[:low]" into watermarks. If low is omitted it is
+ * default_percent of high. Returns false on a syntax error.
+ */
+static bool parse_watermark(const char* str, long long* high, long long* low, int default_percent) {
+    if (!str) {
+        return true;
+    }
+    char* copy = alloca(strlen(str) + 1);
+    strcpy(copy, str);
+    char* colon = strchr(copy, ':');
+    if (colon) {
+        *colon = '\0';
+    }
+    if (!parse_size(copy, high)) {
+        return false;
+    }
+    if (colon) {
+        return parse_size(colon + 1, low);
+    } else {
+        *low = *high * default_percent / 100;
+        return true;
+    }
+}
+
+/*
+ * Parses "rate[:burst]" for --max-rate. Returns false on a syntax error
+ * or a rate the job queue can't time, over one start per microsecond.
+ */
+static bool parse_rate(const char* str, double* rate, int* burst) {
+    if (!str) {
+        return true;
+    }
+    char* end;
+    *rate = strtod(str, &end);
+    if (end == str || !(*rate > 0 && *rate <= 1000000)) {
+        return false;
+    }
+    if (*end == ':') {
+        const char* burst_str = end + 1;
+        long value = strtol(burst_str, &end, 10);
+        if (end == burst_str || value < 1 || value > INT_MAX) {
+            return false;
+        }
+        *burst = (int)value;
+    }
+    return *end == '\0';
+}
+
+/* Millisecond options are ints in JobQueueSettings. */
+static bool check_ms_option(const char* name, long value) {
+    if (value < 0 || value > INT_MAX) {
+        fprintf(stderr, "%s must be between 0 and %d.\n", name, INT_MAX);
+        return false;
+    }
+    return true;
+}
+
 enum OptionKey {
     OPTKEY_NONOPTION = -2,
     OPTKEY_UNKNOWN = -1,
     OPTKEY_HELP,
-    OPTKEY_VERSION
+    OPTKEY_VERSION,
+    OPTKEY_IGNORE
 };
 
 static int process_option(void *data,
@@ -560,6 +1626,16 @@ static int process_option(void *data,
         printf("%s\n", PACKAGE_STRING);
         exit(0);
 
+    case OPTKEY_IGNORE: {
+        size_t count = 0;
+        while (settings.ignore_patterns && settings.ignore_patterns[count])
+            ++count;
+        settings.ignore_patterns = realloc(settings.ignore_patterns, (count + 2) * sizeof(char*));
+        settings.ignore_patterns[count] = strdup(strchr(arg, '=') + 1);
+        settings.ignore_patterns[count + 1] = NULL;
+        return 0;
+    }
+
     case OPTKEY_NONOPTION:
         if (!settings.mntsrc) {
             settings.mntsrc = arg;
@@ -593,9 +1669,75 @@ int main(int argc, char *argv[]) {
     struct OptionData {
         int no_allow_other;
         long retry_delay;
+        int shards;
+        char* max_rate;
+        char* smallest_first;
+        char* max_running_bytes;
+        long timeout;
+        long kill_grace;
+        char* trace_file;
+        char* record_file;
+        char* job_log_dir;
+        char* job_log_file;
+        long job_log_size;
+        char* handoff;
+        char* dedup_index;
+        int stdin_file;
+        char* stdin_memfd;
+        int stream;
+        long stream_wait;
+        char* enqueue_on;
+        int delete_on_finish;
+        char* move_on_finish;
+        char* order_by;
+        char* claim_dir;
+        long claim_lease;
+        char* fuse_cpus;
+        char* queue_cpus;
+        char* worker_cpus;
+        char* worker_placement;
+        char* stats_file;
+        long slow_op;
+        char* max_queued;
+        char* max_queued_bytes;
+        char* min_free;
+        int admission_wait;
     } od = {
         .no_allow_other = 0,
-        .retry_delay = 30 * 1000
+        .retry_delay = 30 * 1000,
+        .shards = 1,
+        .max_rate = NULL,
+        .smallest_first = NULL,
+        .max_running_bytes = NULL,
+        .timeout = 0,
+        .kill_grace = 5 * 1000,
+        .trace_file = NULL,
+        .record_file = NULL,
+        .job_log_dir = NULL,
+        .job_log_file = NULL,
+        .job_log_size = 1024 * 1024,
+        .handoff = NULL,
+        .dedup_index = NULL,
+        .stdin_file = 0,
+        .stdin_memfd = NULL,
+        .stream = 0,
+        .stream_wait = 10 * 1000,
+        .enqueue_on = NULL,
+        .delete_on_finish = 0,
+        .move_on_finish = NULL,
+        .order_by = NULL,
+        .claim_dir = NULL,
+        .claim_lease = 30 * 1000,
+        .fuse_cpus = NULL,
+        .queue_cpus = NULL,
+        .worker_cpus = NULL,
+        .worker_placement = NULL,
+        .stats_file = NULL,
+        .slow_op = 0,
+        .max_queued = NULL,
+        .max_queued_bytes = NULL,
+        .min_free = NULL,
+        .admission_wait = 0
     };
 
 #define OPT2(one, two, key) \
@@ -611,7 +1753,41 @@ int main(int argc, char *argv[]) {
     static const struct fuse_opt options[] = {
         OPT2("-h", "--help", OPTKEY_HELP),
         OPT2("-V", "--version", OPTKEY_VERSION),
+        OPT2("--ignore=", "ignore=", OPTKEY_IGNORE),
         OPT_OFFSET3("-r %ld", "--retry-delay=%ld", "retry-delay=%ld", retry_delay, -1),
+        OPT_OFFSET2("--shards=%d", "shards=%d", shards, -1),
+        OPT_OFFSET2("--max-rate=%s", "max-rate=%s", max_rate, -1),
+        OPT_OFFSET2("--smallest-first=%s", "smallest-first=%s", smallest_first, -1),
+        OPT_OFFSET2("--max-running-bytes=%s", "max-running-bytes=%s", max_running_bytes, -1),
+        OPT_OFFSET3("-t %ld", "--timeout=%ld", "timeout=%ld", timeout, -1),
+        OPT_OFFSET2("--kill-grace=%ld", "kill-grace=%ld", kill_grace, -1),
+        OPT_OFFSET2("--trace=%s", "trace=%s", trace_file, -1),
+        OPT_OFFSET2("--record=%s", "record=%s", record_file, -1),
+        OPT_OFFSET2("--handoff=%s", "handoff=%s", handoff, -1),
+        OPT_OFFSET2("--job-log-dir=%s", "job-log-dir=%s", job_log_dir, -1),
+        OPT_OFFSET2("--job-log=%s", "job-log=%s", job_log_file, -1),
+        OPT_OFFSET2("--job-log-size=%ld", "job-log-size=%ld", job_log_size, -1),
+        OPT_OFFSET2("--dedup-index=%s", "dedup-index=%s", dedup_index, -1),
+        OPT_OFFSET2("--stdin", "stdin", stdin_file, 1),
+        OPT_OFFSET2("--stdin-memfd=%s", "stdin-memfd=%s", stdin_memfd, -1),
+        OPT_OFFSET2("--stream", "stream", stream, 1),
+        OPT_OFFSET2("--stream-wait=%ld", "stream-wait=%ld", stream_wait, -1),
+        OPT_OFFSET2("--enqueue-on=%s", "enqueue-on=%s", enqueue_on, -1),
+        OPT_OFFSET2("--delete-on-finish", "delete-on-finish", delete_on_finish, 1),
+        OPT_OFFSET2("--move-on-finish=%s", "move-on-finish=%s", move_on_finish, -1),
+        OPT_OFFSET2("--order-by=%s", "order-by=%s", order_by, -1),
+        OPT_OFFSET2("--claim-dir=%s", "claim-dir=%s", claim_dir, -1),
+        OPT_OFFSET2("--claim-lease=%ld", "claim-lease=%ld", claim_lease, -1),
+        OPT_OFFSET2("--fuse-cpus=%s", "fuse-cpus=%s", fuse_cpus, -1),
+        OPT_OFFSET2("--queue-cpus=%s", "queue-cpus=%s", queue_cpus, -1),
+        OPT_OFFSET2("--worker-cpus=%s", "worker-cpus=%s", worker_cpus, -1),
+        OPT_OFFSET2("--worker-placement=%s", "worker-placement=%s", worker_placement, -1),
+        OPT_OFFSET2("--stats-file=%s", "stats-file=%s", stats_file, -1),
+        OPT_OFFSET2("--slow-op=%ld", "slow-op=%ld", slow_op, -1),
+        OPT_OFFSET2("--max-queued=%s", "max-queued=%s", max_queued, -1),
+        OPT_OFFSET2("--max-queued-bytes=%s", "max-queued-bytes=%s", max_queued_bytes, -1),
+        OPT_OFFSET2("--min-free=%s", "min-free=%s", min_free, -1),
+        OPT_OFFSET2("--admission-wait=%d", "admission-wait=%d", admission_wait, -1),
         FUSE_OPT_END
     };
 
@@ -628,7 +1804,190 @@ int main(int argc, char *argv[]) {
     if (fuse_opt_parse(&args, &od, options, &process_option) == -1)
         return 1;
 
+    if (!check_ms_option("--retry-delay", od.retry_delay)) {
+        return 1;
+    }
     settings.retry_wait_ms = od.retry_delay;
+    settings.shards = od.shards;
+    if (settings.shards < 1 || settings.shards > JOBQUEUE_MAX_SHARDS) {
+        fprintf(stderr, "The number of shards must be between 1 and %d.\n", JOBQUEUE_MAX_SHARDS);
+        return 1;
+    }
+    settings.max_start_rate = 0;
+    settings.start_burst = 1;
+    if (!parse_rate(od.max_rate, &settings.max_start_rate, &settings.start_burst)) {
+        fprintf(stderr, "Invalid --max-rate: %s\n", od.max_rate);
+        return 1;
+    }
+    free(od.max_rate);
+    settings.smallest_first = 0;
+    if (od.smallest_first) {
+        char* end;
+        settings.smallest_first = strtod(od.smallest_first, &end);
+        if (end == od.smallest_first || *end != '\0' || settings.smallest_first < 0) {
+            fprintf(stderr, "Invalid --smallest-first: %s\n", od.smallest_first);
+            return 1;
+        }
+        free(od.smallest_first);
+    }
+    settings.max_running_bytes = 0;
+    if (od.max_running_bytes) {
+        if (!parse_size(od.max_running_bytes, &settings.max_running_bytes)) {
+            fprintf(stderr, "Invalid --max-running-bytes: %s\n", od.max_running_bytes);
+            return 1;
+        }
+        free(od.max_running_bytes);
+    }
+    if (!check_ms_option("--timeout", od.timeout) || !check_ms_option("--kill-grace", od.kill_grace)) {
+        return 1;
+    }
+    settings.timeout_ms = od.timeout;
+    settings.kill_grace_ms = od.kill_grace;
+    settings.job_log_max_bytes = od.job_log_size;
+    /* fuse_main may chdir to / when it daemonizes */
+    settings.trace_file = absolute_option(od.trace_file);
+    settings.record_file = absolute_option(od.record_file);
+    settings.job_log_dir = absolute_option(od.job_log_dir);
+    settings.job_log_file = absolute_option(od.job_log_file);
+    settings.handoff_socket = absolute_option(od.handoff);
+    settings.dedup_index = absolute_option(od.dedup_index);
+    settings.stdin_file = od.stdin_file;
+    settings.delete_on_finish = od.delete_on_finish;
+    settings.move_on_finish_dir = absolute_option(od.move_on_finish);
+    settings.claim_dir = absolute_option(od.claim_dir);
+    settings.claim_lease_ms = od.claim_lease;
+    if (settings.claim_dir && settings.claim_lease_ms <= 0) {
+        fprintf(stderr, "--claim-lease must be positive.\n");
+        return 1;
+    }
+    if (settings.delete_on_finish && settings.move_on_finish_dir) {
+        fprintf(stderr, "Only one of --delete-on-finish and --move-on-finish may be given.\n");
+        return 1;
+    }
+    settings.enqueue_on_rename = false;
+    if (od.enqueue_on) {
+        if (strcmp(od.enqueue_on, "rename") == 0) {
+            settings.enqueue_on_rename = true;
+        } else if (strcmp(od.enqueue_on, "close") != 0) {
+            fprintf(stderr, "--enqueue-on must be 'close' or 'rename'.\n");
+            return 1;
+        }
+        free(od.enqueue_on);
+    }
+    settings.stdin_memfd_max = 0;
+    if (od.stdin_memfd) {
+        /* "size[:total]" reads like a watermark. */
+        if (!parse_watermark(od.stdin_memfd, &settings.stdin_memfd_max, &settings.stdin_memfd_total, 6400)) {
+            fprintf(stderr, "Invalid --stdin-memfd: %s\n", od.stdin_memfd);
+            return 1;
+        }
+        /* Leaves the job queue most of its descriptors for workers and logs. */
+        struct rlimit nofile;
+        settings.stdin_memfd_count = 256;
+        if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY) {
+            settings.stdin_memfd_count = nofile.rlim_cur / 4;
+        }
+        settings.stdin_file = true;
+        free(od.stdin_memfd);
+#ifndef HAVE_MEMFD_CREATE
+        fprintf(stderr, "Warning: memfd_create is not supported. --stdin-memfd works like --stdin.\n");
+#endif
+    }
+    settings.stream = od.stream;
+    settings.stream_wait_ms = od.stream_wait;
+    if (settings.stream) {
+        /* Streamed jobs are queued before there is content to hash, a name to wait for
+           or a size to budget. */
+        if (settings.enqueue_on_rename || settings.dedup_index || settings.max_running_bytes > 0) {
+            fprintf(stderr, "--stream can't be used with --enqueue-on=rename, --dedup-index "
+                    "or --max-running-bytes.\n");
+            return 1;
+        }
+        /* Retries and jobs of files that weren't streamed read the file instead. */
+        settings.stdin_file = true;
+    }
+    settings.order_key = NULL;
+    if (od.order_by) {
+        settings.order_key = orderkey_parse(od.order_by);
+        if (!settings.order_key) {
+            fprintf(stderr, "Invalid --order-by: %s\n", od.order_by);
+            return 1;
+        }
+        free(od.order_by);
+    }
+    settings.fuse_cpus = NULL;
+    if (od.fuse_cpus) {
+        settings.fuse_cpus = cpuset_parse(od.fuse_cpus);
+        if (!settings.fuse_cpus) {
+            fprintf(stderr, "Invalid --fuse-cpus: %s\n", od.fuse_cpus);
+            return 1;
+        }
+        free(od.fuse_cpus);
+    }
+    if (!check_cpu_list("--queue-cpus", od.queue_cpus) ||
+            !check_cpu_list("--worker-cpus", od.worker_cpus)) {
+        return 1;
+    }
+    settings.queue_cpus = od.queue_cpus;
+    settings.worker_cpus = od.worker_cpus;
+    settings.worker_placement = JOBQUEUE_PLACE_ANY;
+    if (od.worker_placement) {
+        if (strcmp(od.worker_placement, "cpu") == 0) {
+            settings.worker_placement = JOBQUEUE_PLACE_CPU;
+        } else if (strcmp(od.worker_placement, "node") == 0) {
+            settings.worker_placement = JOBQUEUE_PLACE_NODE;
+        } else if (strcmp(od.worker_placement, "local") == 0) {
+            settings.worker_placement = JOBQUEUE_PLACE_LOCAL;
+        } else if (strcmp(od.worker_placement, "any") != 0) {
+            fprintf(stderr, "--worker-placement must be 'any', 'cpu', 'node' or 'local'.\n");
+            return 1;
+        }
+        free(od.worker_placement);
+    }
+    settings.stats_file = NULL;
+    if (od.stats_file) {
+        const char *name = od.stats_file;
+        while (*name == '/')
+            ++name;
+        if (*name == '\0') {
+            fprintf(stderr, "Invalid --stats-file: %s\n", od.stats_file);
+            return 1;
+        }
+        /* Compared against paths as FUSE gives them */
+        settings.stats_file = malloc(strlen(name) + 2);
+        settings.stats_file[0] = '/';
+        strcpy(settings.stats_file + 1, name);
+        free(od.stats_file);
+    }
+    if (od.slow_op < 0) {
+        fprintf(stderr, "--slow-op must not be negative.\n");
+        return 1;
+    }
+    settings.slow_op_us = od.slow_op * 1000;
+    settings.handoff_fd = -1;
+
+    admission_settings_init(&settings.admission);
+    long long max_jobs = 0, resume_jobs = 0;
+    if (!parse_watermark(od.max_queued, &max_jobs, &resume_jobs, 90)) {
+        fprintf(stderr, "Invalid --max-queued: %s\n", od.max_queued);
+        return 1;
+    }
+    settings.admission.max_jobs = max_jobs;
+    settings.admission.resume_jobs = resume_jobs;
+    if (!parse_watermark(od.max_queued_bytes, &settings.admission.max_bytes,
+                         &settings.admission.resume_bytes, 90)) {
+        fprintf(stderr, "Invalid --max-queued-bytes: %s\n", od.max_queued_bytes);
+        return 1;
+    }
+    if (!parse_watermark(od.min_free, &settings.admission.min_free_bytes,
+                         &settings.admission.resume_free_bytes, 110)) {
+        fprintf(stderr, "Invalid --min-free: %s\n", od.min_free);
+        return 1;
+    }
+    settings.admission.wait_ms = od.admission_wait;
+    free(od.max_queued);
+    free(od.max_queued_bytes);
+    free(od.min_free);
 
     /* Check that required arguments were given */
     if (!settings.mntsrc || !settings.mntdest || !settings.cmd_template) {
@@ -649,6 +2008,21 @@ int main(int argc, char *argv[]) {
 
     fuse_opt_add_arg(&args, settings.mntdest);
 
+    if (settings.claim_dir) {
+        settings.claim_mountpoint = make_absolute(settings.mntdest);
+    }
+
+    /* Take over the job queue of a running instance before mounting over it */
+    if (settings.handoff_socket) {
+        settings.handoff_mountpoint = make_absolute(settings.mntdest);
+        settings.handoff_fd = handoff_connect(settings.handoff_socket, &settings.handoff_jq);
+        if (settings.handoff_fd == -1 && errno != ENOENT && errno != ECONNREFUSED) {
+            fprintf(stderr, "Could not take over from %s: %s\n",
+                    settings.handoff_socket, strerror(errno));
+            return 1;
+        }
+    }
+
     /* Open mount source for chrooting in queuefs_init */
     settings.mntsrc_fd = open(settings.mntsrc, O_RDONLY);
     if (settings.mntsrc_fd == -1) {
@@ -659,7 +2033,17 @@ int main(int argc, char *argv[]) {
     /* Ignore mounter's umask */
     umask(0);
 
-    int fuse_main_return = fuse_main(args.argc, args.argv, &queuefs_oper, NULL);
+    /* Operations are only timed when someone will look at the times */
+    struct fuse_operations *oper = &queuefs_oper;
+    if (settings.stats_file || settings.slow_op_us > 0) {
+        if (!opstats_init(NUM_OPS, op_names, settings.slow_op_us)) {
+            fprintf(stderr, "Failed to set up operation statistics\n");
+            return 1;
+        }
+        oper = &queuefs_timed_oper;
+    }
+
+    int fuse_main_return = fuse_main(args.argc, args.argv, oper, NULL);
 
     fuse_opt_free_args(&args);
     close(settings.mntsrc_fd);
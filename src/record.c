@@ -0,0 +1,89 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#include "record.h"
+#include "debug.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static FILE* record_file = NULL;
+
+static long long wall_clock_us();
+
+
+bool record_open(const char* path) {
+    record_file = fopen(path, "a");
+    if (!record_file) {
+        DPRINTF("Failed to open record %s", path);
+        return false;
+    }
+    // Line by line, so a shard that dies or idles doesn't leave events unwritten.
+    setvbuf(record_file, NULL, _IOLBF, 0);
+    return true;
+}
+
+void record_flush() {
+    if (record_file) {
+        fflush(record_file);
+    }
+}
+
+void record_close() {
+    if (record_file) {
+        fclose(record_file);
+        record_file = NULL;
+    }
+}
+
+bool record_enabled() {
+    return record_file != NULL;
+}
+
+void record_enqueue(long long job_id, long long bytes, const char* path) {
+    if (!record_file) {
+        return;
+    }
+    fprintf(record_file, "enqueue %lld %lld %lld %s\n", wall_clock_us(), job_id, bytes, path);
+}
+
+void record_run(long long job_id, long long duration_us, int exit_code) {
+    if (!record_file) {
+        return;
+    }
+    fprintf(record_file, "run %lld %lld %lld %d\n", wall_clock_us(), job_id, duration_us, exit_code);
+}
+
+void record_cancel(long long job_id) {
+    if (!record_file) {
+        return;
+    }
+    fprintf(record_file, "cancel %lld %lld\n", wall_clock_us(), job_id);
+}
+
+/* Wall-clock time, since the records of several shards are merged. */
+static long long wall_clock_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,63 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#ifndef INC_QUEUEFS_RECORD_H
+#define INC_QUEUEFS_RECORD_H
+
+#include <stdbool.h>
+
+/*
+ * A record of the jobs a job queue process got and how their runs went,
+ * for replaying the same traffic against other settings offline with
+ * tests/jobqueuereplay. One event per line, times in microseconds since
+ * the epoch, the path last since it may contain spaces:
+ *
+ *   enqueue <time> <job id> <bytes or -1> <path>
+ *   run <end time> <job id> <duration> <exit code>
+ *   cancel <time> <job id>
+ *
+ * Each event is written as soon as it happens.
+ * Appended to, so job IDs may repeat after a restart. An ID then refers
+ * to the latest job enqueued with it.
+ *
+ * These functions are not thread-safe, like the ones in trace.h.
+ */
+
+/* Opens the record for appending. Returns false on error. */
+bool record_open(const char* path);
+
+/* Writes buffered events to the file. */
+void record_flush();
+
+void record_close();
+
+bool record_enabled();
+
+void record_enqueue(long long job_id, long long bytes, const char* path);
+
+/* Records a finished run. An exit code of 0 means the job succeeded. */
+void record_run(long long job_id, long long duration_us, int exit_code);
+
+void record_cancel(long long job_id);
+
+#endif
@@ -0,0 +1,184 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#include "template.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+typedef enum SegmentType {
+    SEGMENT_LITERAL,
+    SEGMENT_PATH,
+    SEGMENT_REL,
+    SEGMENT_BASE,
+    SEGMENT_STEM,
+    SEGMENT_ATTEMPT,
+    SEGMENT_ID
+} SegmentType;
+
+typedef struct Segment {
+    SegmentType type;
+    const char* text; // Points into the template's copy of the text
+    size_t len;
+} Segment;
+
+struct CommandTemplate {
+    gchar* text;
+    gchar* source_dir; // With a trailing slash, or NULL
+    Segment* segments;
+    int num_segments;
+};
+
+static const struct {
+    const char* name;
+    SegmentType type;
+} placeholders[] = {
+    { "{}", SEGMENT_PATH },
+    { "{rel}", SEGMENT_REL },
+    { "{base}", SEGMENT_BASE },
+    { "{stem}", SEGMENT_STEM },
+    { "{attempt}", SEGMENT_ATTEMPT },
+    { "{id}", SEGMENT_ID }
+};
+
+static void add_segment(CommandTemplate* tmpl, SegmentType type, const char* text, size_t len);
+static void append_quoted(GString* out, const char* str, size_t len);
+
+
+CommandTemplate* template_compile(const char* text, const char* source_dir) {
+    CommandTemplate* tmpl = g_malloc(sizeof(CommandTemplate));
+    tmpl->text = g_strdup(text);
+    tmpl->source_dir = NULL;
+    if (source_dir) {
+        tmpl->source_dir = g_str_has_suffix(source_dir, "/")
+            ? g_strdup(source_dir)
+            : g_strconcat(source_dir, "/", NULL);
+    }
+    tmpl->segments = NULL;
+    tmpl->num_segments = 0;
+
+    const char* literal = tmpl->text;
+    const char* p = tmpl->text;
+    while ((p = strchr(p, '{')) != NULL) {
+        bool matched = false;
+        for (size_t i = 0; i < G_N_ELEMENTS(placeholders); ++i) {
+            size_t len = strlen(placeholders[i].name);
+            if (strncmp(p, placeholders[i].name, len) == 0) {
+                add_segment(tmpl, SEGMENT_LITERAL, literal, p - literal);
+                add_segment(tmpl, placeholders[i].type, NULL, 0);
+                p += len;
+                literal = p;
+                matched = true;
+                break;
+            }
+        }
+        if (!matched) {
+            p++;
+        }
+    }
+    add_segment(tmpl, SEGMENT_LITERAL, literal, strlen(literal));
+    return tmpl;
+}
+
+void template_free(CommandTemplate* tmpl) {
+    if (tmpl) {
+        g_free(tmpl->text);
+        g_free(tmpl->source_dir);
+        g_free(tmpl->segments);
+        g_free(tmpl);
+    }
+}
+
+void template_expand(const CommandTemplate* tmpl, GString* out,
+                     const char* path, int attempt, long long id) {
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+
+    g_string_truncate(out, 0);
+    for (int i = 0; i < tmpl->num_segments; ++i) {
+        const Segment* seg = &tmpl->segments[i];
+        switch (seg->type) {
+        case SEGMENT_LITERAL:
+            g_string_append_len(out, seg->text, seg->len);
+            break;
+        case SEGMENT_PATH:
+            append_quoted(out, path, strlen(path));
+            break;
+        case SEGMENT_REL: {
+            const char* rel = path;
+            if (tmpl->source_dir && g_str_has_prefix(path, tmpl->source_dir)) {
+                rel = path + strlen(tmpl->source_dir);
+                while (*rel == '/') {
+                    rel++;
+                }
+            }
+            append_quoted(out, rel, strlen(rel));
+            break;
+        }
+        case SEGMENT_BASE:
+            append_quoted(out, base, strlen(base));
+            break;
+        case SEGMENT_STEM: {
+            // A leading dot starts a hidden file's name, not an extension.
+            const char* dot = strrchr(base, '.');
+            size_t len = (dot && dot != base) ? (size_t)(dot - base) : strlen(base);
+            append_quoted(out, base, len);
+            break;
+        }
+        case SEGMENT_ATTEMPT:
+            g_string_append_printf(out, "%d", attempt);
+            break;
+        case SEGMENT_ID:
+            g_string_append_printf(out, "%lld", id);
+            break;
+        }
+    }
+}
+
+static void add_segment(CommandTemplate* tmpl, SegmentType type, const char* text, size_t len) {
+    if (type == SEGMENT_LITERAL && len == 0) {
+        return;
+    }
+    tmpl->segments = g_realloc(tmpl->segments, (tmpl->num_segments + 1) * sizeof(Segment));
+    Segment* seg = &tmpl->segments[tmpl->num_segments++];
+    seg->type = type;
+    seg->text = text;
+    seg->len = len;
+}
+
+/* Quotes like g_shell_quote(): in single quotes, with ' written as '\''. */
+static void append_quoted(GString* out, const char* str, size_t len) {
+    const char* end = str + len;
+    g_string_append_c(out, '\'');
+    while (str < end) {
+        const char* quote = memchr(str, '\'', end - str);
+        if (!quote) {
+            g_string_append_len(out, str, end - str);
+            break;
+        }
+        g_string_append_len(out, str, quote - str);
+        g_string_append(out, "'\\''");
+        str = quote + 1;
+    }
+    g_string_append_c(out, '\'');
+}
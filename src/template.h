@@ -0,0 +1,55 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#ifndef INC_QUEUEFS_TEMPLATE_H
+#define INC_QUEUEFS_TEMPLATE_H
+
+#include <glib.h>
+
+/*
+ * A command template, parsed once into literal text and placeholders
+ * so that each job's command is built in one pass.
+ *
+ * Placeholders are replaced by shell-quoted values:
+ *   {}         the absolute path of the file
+ *   {rel}      the path relative to the source directory
+ *   {base}     the file name
+ *   {stem}     the file name without its last extension
+ *   {attempt}  1 for the first run of a job, 2 for the first retry etc.
+ *   {id}       the job's sequence number
+ * Anything else in braces is left alone.
+ */
+
+struct CommandTemplate;
+typedef struct CommandTemplate CommandTemplate;
+
+/* source_dir is what {rel} is relative to. It may be NULL. */
+CommandTemplate* template_compile(const char* text, const char* source_dir);
+
+void template_free(CommandTemplate* tmpl);
+
+/* Replaces the contents of out with the command for a job. */
+void template_expand(const CommandTemplate* tmpl, GString* out,
+                     const char* path, int attempt, long long id);
+
+#endif
@@ -0,0 +1,133 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#include "trace.h"
+#include "debug.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+static FILE* trace_file = NULL;
+static pid_t trace_pid;
+
+static void write_json_string(const char* s);
+
+bool trace_open(const char* path) {
+    trace_file = fopen(path, "w");
+    if (!trace_file) {
+        DPRINTF("Failed to open trace file %s", path);
+        return false;
+    }
+    trace_pid = getpid();
+    // A trailing comma and missing ']' are allowed by the format,
+    // so a trace cut short by a crash is still readable.
+    fputs("[\n", trace_file);
+    fprintf(trace_file,
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"queuefs job queue\"}},\n",
+            (int)trace_pid);
+    return true;
+}
+
+void trace_flush() {
+    if (trace_file) {
+        fflush(trace_file);
+    }
+}
+
+void trace_close() {
+    if (trace_file) {
+        fputs("{}]\n", trace_file);
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+}
+
+bool trace_enabled() {
+    return trace_file != NULL;
+}
+
+void trace_job_begin(long long job_id, const char* path) {
+    if (!trace_file) {
+        return;
+    }
+    fprintf(trace_file,
+            "{\"name\":\"job\",\"cat\":\"job\",\"ph\":\"b\",\"id\":%lld,\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"args\":{\"path\":",
+            job_id, (int)trace_pid, (int)trace_pid, trace_now_us());
+    write_json_string(path);
+    fputs("}},\n", trace_file);
+}
+
+void trace_job_end(long long job_id, const char* result) {
+    if (!trace_file) {
+        return;
+    }
+    fprintf(trace_file,
+            "{\"name\":\"job\",\"cat\":\"job\",\"ph\":\"e\",\"id\":%lld,\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"args\":{\"result\":",
+            job_id, (int)trace_pid, (int)trace_pid, trace_now_us());
+    write_json_string(result);
+    fputs("}},\n", trace_file);
+}
+
+void trace_job_instant(long long job_id, const char* name, int value) {
+    if (!trace_file) {
+        return;
+    }
+    fprintf(trace_file, "{\"name\":");
+    write_json_string(name);
+    fprintf(trace_file,
+            ",\"cat\":\"job\",\"ph\":\"n\",\"id\":%lld,\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"args\":{\"value\":%d}},\n",
+            job_id, (int)trace_pid, (int)trace_pid, trace_now_us(), value);
+}
+
+void trace_job_run(long long job_id, pid_t pid, long long start_us, int exit_code) {
+    if (!trace_file) {
+        return;
+    }
+    fprintf(trace_file,
+            "{\"name\":\"run\",\"cat\":\"worker\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,"
+            "\"args\":{\"job\":%lld,\"exit_code\":%d}},\n",
+            (int)trace_pid, (int)pid, start_us, trace_now_us() - start_us, job_id, exit_code);
+}
+
+long long trace_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void write_json_string(const char* s) {
+    fputc('"', trace_file);
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', trace_file);
+            fputc(c, trace_file);
+        } else if (c < 0x20) {
+            fprintf(trace_file, "\\u%04x", c);
+        } else {
+            fputc(c, trace_file);
+        }
+    }
+    fputc('"', trace_file);
+}
@@ -0,0 +1,82 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+#ifndef INC_QUEUEFS_TRACE_H
+#define INC_QUEUEFS_TRACE_H
+
+#include <config.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Static tracepoints under the provider name "queuefs".
+ * They compile to a nop unless sys/sdt.h was found by configure,
+ * and cost next to nothing until a tracer attaches to them, e.g.
+ *   bpftrace -e 'usdt:./queuefs:queuefs:job_start { printf("%s\n", str(arg2)); }'
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(queuefs, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(queuefs, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(queuefs, name, a, b, c)
+#define TRACE_PROBE4(name, a, b, c, d) DTRACE_PROBE4(queuefs, name, a, b, c, d)
+#else
+#define TRACE_PROBE1(name, a)
+#define TRACE_PROBE2(name, a, b)
+#define TRACE_PROBE3(name, a, b, c)
+#define TRACE_PROBE4(name, a, b, c, d)
+#endif
+
+/*
+ * A writer for Chrome's trace event format (chrome://tracing, Perfetto).
+ * Used by the job queue process to record the lifecycle of each job.
+ *
+ * These functions are not thread-safe. In the job queue process they must
+ * only be called while SIGCHLD is blocked or from the SIGCHLD handler.
+ */
+
+/* Opens the trace file for writing. Returns false on error. */
+bool trace_open(const char* path);
+
+/* Flushes buffered events to the trace file. */
+void trace_flush();
+
+/* Finishes and closes the trace file. */
+void trace_close();
+
+bool trace_enabled();
+
+/* Begins and ends the async event spanning a job's whole lifetime. */
+void trace_job_begin(long long job_id, const char* path);
+void trace_job_end(long long job_id, const char* result);
+
+/* Records a point in time during the job's lifetime, e.g. a retry. */
+void trace_job_instant(long long job_id, const char* name, int value);
+
+/* Records one run of a job as a complete event on the worker's "thread". */
+void trace_job_run(long long job_id, pid_t pid, long long start_us, int exit_code);
+
+/* Microseconds on the clock used for trace timestamps. */
+long long trace_now_us();
+
+#endif
@@ -0,0 +1,221 @@
+#!/usr/bin/env ruby
+# Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+
+# End-to-end ingest benchmark.
+#
+# Runs the same writer workload on a raw directory and through a queuefs
+# mount of another directory on the same filesystem, and prints one JSON
+# object per line for each run plus one with the relative overhead.
+#
+# Jobs run `jobqueuebench --stamp`, which records when each job started,
+# so `make bench` should have been run first.
+
+require 'optparse'
+require 'json'
+require 'fileutils'
+include FileUtils
+
+EXECUTABLE_PATH = File.expand_path('../src/queuefs', File.dirname(__FILE__))
+STAMP_PATH = File.expand_path('jobqueuebench', File.dirname(__FILE__))
+BENCHDIR_NAME = 'tmp_bench_queuefs'
+
+$opts = {
+    :threads => 4,
+    :files => 250,
+    :size => 64 * 1024,
+    :chunk => 64 * 1024,
+    :tmpfs => false,
+    :queuefs_opts => ''
+}
+
+OptionParser.new do |o|
+    o.banner = "Usage: #{$0} [options]"
+    o.on('--threads=N', Integer, 'Writer threads. Default: 4') {|v| $opts[:threads] = v }
+    o.on('--files=N', Integer, 'Files per writer thread. Default: 250') {|v| $opts[:files] = v }
+    o.on('--size=BYTES', Integer, 'Size of each file. Default: 65536') {|v| $opts[:size] = v }
+    o.on('--chunk=BYTES', Integer, 'Bytes per write() call. Default: 65536') {|v| $opts[:chunk] = v }
+    o.on('--tmpfs', 'Mount a tmpfs for the backing directories (needs root).') { $opts[:tmpfs] = true }
+    o.on('--queuefs-opts=OPTS', 'Extra options for queuefs.') {|v| $opts[:queuefs_opts] = v }
+end.parse!
+
+def now_ns
+    Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+end
+
+def umount_cmd
+    if `which fusermount`.strip.empty?
+    then 'umount'
+    else 'fusermount -uz'
+    end
+end
+
+def percentiles(samples)
+    sorted = samples.sort
+    result = {}
+    [[50, 'p50'], [90, 'p90'], [99, 'p99'], [99.9, 'p999']].each do |p, name|
+        idx = ((p / 100.0) * (sorted.size - 1)).to_i
+        result["#{name}_us"] = sorted.empty? ? 0 : (sorted[idx] / 1000.0).round(1)
+    end
+    result['max_us'] = sorted.empty? ? 0 : (sorted.last / 1000.0).round(1)
+    result
+end
+
+# Runs the writer workload in dir. Returns per-op timings and, for each
+# file name, the time its close() returned.
+def run_workload(dir)
+    data = 'x' * $opts[:chunk]
+    ops = { 'create' => [], 'write' => [], 'close' => [] }
+    closed_at = {}
+    lock = Mutex.new
+
+    start = now_ns
+    threads = (0...$opts[:threads]).map do |t|
+        Thread.new do
+            local = { 'create' => [], 'write' => [], 'close' => [] }
+            local_closed = {}
+            $opts[:files].times do |i|
+                name = "t#{t}_#{i}"
+                t0 = now_ns
+                f = File.open("#{dir}/#{name}", 'wb')
+                local['create'] << now_ns - t0
+                remaining = $opts[:size]
+                while remaining > 0
+                    n = [remaining, data.size].min
+                    t0 = now_ns
+                    f.syswrite(n == data.size ? data : data[0, n])
+                    local['write'] << now_ns - t0
+                    remaining -= n
+                end
+                t0 = now_ns
+                f.close
+                t1 = now_ns
+                local['close'] << t1 - t0
+                local_closed[name] = t1
+            end
+            lock.synchronize do
+                local.each {|op, samples| ops[op].concat(samples) }
+                closed_at.merge!(local_closed)
+            end
+        end
+    end
+    threads.each(&:join)
+    elapsed = now_ns - start
+
+    [ops, closed_at, elapsed]
+end
+
+def report(target, ops, elapsed)
+    files = $opts[:threads] * $opts[:files]
+    result = {
+        'bench' => 'ingest',
+        'target' => target,
+        'threads' => $opts[:threads],
+        'files' => files,
+        'size' => $opts[:size],
+        'seconds' => (elapsed / 1e9).round(6),
+        'files_per_s' => (files / (elapsed / 1e9)).round,
+        'mb_per_s' => (files * $opts[:size] / (elapsed / 1e9) / 1e6).round(2)
+    }
+    ops.each {|op, samples| result[op] = percentiles(samples) }
+    result
+end
+
+def wait_for_mount(pid, dir)
+    while !`mount`.include?(dir)
+        raise 'queuefs exited before mounting' if Process.waitpid(pid, Process::WNOHANG)
+        sleep 0.01
+    end
+end
+
+# Waits until all queued jobs have run at least once (see flush_jobs in test_queuefs.rb).
+def flush_jobs(pid)
+    got_signal = false
+    Signal.trap('SIGUSR2') { got_signal = true }
+    begin
+        Process.kill('SIGUSR2', pid)
+        sleep 0.001 until got_signal
+    ensure
+        Signal.trap('SIGUSR2', 'DEFAULT')
+    end
+end
+
+unless File.executable?(STAMP_PATH)
+    $stderr.puts "#{STAMP_PATH} not found. Run `make bench` first."
+    exit! 1
+end
+
+mkdir BENCHDIR_NAME
+Dir.chdir BENCHDIR_NAME
+results = []
+queuefs_pid = nil
+begin
+    if $opts[:tmpfs]
+        mkdir 'fs'
+        raise 'failed to mount tmpfs' unless system('mount -t tmpfs queuefs_bench fs')
+        root = 'fs'
+    else
+        root = '.'
+    end
+    %w(raw src mnt).each {|d| mkdir "#{root}/#{d}" }
+    stamp_log = File.expand_path("#{root}/stamps")
+
+    ops, _, elapsed = run_workload("#{root}/raw")
+    results << report('raw', ops, elapsed)
+
+    cmd = "#{STAMP_PATH} --stamp=#{stamp_log} {}"
+    args = [EXECUTABLE_PATH, $opts[:queuefs_opts].split(/\s+/), '-f',
+            "#{root}/src", "#{root}/mnt", cmd].flatten.reject(&:empty?)
+    queuefs_pid = Process.spawn(*args)
+    wait_for_mount(queuefs_pid, File.expand_path("#{root}/mnt"))
+
+    ops, closed_at, elapsed = run_workload("#{root}/mnt")
+    flush_jobs(queuefs_pid)
+    result = report('queuefs', ops, elapsed)
+
+    started_at = {}
+    IO.readlines(stamp_log).each do |line|
+        path, t = line.split(' ')
+        started_at[File.basename(path)] ||= t.to_i
+    end
+    latencies = closed_at.map {|name, t| started_at[name] - t if started_at[name] }.compact
+    result['jobs_started'] = latencies.size
+    result['close_to_start'] = percentiles(latencies)
+    results << result
+
+    raw, fs = results
+    results << {
+        'bench' => 'ingest_overhead',
+        'throughput_ratio' => (fs['files_per_s'].to_f / raw['files_per_s']).round(4),
+        'write_p50_ratio' => raw['write']['p50_us'] > 0 ? (fs['write']['p50_us'] / raw['write']['p50_us']).round(2) : nil,
+        'close_p50_ratio' => raw['close']['p50_us'] > 0 ? (fs['close']['p50_us'] / raw['close']['p50_us']).round(2) : nil
+    }
+ensure
+    if queuefs_pid
+        system("#{umount_cmd} #{root}/mnt")
+        Process.wait queuefs_pid
+    end
+    system('umount fs') if $opts[:tmpfs]
+    Dir.chdir '..'
+    system("rm -Rf #{BENCHDIR_NAME}")
+end
+
+results.each {|r| puts JSON.generate(r) }
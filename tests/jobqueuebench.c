@@ -0,0 +1,527 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+/*
+ * Microbenchmarks for the job queue. Each result is printed to stdout
+ * as one JSON object per line so that runs can be compared by scripts.
+ *
+ * Run with --help for options.
+ */
+
+#define QUEUEFS_DISABLE_DEBUG 1
+
+#include <config.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "misc.c"
+#include "trace.c"
+#include "record.c"
+#include "joblog.c"
+#include "hash.c"
+#include "dedup.c"
+#include "claim.c"
+#include "cpuset.c"
+#include "template.c"
+#include "jobqueue.c"
+#include "jobqueue_process.c"
+
+#define BENCH_DIR "/tmp/queuefs_bench"
+
+static struct BenchSettings {
+    int threads;
+    long min_depth;
+    long max_depth;
+    int workers;
+    int shards;
+    long spawn_jobs;
+    long latency_jobs;
+    long latency_rate;
+    long flush_rounds;
+    long sim_jobs;
+    const char* self_path;
+} bs;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ns(long long ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
+
+static int compare_long_long(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/* Sorts samples in place and prints the common percentiles in microseconds. */
+static void print_percentiles(long long* samples, long n) {
+    if (n == 0) {
+        return;
+    }
+    qsort(samples, n, sizeof(long long), &compare_long_long);
+    const double ps[] = { 50, 90, 99, 99.9 };
+    const char* names[] = { "p50", "p90", "p99", "p999" };
+    for (int i = 0; i < 4; ++i) {
+        long idx = (long)(ps[i] / 100.0 * (n - 1));
+        printf(",\"%s_us\":%.1f", names[i], samples[idx] / 1000.0);
+    }
+    printf(",\"max_us\":%.1f", samples[n - 1] / 1000.0);
+}
+
+/* Reads a field like "VmRSS:" from /proc/<pid>/status. Returns kB or -1. */
+static long proc_status_kb(pid_t pid, const char* field) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    long result = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, field, strlen(field)) == 0) {
+            result = atol(line + strlen(field));
+            break;
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+static char proc_state(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return '?';
+    }
+    char state = '?';
+    if (fscanf(f, "%*d (%*[^)]) %c", &state) != 1) {
+        state = '?';
+    }
+    fclose(f);
+    return state;
+}
+
+/* Sums a field of /proc/<pid>/status over all shards. */
+static long jobqueue_status_kb(JobQueue* jq, const char* field) {
+    long total = 0;
+    for (int i = 0; i < jq->num_shards; ++i) {
+        total += proc_status_kb(jq->shards[i].pid, field);
+    }
+    return total;
+}
+
+/*
+ * Waits until the job queue processes have consumed everything written to
+ * their command pipes and gone back to sleep in poll().
+ * FLUSH can't be used for this since it would run the queued jobs.
+ */
+static void wait_until_drained(JobQueue* jq) {
+    int idle_polls = 0;
+    while (idle_polls < 3) {
+        bool idle = true;
+        for (int i = 0; i < jq->num_shards; ++i) {
+            int pending = 0;
+            if (ioctl(jq->shards[i].input_fd, FIONREAD, &pending) == -1) {
+                pending = 0;
+            }
+            if (pending != 0 || proc_state(jq->shards[i].pid) != 'S') {
+                idle = false;
+            }
+        }
+        idle_polls = idle ? idle_polls + 1 : 0;
+        sleep_ns(1000000);
+    }
+}
+
+static JobQueue* make_jobqueue(const char* cmd_template, int max_workers) {
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = cmd_template;
+    jqs.max_workers = max_workers;
+    jqs.shards = bs.shards;
+    jqs.retry_wait_ms = 1000;
+    JobQueue* jq = jobqueue_create(&jqs);
+    if (!jq) {
+        fprintf(stderr, "Failed to create job queue\n");
+        exit(1);
+    }
+    return jq;
+}
+
+typedef struct EnqueueThreadArgs {
+    JobQueue* jq;
+    long first;
+    long count;
+} EnqueueThreadArgs;
+
+static void* enqueue_thread(void* arg) {
+    EnqueueThreadArgs* a = arg;
+    char path[256];
+    for (long i = a->first; i < a->first + a->count; ++i) {
+        snprintf(path, sizeof(path), BENCH_DIR "/enqueue/%ld", i);
+        jobqueue_add_file(a->jq, path);
+    }
+    return NULL;
+}
+
+/*
+ * Enqueues `depth` jobs from several threads into a queue with no worker
+ * slots, so only the IPC and scheduler bookkeeping are measured.
+ * Also reports the job queue process's memory growth per queued job.
+ */
+static void bench_enqueue(long depth) {
+    JobQueue* jq = make_jobqueue("true", 0);
+    jobqueue_flush(jq);
+    long rss_before = jobqueue_status_kb(jq, "VmRSS:");
+
+    pthread_t* threads = malloc(bs.threads * sizeof(pthread_t));
+    EnqueueThreadArgs* args = malloc(bs.threads * sizeof(EnqueueThreadArgs));
+    long per_thread = depth / bs.threads;
+
+    long long start = now_ns();
+    for (int i = 0; i < bs.threads; ++i) {
+        args[i].jq = jq;
+        args[i].first = i * per_thread;
+        args[i].count = (i == bs.threads - 1) ? depth - i * per_thread : per_thread;
+        pthread_create(&threads[i], NULL, &enqueue_thread, &args[i]);
+    }
+    for (int i = 0; i < bs.threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    long long sent = now_ns();
+    wait_until_drained(jq);
+    long long drained = now_ns();
+
+    long rss_after = jobqueue_status_kb(jq, "VmRSS:");
+
+    printf("{\"bench\":\"enqueue\",\"depth\":%ld,\"threads\":%d,\"shards\":%d",
+           depth, bs.threads, bs.shards);
+    printf(",\"send_s\":%.6f,\"send_jobs_per_s\":%.0f",
+           (sent - start) / 1e9, depth / ((sent - start) / 1e9));
+    printf(",\"drain_s\":%.6f,\"jobs_per_s\":%.0f",
+           (drained - start) / 1e9, depth / ((drained - start) / 1e9));
+    printf(",\"rss_before_kb\":%ld,\"rss_after_kb\":%ld,\"bytes_per_job\":%.1f}\n",
+           rss_before, rss_after, (rss_after - rss_before) * 1024.0 / depth);
+    fflush(stdout);
+
+    free(threads);
+    free(args);
+    jobqueue_destroy(jq);
+}
+
+/* Measures how fast trivial jobs can be forked and reaped. */
+static void bench_spawn() {
+    JobQueue* jq = make_jobqueue("true", bs.workers);
+    jobqueue_flush(jq);
+
+    char path[256];
+    long long start = now_ns();
+    for (long i = 0; i < bs.spawn_jobs; ++i) {
+        snprintf(path, sizeof(path), BENCH_DIR "/spawn/%ld", i);
+        jobqueue_add_file(jq, path);
+    }
+    jobqueue_flush(jq);
+    long long end = now_ns();
+
+    printf("{\"bench\":\"spawn\",\"jobs\":%ld,\"workers\":%d,\"shards\":%d,\"seconds\":%.6f,\"jobs_per_s\":%.0f}\n",
+           bs.spawn_jobs, bs.workers, bs.shards, (end - start) / 1e9,
+           bs.spawn_jobs / ((end - start) / 1e9));
+    fflush(stdout);
+
+    jobqueue_destroy(jq);
+}
+
+/*
+ * Measures the time from jobqueue_add_file() to the job's process running.
+ * Jobs are paced so that they don't queue up behind each other.
+ * Each job runs this program with --stamp, which appends the file name and
+ * the current time to a log.
+ */
+static void bench_latency() {
+    const char* stamp_log = BENCH_DIR "/stamps";
+    unlink(stamp_log);
+
+    gchar* quoted_self = g_shell_quote(bs.self_path);
+    gchar* quoted_log = g_shell_quote(stamp_log);
+    gchar* cmd = g_strdup_printf("%s --stamp=%s {}", quoted_self, quoted_log);
+    JobQueue* jq = make_jobqueue(cmd, bs.workers);
+    jobqueue_flush(jq);
+
+    long long* enqueued_at = malloc(bs.latency_jobs * sizeof(long long));
+    long long interval = 1000000000LL / bs.latency_rate;
+    char path[256];
+    long long next = now_ns();
+    for (long i = 0; i < bs.latency_jobs; ++i) {
+        long long t = now_ns();
+        if (t < next) {
+            sleep_ns(next - t);
+        }
+        next += interval;
+        snprintf(path, sizeof(path), "%ld", i);
+        enqueued_at[i] = now_ns();
+        jobqueue_add_file(jq, path);
+    }
+    jobqueue_flush(jq);
+    jobqueue_destroy(jq);
+
+    long long* latencies = malloc(bs.latency_jobs * sizeof(long long));
+    long n = 0;
+    FILE* f = fopen(stamp_log, "r");
+    if (f) {
+        long i;
+        long long started_at;
+        while (fscanf(f, "%ld %lld", &i, &started_at) == 2) {
+            if (i >= 0 && i < bs.latency_jobs && n < bs.latency_jobs) {
+                latencies[n++] = started_at - enqueued_at[i];
+            }
+        }
+        fclose(f);
+    }
+
+    printf("{\"bench\":\"start_latency\",\"jobs\":%ld,\"started\":%ld,\"rate\":%ld,\"workers\":%d",
+           bs.latency_jobs, n, bs.latency_rate, bs.workers);
+    print_percentiles(latencies, n);
+    printf("}\n");
+    fflush(stdout);
+
+    free(latencies);
+    free(enqueued_at);
+    g_free(cmd);
+    g_free(quoted_log);
+    g_free(quoted_self);
+    unlink(stamp_log);
+}
+
+/* Measures the round trip of a FLUSH on an idle queue. */
+static void bench_flush() {
+    JobQueue* jq = make_jobqueue("true", bs.workers);
+    jobqueue_flush(jq);
+
+    long long* samples = malloc(bs.flush_rounds * sizeof(long long));
+    for (long i = 0; i < bs.flush_rounds; ++i) {
+        long long start = now_ns();
+        jobqueue_flush(jq);
+        samples[i] = now_ns() - start;
+    }
+
+    printf("{\"bench\":\"flush_idle\",\"rounds\":%ld", bs.flush_rounds);
+    print_percentiles(samples, bs.flush_rounds);
+    printf("}\n");
+    fflush(stdout);
+
+    free(samples);
+    jobqueue_destroy(jq);
+}
+
+// Job n takes 1 to 10 seconds of virtual time and every 10th fails its first run.
+static int simulated_job(const char* path, int attempt, long long* duration_us) {
+    long n = atol(strrchr(path, '/') + 1);
+    *duration_us = (n % 10 + 1) * 1000000LL;
+    return (n % 10 == 0 && attempt == 0) ? 1 : 0;
+}
+
+/*
+ * Runs jobs that are only simulated, on a virtual clock, so the time taken
+ * is the scheduler's own work of starting, reaping and retrying jobs.
+ */
+static void bench_scheduler() {
+    static JobQueueSimulation sim = { true, &simulated_job };
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "false";
+    jqs.max_workers = bs.workers;
+    jqs.retry_wait_ms = 60 * 1000;
+    jqs.simulation = &sim;
+    JobQueue* jq = jobqueue_create(&jqs);
+    if (!jq) {
+        fprintf(stderr, "Failed to create job queue\n");
+        exit(1);
+    }
+    jobqueue_flush(jq);
+
+    char path[256];
+    long long start = now_ns();
+    for (long i = 0; i < bs.sim_jobs; ++i) {
+        snprintf(path, sizeof(path), BENCH_DIR "/sim/%ld", i);
+        jobqueue_add_file(jq, path);
+    }
+    // Not flushed, since that would run the failed jobs again at once.
+    long jobs = 1;
+    long long bytes;
+    while (jobs > 0) {
+        sleep_ns(1000000);
+        jobqueue_get_backlog(jq, &jobs, &bytes);
+    }
+    long long end = now_ns();
+
+    printf("{\"bench\":\"scheduler\",\"jobs\":%ld,\"workers\":%d,\"seconds\":%.6f,\"jobs_per_s\":%.0f}\n",
+           bs.sim_jobs, bs.workers, (end - start) / 1e9, bs.sim_jobs / ((end - start) / 1e9));
+    fflush(stdout);
+
+    jobqueue_destroy(jq);
+}
+
+static int stamp_main(const char* log_path, const char* name) {
+    char line[256];
+    int len = snprintf(line, sizeof(line), "%s %lld\n", name, now_ns());
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        return 1;
+    }
+    int ok = (write(fd, line, len) == len);
+    close(fd);
+    return ok ? 0 : 1;
+}
+
+static void print_usage(const char* progname) {
+    printf("\n"
+        "Usage: %s [options]\n"
+        "\n"
+        "  --threads=n        Enqueueing threads. Default: 4\n"
+        "  --min-depth=n      Smallest queue depth to test. Default: 1000\n"
+        "  --max-depth=n      Largest queue depth to test. Default: 1000000\n"
+        "                     Depths are powers of 10 between these.\n"
+        "  --workers=n        Worker slots for spawn and latency tests. Default: 8\n"
+        "  --shards=n         Job queue processes. Default: 1\n"
+        "  --spawn-jobs=n     Jobs in the spawn test. Default: 2000\n"
+        "  --latency-jobs=n   Jobs in the latency test. Default: 500\n"
+        "  --latency-rate=n   Jobs per second in the latency test. Default: 100\n"
+        "  --flush-rounds=n   Rounds in the flush test. Default: 1000\n"
+        "  --sim-jobs=n       Simulated jobs in the scheduler test. Default: 20000\n"
+        "  --only=name        Run only one of enqueue, spawn, latency, flush, scheduler.\n"
+        "\n", progname);
+}
+
+int main(int argc, char* argv[]) {
+    bs.threads = 4;
+    bs.min_depth = 1000;
+    bs.max_depth = 1000000;
+    bs.workers = 8;
+    bs.shards = 1;
+    bs.spawn_jobs = 2000;
+    bs.latency_jobs = 500;
+    bs.latency_rate = 100;
+    bs.flush_rounds = 1000;
+    bs.sim_jobs = 20000;
+    const char* only = NULL;
+    const char* stamp_log = NULL;
+
+    static const struct option long_options[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "min-depth", required_argument, NULL, 'm' },
+        { "max-depth", required_argument, NULL, 'M' },
+        { "workers", required_argument, NULL, 'w' },
+        { "shards", required_argument, NULL, 'n' },
+        { "spawn-jobs", required_argument, NULL, 's' },
+        { "latency-jobs", required_argument, NULL, 'l' },
+        { "latency-rate", required_argument, NULL, 'r' },
+        { "flush-rounds", required_argument, NULL, 'f' },
+        { "sim-jobs", required_argument, NULL, 'j' },
+        { "only", required_argument, NULL, 'o' },
+        { "stamp", required_argument, NULL, 'S' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 't': bs.threads = atoi(optarg); break;
+        case 'm': bs.min_depth = atol(optarg); break;
+        case 'M': bs.max_depth = atol(optarg); break;
+        case 'w': bs.workers = atoi(optarg); break;
+        case 'n': bs.shards = atoi(optarg); break;
+        case 's': bs.spawn_jobs = atol(optarg); break;
+        case 'l': bs.latency_jobs = atol(optarg); break;
+        case 'r': bs.latency_rate = atol(optarg); break;
+        case 'f': bs.flush_rounds = atol(optarg); break;
+        case 'j': bs.sim_jobs = atol(optarg); break;
+        case 'o': only = optarg; break;
+        case 'S': stamp_log = optarg; break;
+        case 'h': print_usage(argv[0]); return 0;
+        default: print_usage(argv[0]); return 1;
+        }
+    }
+
+    if (stamp_log) {
+        return optind < argc ? stamp_main(stamp_log, argv[optind]) : 1;
+    }
+
+    if (bs.threads < 1 || bs.workers < 1 || bs.shards < 1 || bs.min_depth < 1 ||
+        bs.latency_rate < 1 || bs.latency_jobs < 1 || bs.flush_rounds < 1 || bs.sim_jobs < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    static char self_path[4096];
+    ssize_t len = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1);
+    if (len <= 0) {
+        fprintf(stderr, "Failed to find own executable\n");
+        return 1;
+    }
+    self_path[len] = '\0';
+    bs.self_path = self_path;
+
+    mkdir(BENCH_DIR, 0755);
+
+#define SHOULD_RUN(name) (!only || strcmp(only, (name)) == 0)
+    if (SHOULD_RUN("enqueue")) {
+        for (long depth = bs.min_depth; depth <= bs.max_depth; depth *= 10) {
+            bench_enqueue(depth);
+        }
+    }
+    if (SHOULD_RUN("spawn")) {
+        bench_spawn();
+    }
+    if (SHOULD_RUN("latency")) {
+        bench_latency();
+    }
+    if (SHOULD_RUN("flush")) {
+        bench_flush();
+    }
+    if (SHOULD_RUN("scheduler")) {
+        bench_scheduler();
+    }
+#undef SHOULD_RUN
+
+    rmdir(BENCH_DIR);
+    return 0;
+}
@@ -0,0 +1,459 @@
+/***********************************************************************************/
+/*  Copyright (c) 2011 Martin Pärtel <martin.partel@gmail.com>                    */
+/*                                                                                 */
+/*  Permission is hereby granted, free of charge, to any person obtaining a copy   */
+/*  of this software and associated documentation files (the "Software"), to deal  */
+/*  in the Software without restriction, including without limitation the rights   */
+/*  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell      */
+/*  copies of the Software, and to permit persons to whom the Software is          */
+/*  furnished to do so, subject to the following conditions:                       */
+/*                                                                                 */
+/*  The above copyright notice and this permission notice shall be included in     */
+/*  all copies or substantial portions of the Software.                            */
+/*                                                                                 */
+/*  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR     */
+/*  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,       */
+/*  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE    */
+/*  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER         */
+/*  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,  */
+/*  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN      */
+/*  THE SOFTWARE.                                                                  */
+/*                                                                                 */
+/***********************************************************************************/
+
+/*
+ * Replays a record written by queuefs --record against a job queue with
+ * different settings. Jobs arrive with the recorded spacing, and each run
+ * sleeps as long as the recorded run took and exits with its exit code,
+ * all sped up by --speed. What happened in the record and in the replay
+ * is printed as one JSON object per line each, in recorded time, so that
+ * settings can be compared against real traffic.
+ *
+ * A job retried more often than in the record succeeds on the extra
+ * runs, taking as long as its last recorded run.
+ *
+ * Run with --help for options.
+ */
+
+#define QUEUEFS_DISABLE_DEBUG 1
+
+#include <config.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "misc.c"
+#include "trace.c"
+#include "record.c"
+#include "joblog.c"
+#include "hash.c"
+#include "dedup.c"
+#include "claim.c"
+#include "cpuset.c"
+#include "template.c"
+#include "jobqueue.c"
+#include "jobqueue_process.c"
+
+#define REPLAY_DIR "/tmp/queuefs_replay"
+
+/* Each job's file lists "<seconds> <exit code>" for its runs. The last line is used for extra runs. */
+#define STUB_COMMAND "set -- $(sed -n '{attempt}p;$p' {} | head -n 1); sleep \"$1\"; exit \"$2\""
+
+static struct ReplaySettings {
+    double speed;
+    int workers;
+    int shards;
+    long retry_delay_ms;
+    long timeout_ms;
+    double max_rate;
+    double smallest_first;
+    long long max_running_bytes;
+} rs;
+
+typedef struct Job {
+    long long id;
+    long long enqueued_us;
+    long long bytes;
+    long long first_start_us; // -1 if it never ran
+    long long done_us;        // End of the successful run, or -1
+    long long cancel_us;      // -1 unless canceled
+    long long last_event_us;
+    int runs;
+    int failed_runs;
+    long long last_run_us;
+    GString* runs_spec; // For the job's file in the replay
+} Job;
+
+/* An arrival or cancellation to replay. */
+typedef struct Event {
+    long long time_us;
+    long index; // Of the job
+    bool cancel;
+} Event;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ns(long long ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
+
+static int compare_long_long(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_jobs(const void* a, const void* b) {
+    const Job* x = *(Job* const*)a;
+    const Job* y = *(Job* const*)b;
+    return compare_long_long(&x->enqueued_us, &y->enqueued_us);
+}
+
+static int compare_events(const void* a, const void* b) {
+    return compare_long_long(&((const Event*)a)->time_us, &((const Event*)b)->time_us);
+}
+
+static void free_job(Job* job) {
+    g_string_free(job->runs_spec, TRUE);
+    g_free(job);
+}
+
+/*
+ * Adds the jobs in a record file to jobs, with their runs.
+ * ids maps job IDs to the latest job with that ID in any file read so far,
+ * so it must be cleared between the files of different runs of queuefs.
+ */
+static bool load_record(const char* path, GQueue* jobs, GHashTable* ids) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), f)) {
+        long long time_us, id, value;
+        int code;
+        if (sscanf(line, "enqueue %lld %lld %lld ", &time_us, &id, &value) == 3) {
+            Job* job = g_malloc0(sizeof(Job));
+            job->id = id;
+            job->enqueued_us = time_us;
+            job->bytes = value;
+            job->first_start_us = -1;
+            job->done_us = -1;
+            job->cancel_us = -1;
+            job->last_event_us = time_us;
+            job->runs_spec = g_string_new("");
+            g_queue_push_tail(jobs, job);
+            g_hash_table_replace(ids, &job->id, job);
+        } else if (sscanf(line, "run %lld %lld %lld %d", &time_us, &id, &value, &code) == 4) {
+            Job* job = g_hash_table_lookup(ids, &id);
+            if (!job) {
+                continue;
+            }
+            if (job->runs == 0) {
+                job->first_start_us = time_us - value;
+            }
+            job->runs++;
+            job->last_run_us = value;
+            job->last_event_us = time_us;
+            if (code == 0) {
+                job->done_us = time_us;
+            } else {
+                job->failed_runs++;
+            }
+            // Signals and timeouts are recorded as negative codes, which sh can't exit with.
+            g_string_append_printf(job->runs_spec, "%.6f %d\n", value / 1e6 / rs.speed,
+                                   code >= 0 && code < 256 ? code : 1);
+        } else if (sscanf(line, "cancel %lld %lld", &time_us, &id) == 2) {
+            Job* job = g_hash_table_lookup(ids, &id);
+            if (job) {
+                job->cancel_us = time_us;
+                job->last_event_us = time_us;
+            }
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+/* Returns the jobs sorted by arrival. Sets *count. */
+static Job** sorted_jobs(GQueue* jobs, long* count) {
+    *count = g_queue_get_length(jobs);
+    Job** result = g_malloc((*count + 1) * sizeof(Job*));
+    for (long i = 0; i < *count; ++i) {
+        result[i] = g_queue_pop_head(jobs);
+    }
+    qsort(result, *count, sizeof(Job*), &compare_jobs);
+    return result;
+}
+
+/* Sorts samples in place and prints percentiles in seconds, multiplied by scale. */
+static void print_percentiles(const char* name, long long* samples, long n, double scale) {
+    if (n == 0) {
+        return;
+    }
+    qsort(samples, n, sizeof(long long), &compare_long_long);
+    const double ps[] = { 50, 90, 99 };
+    const char* names[] = { "p50", "p90", "p99" };
+    for (int i = 0; i < 3; ++i) {
+        long idx = (long)(ps[i] / 100.0 * (n - 1));
+        printf(",\"%s_%s_s\":%.3f", name, names[i], samples[idx] * scale / 1e6);
+    }
+    printf(",\"%s_max_s\":%.3f", name, samples[n - 1] * scale / 1e6);
+}
+
+/*
+ * Prints what happened to the jobs: how long they waited to first start,
+ * how long they took to succeed, and how long everything took.
+ */
+static void print_summary(const char* name, Job** jobs, long n, double scale) {
+    long long* waits = g_malloc((n + 1) * sizeof(long long));
+    long long* latencies = g_malloc((n + 1) * sizeof(long long));
+    long num_waits = 0, succeeded = 0, canceled = 0, runs = 0, failed_runs = 0;
+    long long first_us = n > 0 ? jobs[0]->enqueued_us : 0;
+    long long last_us = first_us;
+    for (long i = 0; i < n; ++i) {
+        Job* job = jobs[i];
+        if (job->first_start_us != -1) {
+            waits[num_waits++] = job->first_start_us - job->enqueued_us;
+        }
+        if (job->done_us != -1) {
+            latencies[succeeded++] = job->done_us - job->enqueued_us;
+        }
+        if (job->cancel_us != -1) {
+            canceled++;
+        }
+        runs += job->runs;
+        failed_runs += job->failed_runs;
+        if (job->last_event_us > last_us) {
+            last_us = job->last_event_us;
+        }
+    }
+
+    printf("{\"replay\":\"%s\",\"jobs\":%ld,\"succeeded\":%ld,\"canceled\":%ld,\"runs\":%ld,\"failed_runs\":%ld",
+           name, n, succeeded, canceled, runs, failed_runs);
+    printf(",\"makespan_s\":%.3f", (last_us - first_us) * scale / 1e6);
+    print_percentiles("wait", waits, num_waits, scale);
+    print_percentiles("latency", latencies, succeeded, scale);
+    printf("}\n");
+    fflush(stdout);
+
+    g_free(waits);
+    g_free(latencies);
+}
+
+static gchar* stub_path(long index) {
+    return g_strdup_printf(REPLAY_DIR "/jobs/%ld", index);
+}
+
+static bool write_stubs(Job** jobs, long n) {
+    mkdir(REPLAY_DIR "/jobs", 0755);
+    for (long i = 0; i < n; ++i) {
+        Job* job = jobs[i];
+        gchar* path = stub_path(i);
+        FILE* f = fopen(path, "w");
+        g_free(path);
+        if (!f) {
+            return false;
+        }
+        fputs(job->runs_spec->str, f);
+        if (job->runs == 0 || job->done_us == -1) {
+            fprintf(f, "%.6f 0\n", job->last_run_us / 1e6 / rs.speed);
+        }
+        fclose(f);
+    }
+    return true;
+}
+
+/* Runs the jobs through a job queue with the replay settings, recording to REPLAY_DIR/replayed. */
+static void replay(Job** jobs, long n) {
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = STUB_COMMAND;
+    jqs.max_workers = rs.workers;
+    jqs.shards = rs.shards;
+    jqs.retry_wait_ms = rs.retry_delay_ms / rs.speed;
+    jqs.timeout_ms = rs.timeout_ms > 0 ? MAX(1, rs.timeout_ms / rs.speed) : 0;
+    jqs.kill_grace_ms = MAX(1, jqs.kill_grace_ms / rs.speed);
+    jqs.max_start_rate = rs.max_rate * rs.speed;
+    jqs.smallest_first = rs.smallest_first;
+    jqs.max_running_bytes = rs.max_running_bytes;
+    jqs.record_file = REPLAY_DIR "/replayed";
+    JobQueue* jq = jobqueue_create(&jqs);
+    if (!jq) {
+        fprintf(stderr, "Failed to create job queue\n");
+        exit(1);
+    }
+
+    Event* events = g_malloc((2 * n + 1) * sizeof(Event));
+    long num_events = 0;
+    for (long i = 0; i < n; ++i) {
+        events[num_events++] = (Event){ jobs[i]->enqueued_us, i, false };
+        if (jobs[i]->cancel_us != -1) {
+            events[num_events++] = (Event){ jobs[i]->cancel_us, i, true };
+        }
+    }
+    qsort(events, num_events, sizeof(Event), &compare_events);
+
+    long long start_ns = now_ns();
+    for (long i = 0; i < num_events; ++i) {
+        long long due_ns = start_ns + (long long)((events[i].time_us - events[0].time_us) * 1000 / rs.speed);
+        long long t = now_ns();
+        if (t < due_ns) {
+            sleep_ns(due_ns - t);
+        }
+        gchar* path = stub_path(events[i].index);
+        if (events[i].cancel) {
+            jobqueue_cancel(jq, path);
+        } else {
+            JobInfo info;
+            jobqueue_job_info_init(&info);
+            info.bytes = jobs[events[i].index]->bytes;
+            jobqueue_add_job(jq, path, &info);
+        }
+        g_free(path);
+    }
+
+    // Retries aren't waited for by a flush, but they keep a job in the backlog.
+    long backlog_jobs;
+    long long backlog_bytes;
+    do {
+        sleep_ns(10 * 1000000LL);
+        jobqueue_get_backlog(jq, &backlog_jobs, &backlog_bytes);
+    } while (backlog_jobs > 0);
+
+    jobqueue_destroy(jq);
+    g_free(events);
+}
+
+static void print_usage(const char* progname) {
+    printf("\n"
+        "Usage: %s [options] record...\n"
+        "\n"
+        "Replays records written by queuefs --record. Give all shards'\n"
+        "records of one run of queuefs at once, e.g. record.0 record.1.\n"
+        "Times are in recorded time and are divided by --speed in the replay.\n"
+        "\n"
+        "  --speed=x          How many times faster than recorded. Default: 10\n"
+        "  --workers=n        Worker slots. Default: 8\n"
+        "  --shards=n         Job queue processes. Default: 1\n"
+        "  --retry-delay=ms   Wait before retrying a failed job. Default: 30000\n"
+        "  --timeout=ms       Limit on one run of a job. Default: 0 (none)\n"
+        "  --max-rate=n       Job starts per second. Default: 0 (no limit)\n"
+        "  --smallest-first=n Like queuefs --smallest-first. Default: 0\n"
+        "  --max-running-bytes=n\n"
+        "                     Limit on the recorded sizes of running jobs.\n"
+        "                     Default: 0 (no limit)\n"
+        "\n", progname);
+}
+
+int main(int argc, char* argv[]) {
+    rs.speed = 10;
+    rs.workers = 8;
+    rs.shards = 1;
+    rs.retry_delay_ms = 30 * 1000;
+    rs.timeout_ms = 0;
+    rs.max_rate = 0;
+    rs.smallest_first = 0;
+    rs.max_running_bytes = 0;
+
+    static const struct option long_options[] = {
+        { "speed", required_argument, NULL, 's' },
+        { "workers", required_argument, NULL, 'w' },
+        { "shards", required_argument, NULL, 'n' },
+        { "retry-delay", required_argument, NULL, 'r' },
+        { "timeout", required_argument, NULL, 't' },
+        { "max-rate", required_argument, NULL, 'm' },
+        { "smallest-first", required_argument, NULL, 'f' },
+        { "max-running-bytes", required_argument, NULL, 'b' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 's': rs.speed = atof(optarg); break;
+        case 'w': rs.workers = atoi(optarg); break;
+        case 'n': rs.shards = atoi(optarg); break;
+        case 'r': rs.retry_delay_ms = atol(optarg); break;
+        case 't': rs.timeout_ms = atol(optarg); break;
+        case 'm': rs.max_rate = atof(optarg); break;
+        case 'f': rs.smallest_first = atof(optarg); break;
+        case 'b': rs.max_running_bytes = atoll(optarg); break;
+        case 'h': print_usage(argv[0]); return 0;
+        default: print_usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc || rs.speed <= 0 || rs.workers < 1 || rs.shards < 1 ||
+        rs.shards > JOBQUEUE_MAX_SHARDS || rs.retry_delay_ms < 0 || rs.timeout_ms < 0 || rs.max_rate < 0 ||
+        rs.smallest_first < 0 || rs.max_running_bytes < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    GQueue recorded_jobs;
+    g_queue_init(&recorded_jobs);
+    GHashTable* ids = g_hash_table_new_full(&g_int64_hash, &g_int64_equal, NULL, NULL);
+    for (int i = optind; i < argc; ++i) {
+        if (!load_record(argv[i], &recorded_jobs, ids)) {
+            fprintf(stderr, "Failed to read %s: %s\n", argv[i], strerror(errno));
+            return 1;
+        }
+    }
+    g_hash_table_destroy(ids);
+    long n;
+    Job** jobs = sorted_jobs(&recorded_jobs, &n);
+    if (n == 0) {
+        fprintf(stderr, "No jobs in the record\n");
+        return 1;
+    }
+    print_summary("recorded", jobs, n, 1);
+
+    mkdir(REPLAY_DIR, 0755);
+    if (!write_stubs(jobs, n)) {
+        fprintf(stderr, "Failed to write job files to %s\n", REPLAY_DIR);
+        return 1;
+    }
+    for (int i = -1; i < rs.shards; ++i) {
+        gchar* path = i == -1 ? g_strdup(REPLAY_DIR "/replayed") : g_strdup_printf(REPLAY_DIR "/replayed.%d", i);
+        unlink(path);
+        g_free(path);
+    }
+
+    replay(jobs, n);
+
+    GQueue replayed_jobs;
+    g_queue_init(&replayed_jobs);
+    ids = g_hash_table_new_full(&g_int64_hash, &g_int64_equal, NULL, NULL);
+    for (int i = 0; i < rs.shards; ++i) {
+        gchar* path = rs.shards == 1 ? g_strdup(REPLAY_DIR "/replayed") : g_strdup_printf(REPLAY_DIR "/replayed.%d", i);
+        load_record(path, &replayed_jobs, ids);
+        g_free(path);
+    }
+    g_hash_table_destroy(ids);
+    long replayed_n;
+    Job** replayed = sorted_jobs(&replayed_jobs, &replayed_n);
+    print_summary("replayed", replayed, replayed_n, rs.speed);
+
+    for (long i = 0; i < n; ++i) {
+        free_job(jobs[i]);
+    }
+    for (long i = 0; i < replayed_n; ++i) {
+        free_job(replayed[i]);
+    }
+    g_free(jobs);
+    g_free(replayed);
+    return 0;
+}
@@ -23,12 +23,22 @@
 
 #define QUEUEFS_DISABLE_DEBUG 1 // Comment out to get some debugging output
 
+#include <config.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "misc.c"
+#include "trace.c"
+#include "record.c"
+#include "joblog.c"
+#include "hash.c"
+#include "dedup.c"
+#include "claim.c"
+#include "cpuset.c"
+#include "opstats.c"
+#include "template.c"
 #include "jobqueue.c"
 #include "jobqueue_process.c"
 
@@ -57,6 +67,7 @@ static void checked_jobqueue_destroy(JobQueue* jq) {
 
 static void simple() {
     JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
     jqs.cmd_template = "sleep 0.1 && " ECHO " && rm -f {} && touch {}";
     jqs.max_workers = 2;
     jqs.retry_wait_ms = 1;
@@ -105,9 +116,10 @@ static void simple() {
 
 static void rerunning() {
     JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
     jqs.cmd_template = "test -f {} && rm -f {}";
     jqs.max_workers = 2;
-    jqs.retry_wait_ms = 1;
+    jqs.retry_wait_ms = 60 * 1000; // Only rerun when flushed
 
     JobQueue* jq = jobqueue_create(&jqs);
     CHECK(jq);
@@ -128,7 +140,1194 @@ static void rerunning() {
     checked_jobqueue_destroy(jq);
 }
 
+static bool file_contains(const char* path, const char* needle) {
+    bool found = false;
+    FILE* f = fopen(path, "rb");
+    if (f) {
+        char buf[4096];
+        size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+        buf[len] = '\0';
+        found = strstr(buf, needle) != NULL;
+        fclose(f);
+    }
+    return found;
+}
+
+static void job_logs() {
+    const char* log_dir = TESTFILE("logdir");
+    const char* shared_log = TESTFILE("shared.log");
+    const char* ok_file = TESTFILE("log_ok");
+    const char* missing_file = TESTFILE("log_missing");
+    unlink(shared_log);
+    unlink(missing_file);
+    FILE* f = fopen(ok_file, "wb");
+    CHECK(f);
+    fclose(f);
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "echo out; echo err >&2; test -f {}";
+    jqs.max_workers = 2;
+    jqs.retry_wait_ms = 60 * 1000;
+    jqs.job_log_dir = log_dir;
+    jqs.job_log_file = shared_log;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    jobqueue_add_file(jq, ok_file);      // job 0
+    jobqueue_add_file(jq, missing_file); // job 1
+    jobqueue_flush(jq);
+    checked_jobqueue_destroy(jq);
+
+    CHECK_FILE_NOT_EXISTS(TESTFILE("logdir/0.log"));
+    CHECK(file_contains(TESTFILE("logdir/1.log"), "out\nerr\n"));
+    CHECK(file_contains(shared_log, "[job 0 " TESTFILE("log_ok") "] out\n"));
+    CHECK(file_contains(shared_log, "[job 1 " TESTFILE("log_missing") "] err\n"));
+
+    unlink(TESTFILE("logdir/1.log"));
+    rmdir(log_dir);
+    unlink(shared_log);
+    unlink(ok_file);
+}
+
+static void timeout() {
+    const char* filename = TESTFILE("timeout");
+    unlink(filename);
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    // The background job is in the worker's process group and must die too.
+    jqs.cmd_template = "trap '' TERM; (sleep 1 && touch {}) & sleep 10";
+    jqs.max_workers = 2;
+    jqs.retry_wait_ms = 60 * 1000;
+    jqs.timeout_ms = 100;
+    jqs.kill_grace_ms = 100;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    jobqueue_add_file(jq, filename);
+    jobqueue_flush(jq);
+    CHECK(-ms_to_timeval(&start) < 1000);
+
+    usleep(1500 * 1000);
+    CHECK_FILE_NOT_EXISTS(filename);
+
+    checked_jobqueue_destroy(jq);
+}
+
+static void export_and_adopt() {
+    const char* filename1 = TESTFILE("handoff1");
+    const char* filename2 = TESTFILE("handoff2");
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "touch {}";
+    jqs.max_workers = 2;
+    jqs.retry_wait_ms = 1;
+
+    JobQueue* old_jq = jobqueue_create(&jqs);
+    CHECK(old_jq);
+
+    JobQueueExport exp;
+    jobqueue_export(old_jq, &exp);
+    exp.shared_fd = dup(exp.shared_fd);
+    for (int i = 0; i < exp.num_shards; ++i) {
+        exp.input_fds[i] = dup(exp.input_fds[i]);
+        exp.output_fds[i] = dup(exp.output_fds[i]);
+    }
+    JobQueue* new_jq = jobqueue_adopt(&exp);
+    CHECK(new_jq);
+
+    // Both instances can add jobs but only the new one can flush.
+    jobqueue_add_file(old_jq, filename1);
+    jobqueue_add_file(new_jq, filename2);
+    jobqueue_flush(old_jq);
+    jobqueue_flush(new_jq);
+    CHECK_FILE_EXISTS(filename1);
+    CHECK_FILE_EXISTS(filename2);
+
+    checked_jobqueue_destroy(old_jq);
+    checked_jobqueue_destroy(new_jq);
+
+    unlink(filename1);
+    unlink(filename2);
+}
+
+static void sharded() {
+    const char* lock_dir = TESTFILE("shard_lock");
+    const char* violation = TESTFILE("shard_violation");
+    rmdir(lock_dir);
+    unlink(violation);
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    // Fails to take the lock if another job is running.
+    jqs.cmd_template = "if mkdir " TESTFILE("shard_lock") "; then "
+        "sleep 0.02; rmdir " TESTFILE("shard_lock") "; "
+        "else touch " TESTFILE("shard_violation") "; fi; touch {}";
+    jqs.max_workers = 1;
+    jqs.shards = 4;
+    jqs.retry_wait_ms = 1;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    const int count = 16;
+    char names[16][100];
+    for (int i = 0; i < count; ++i) {
+        snprintf(names[i], sizeof(names[i]), TESTFILE("shard_%d"), i);
+        unlink(names[i]);
+        jobqueue_add_file(jq, names[i]);
+    }
+
+    // Not flushed since flushing may exceed max_workers.
+    for (int tries = 0; tries < 500; ++tries) {
+        int done = 0;
+        for (int i = 0; i < count; ++i) {
+            done += (stat(names[i], &global_stat_struct) == 0);
+        }
+        if (done == count) {
+            break;
+        }
+        usleep(10 * 1000);
+    }
+    for (int i = 0; i < count; ++i) {
+        CHECK_FILE_EXISTS(names[i]);
+        unlink(names[i]);
+    }
+    CHECK_FILE_NOT_EXISTS(violation);
+
+    checked_jobqueue_destroy(jq);
+}
+
+static void backlog() {
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "test -f {} && rm -f {}";
+    jqs.max_workers = 2;
+    jqs.shards = 2;
+    jqs.retry_wait_ms = 60 * 1000;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    const char* filename = TESTFILE("backlog");
+    unlink(filename);
+
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    info.bytes = 1234;
+    jobqueue_add_job(jq, filename, &info);
+
+    long jobs;
+    long long bytes;
+    jobqueue_get_backlog(jq, &jobs, &bytes);
+    CHECK(jobs == 1);
+    CHECK(bytes == 1234);
+
+    // Failed runs stay in the backlog
+    for (int i = 0; i < 10; ++i) {
+        jobqueue_flush(jq);
+    }
+    jobqueue_get_backlog(jq, &jobs, &bytes);
+    CHECK(jobs == 1);
+    CHECK(bytes == 1234);
+
+    FILE* f = fopen(filename, "w");
+    fclose(f);
+    jobqueue_flush(jq);
+    CHECK_FILE_NOT_EXISTS(filename);
+    jobqueue_get_backlog(jq, &jobs, &bytes);
+    CHECK(jobs == 0);
+    CHECK(bytes == 0);
+
+    checked_jobqueue_destroy(jq);
+}
+
+static void dedup() {
+    CHECK(xxh64("", 0, 0) == 0xef46db3751d8e999ULL);
+    CHECK(xxh64("abc", 3, 0) == 0x44bc2cf5ad770999ULL);
+
+    const char* index_file = TESTFILE("dedup_index");
+    const char* filename = TESTFILE("dedup");
+    unlink(index_file);
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "test -f {} && rm -f {}";
+    jqs.retry_wait_ms = 60 * 1000;
+    jqs.dedup_index = index_file;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    char hash1[HASH_HEX_LEN + 1];
+    char hash2[HASH_HEX_LEN + 1];
+    HashState hs;
+    hash_init(&hs);
+    hash_update(&hs, "hello ", 6);
+    hash_update(&hs, "world", 5);
+    hash_final(&hs, hash1);
+    hash_init(&hs);
+    hash_update(&hs, "hello world!", 12);
+    hash_final(&hs, hash2);
+    CHECK(strlen(hash1) == HASH_HEX_LEN);
+    CHECK(strcmp(hash1, hash2) != 0);
+
+    // Only successful jobs are recorded
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    info.hash = hash1;
+    unlink(filename);
+    jobqueue_add_job(jq, filename, &info);
+    jobqueue_flush(jq);
+
+    CHECK(dedup_init(index_file));
+    CHECK(!dedup_seen(hash1));
+
+    FILE* f = fopen(filename, "w");
+    fclose(f);
+    jobqueue_flush(jq);
+    CHECK_FILE_NOT_EXISTS(filename);
+    CHECK(dedup_seen(hash1));
+    CHECK(!dedup_seen(hash2));
+
+    checked_jobqueue_destroy(jq);
+    dedup_shutdown();
+
+    // The index persists
+    CHECK(dedup_init(index_file));
+    CHECK(dedup_seen(hash1));
+    dedup_shutdown();
+    unlink(index_file);
+}
+
+static void command_templates() {
+    GString* out = g_string_new("");
+    CommandTemplate* tmpl = template_compile(
+        "run {} {rel} {base} {stem} {attempt} {id} {x} awk '{print}'", "/src");
+
+    template_expand(tmpl, out, "/src/dir/file.tar.gz", 2, 17);
+    CHECK(g_str_equal(out->str,
+        "run '/src/dir/file.tar.gz' 'dir/file.tar.gz' 'file.tar.gz' 'file.tar' 2 17 {x} awk '{print}'"));
+
+    template_expand(tmpl, out, "/elsewhere/it's", 1, 0);
+    CHECK(g_str_equal(out->str,
+        "run '/elsewhere/it'\\''s' '/elsewhere/it'\\''s' 'it'\\''s' 'it'\\''s' 1 0 {x} awk '{print}'"));
+
+    template_expand(tmpl, out, "/src/.hidden", 1, 0);
+    CHECK(g_str_has_prefix(out->str, "run '/src/.hidden' '.hidden' '.hidden' '.hidden' "));
+
+    template_free(tmpl);
+    g_string_free(out, true);
+}
+
+static bool file_has_content(const char* path, const char* expected) {
+    gchar* content = NULL;
+    bool ok = g_file_get_contents(path, &content, NULL, NULL) && g_str_equal(content, expected);
+    g_free(content);
+    return ok;
+}
+
+static void stdin_modes() {
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "cat > {}.copy";
+    jqs.stdin_file = true;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    // The file itself
+    const char* filename = TESTFILE("stdin");
+    FILE* f = fopen(filename, "w");
+    fputs("from the file", f);
+    fclose(f);
+    jobqueue_add_file(jq, filename);
+
+    // Content passed as a file descriptor, which is used for every attempt
+    const char* passed_name = TESTFILE("stdin_passed");
+    int fd = open(passed_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    CHECK(fd != -1);
+    CHECK(write(fd, "passed", 6) == 6);
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    info.stdin_fd = fd;
+    info.bytes = 6;
+    jobqueue_add_job(jq, passed_name, &info);
+    close(fd);
+    unlink(passed_name);
+    int held_fds;
+    long long held_bytes;
+    jobqueue_get_stdin_fds(jq, &held_fds, &held_bytes);
+    CHECK(held_fds == 1 && held_bytes == 6);
+
+    jobqueue_flush(jq);
+    // Closed once the job succeeded
+    jobqueue_get_stdin_fds(jq, &held_fds, &held_bytes);
+    CHECK(held_fds == 0 && held_bytes == 0);
+
+    CHECK(file_has_content(TESTFILE("stdin.copy"), "from the file"));
+    CHECK(file_has_content(TESTFILE("stdin_passed.copy"), "passed"));
+    unlink(filename);
+    unlink(TESTFILE("stdin.copy"));
+    unlink(TESTFILE("stdin_passed.copy"));
+
+    checked_jobqueue_destroy(jq);
+}
+
+static void delete_and_move_on_finish() {
+    const char* filename = TESTFILE("finish");
+    const char* move_dir = TESTFILE("finish_dir");
+    const char* moved = TESTFILE("finish_dir/queuefs_test_file_finish");
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "test -f {}";
+    jqs.delete_on_finish = true;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+    fclose(fopen(filename, "w"));
+    jobqueue_add_file(jq, filename);
+    jobqueue_flush(jq);
+    CHECK_FILE_NOT_EXISTS(filename);
+    checked_jobqueue_destroy(jq);
+
+    mkdir(move_dir, 0755);
+    jqs.delete_on_finish = false;
+    jqs.move_on_finish_dir = move_dir;
+    jq = jobqueue_create(&jqs);
+    CHECK(jq);
+    fclose(fopen(filename, "w"));
+    jobqueue_add_file(jq, filename);
+    jobqueue_flush(jq);
+    CHECK_FILE_NOT_EXISTS(filename);
+    CHECK_FILE_EXISTS(moved);
+    checked_jobqueue_destroy(jq);
+
+    unlink(moved);
+    rmdir(move_dir);
+
+    // A file is left alone while any job for it is unfinished,
+    // even if it's one that needs no run.
+    jqs.cmd_template = "test -f {}.go";
+    jqs.move_on_finish_dir = NULL;
+    jqs.delete_on_finish = true;
+    jqs.retry_wait_ms = 1;
+    jq = jobqueue_create(&jqs);
+    CHECK(jq);
+    fclose(fopen(filename, "w"));
+    jobqueue_add_file(jq, filename);
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    info.done = true;
+    jobqueue_add_job(jq, filename, &info);
+    usleep(50 * 1000);
+    CHECK_FILE_EXISTS(filename);
+    char go[256];
+    snprintf(go, sizeof(go), "%s.go", filename);
+    fclose(fopen(go, "w"));
+    // A flush only waits for a run, and the one in flight may have missed the .go file.
+    jobqueue_flush(jq);
+    jobqueue_flush(jq);
+    CHECK_FILE_NOT_EXISTS(filename);
+    unlink(go);
+    checked_jobqueue_destroy(jq);
+}
+
+static void ordered_keys() {
+    const char* violation = TESTFILE("order_violation");
+    unlink(violation);
+    unlink(TESTFILE("order_log_a"));
+    unlink(TESTFILE("order_log_b"));
+    rmdir(TESTFILE("order_lock_a"));
+    rmdir(TESTFILE("order_lock_b"));
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    // The key is the first letter of the file name. The first job fails once.
+    jqs.cmd_template = "k=$(echo {base} | cut -c1); "
+        "if [ {base} = a0 ] && [ {attempt} = 1 ]; then exit 1; fi; "
+        "if mkdir " TESTFILE("order_lock_") "$k; then "
+        "sleep 0.01; echo {base} >> " TESTFILE("order_log_") "$k; rmdir " TESTFILE("order_lock_") "$k; "
+        "else touch " TESTFILE("order_violation") "; fi";
+    jqs.max_workers = 4;
+    jqs.shards = 2;
+    jqs.retry_wait_ms = 1;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    for (int i = 0; i < 5; ++i) {
+        for (int k = 0; k < 2; ++k) {
+            char name[100];
+            char key[2] = { "ab"[k], '\0' };
+            snprintf(name, sizeof(name), "%s%d", key, i);
+            JobInfo info;
+            jobqueue_job_info_init(&info);
+            info.order_key = key;
+            jobqueue_add_job(jq, name, &info);
+        }
+    }
+
+    const char* expected_a = "a0\na1\na2\na3\na4\n";
+    const char* expected_b = "b0\nb1\nb2\nb3\nb4\n";
+    for (int tries = 0; tries < 500; ++tries) {
+        if (file_has_content(TESTFILE("order_log_a"), expected_a) &&
+            file_has_content(TESTFILE("order_log_b"), expected_b)) {
+            break;
+        }
+        usleep(10 * 1000);
+    }
+    CHECK(file_has_content(TESTFILE("order_log_a"), expected_a));
+    CHECK(file_has_content(TESTFILE("order_log_b"), expected_b));
+    CHECK_FILE_NOT_EXISTS(violation);
+    unlink(TESTFILE("order_log_a"));
+    unlink(TESTFILE("order_log_b"));
+
+    checked_jobqueue_destroy(jq);
+}
+
+static void start_rate_limit() {
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "touch {}";
+    jqs.shards = 2;
+    jqs.max_start_rate = 20;
+    jqs.start_burst = 2;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    // Two start at once, the rest 50 ms apart, across both shards.
+    const int count = 10;
+    char names[10][100];
+    long long start_us = now_us();
+    for (int i = 0; i < count; ++i) {
+        snprintf(names[i], sizeof(names[i]), TESTFILE("rate_%d"), i);
+        unlink(names[i]);
+        jobqueue_add_file(jq, names[i]);
+    }
+    jobqueue_flush(jq);
+    long long elapsed_ms = (now_us() - start_us) / 1000;
+
+    for (int i = 0; i < count; ++i) {
+        CHECK_FILE_EXISTS(names[i]);
+        unlink(names[i]);
+    }
+    CHECK(elapsed_ms >= 350);
+    CHECK(elapsed_ms < 2000);
+
+    checked_jobqueue_destroy(jq);
+
+    // Rates too high to time still limit something.
+    jqs.max_start_rate = 1e7;
+    jq = jobqueue_create(&jqs);
+    CHECK(jq);
+    CHECK(jq->shared->start_interval_us == 1);
+    checked_jobqueue_destroy(jq);
+}
+
+typedef struct BarrierWait {
+    JobQueue* jq;
+    long long id;
+    volatile bool returned;
+} BarrierWait;
+
+static void* wait_for_barrier(void* arg) {
+    BarrierWait* wait = arg;
+    jobqueue_barrier_wait(wait->jq, wait->id);
+    wait->returned = true;
+    return NULL;
+}
+
+static void scoped_barriers() {
+    const char* slow = TESTFILE("barrier_slow/x");
+    const char* fast = TESTFILE("barrier_fast/x");
+    const char* release = TESTFILE("barrier_release");
+    mkdir(TESTFILE("barrier_slow"), 0755);
+    mkdir(TESTFILE("barrier_fast"), 0755);
+    unlink(release);
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    // Slow jobs wait until released.
+    jqs.cmd_template = "case {} in *slow*) while [ ! -f " TESTFILE("barrier_release") " ]; do sleep 0.01; done;; esac; touch {}.done";
+    jqs.max_workers = 4;
+    jqs.shards = 2;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    jobqueue_add_file(jq, slow);
+    const char* slow_scope[] = { TESTFILE("barrier_slow"), NULL };
+    long long slow_barrier = jobqueue_barrier(jq, slow_scope);
+
+    jobqueue_add_file(jq, fast);
+    const char* fast_scope[] = { TESTFILE("barrier_fast/"), NULL };
+    long long fast_barrier = jobqueue_barrier(jq, fast_scope);
+    CHECK(slow_barrier != fast_barrier);
+
+    // The fast barrier doesn't wait for the slow job.
+    jobqueue_barrier_wait(jq, fast_barrier);
+    CHECK_FILE_EXISTS(TESTFILE("barrier_fast/x.done"));
+    CHECK_FILE_NOT_EXISTS(TESTFILE("barrier_slow/x.done"));
+
+    close(open(release, O_WRONLY | O_CREAT, 0644));
+    jobqueue_barrier_wait(jq, slow_barrier);
+    CHECK_FILE_EXISTS(TESTFILE("barrier_slow/x.done"));
+    unlink(release);
+
+    // Nor does it when another thread is already waiting for the slow one.
+    jobqueue_add_file(jq, TESTFILE("barrier_slow/y"));
+    BarrierWait slow_wait = { jq, jobqueue_barrier(jq, slow_scope), false };
+    jobqueue_add_file(jq, TESTFILE("barrier_fast/y"));
+    fast_barrier = jobqueue_barrier(jq, fast_scope);
+    pthread_t thread;
+    pthread_create(&thread, NULL, &wait_for_barrier, &slow_wait);
+    usleep(50 * 1000);
+    jobqueue_barrier_wait(jq, fast_barrier);
+    CHECK_FILE_EXISTS(TESTFILE("barrier_fast/y.done"));
+    CHECK(!slow_wait.returned);
+    close(open(release, O_WRONLY | O_CREAT, 0644));
+    pthread_join(thread, NULL);
+    CHECK(slow_wait.returned);
+    CHECK_FILE_EXISTS(TESTFILE("barrier_slow/y.done"));
+
+    unlink(TESTFILE("barrier_fast/x.done"));
+    unlink(TESTFILE("barrier_slow/x.done"));
+    unlink(TESTFILE("barrier_fast/y.done"));
+    unlink(TESTFILE("barrier_slow/y.done"));
+    rmdir(TESTFILE("barrier_fast"));
+    rmdir(TESTFILE("barrier_slow"));
+    unlink(release);
+
+    checked_jobqueue_destroy(jq);
+}
+
+static void worker_placement() {
+    CpuSet* parsed = cpuset_parse("0-2,5, 4");
+    CHECK(parsed && cpuset_count(parsed) == 5);
+    cpuset_free(parsed);
+    CHECK(cpuset_parse("3-1") == NULL);
+    CHECK(cpuset_parse("x") == NULL);
+
+    CpuSet* current = cpuset_current();
+    CHECK(current);
+    CpuSet* last = cpuset_single(current, cpuset_count(current) - 1);
+    char cpu[16];
+    char expected[32];
+    snprintf(cpu, sizeof(cpu), "%d", last->cpus[0]);
+    snprintf(expected, sizeof(expected), "%s\n", cpu);
+    cpuset_free(last);
+    cpuset_free(current);
+
+    const char* filename = TESTFILE("placement");
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "sed -n 's/^Cpus_allowed_list:[[:space:]]*//p' /proc/self/status > {}";
+    jqs.worker_cpus = cpu;
+    jqs.worker_placement = JOBQUEUE_PLACE_CPU;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+    jobqueue_add_file(jq, filename);
+    jobqueue_flush(jq);
+    CHECK(file_has_content(filename, expected));
+    unlink(filename);
+
+    checked_jobqueue_destroy(jq);
+}
+
+static void cancel() {
+    const char* running = TESTFILE("cancel_running");
+    const char* queued = TESTFILE("cancel_queued");
+    unlink(TESTFILE("cancel_running.started"));
+    unlink(TESTFILE("cancel_queued.ran"));
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "case {} in *running) touch {}.started; sleep 10;; *) touch {}.ran;; esac";
+    jqs.max_workers = 1;
+    jqs.kill_grace_ms = 100;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    long long start_us = now_us();
+    jobqueue_add_file(jq, running);
+    jobqueue_add_file(jq, queued);
+    for (int tries = 0; tries < 500 && stat(TESTFILE("cancel_running.started"), &global_stat_struct) != 0; ++tries) {
+        usleep(10 * 1000);
+    }
+    CHECK_FILE_EXISTS(TESTFILE("cancel_running.started"));
+
+    jobqueue_cancel(jq, queued);
+    jobqueue_cancel(jq, running);
+    jobqueue_flush(jq);
+    CHECK((now_us() - start_us) / 1000 < 5000);
+    CHECK_FILE_NOT_EXISTS(TESTFILE("cancel_queued.ran"));
+
+    long jobs;
+    long long bytes;
+    jobqueue_get_backlog(jq, &jobs, &bytes);
+    CHECK(jobs == 0);
+
+    // Jobs added later are unaffected.
+    jobqueue_add_file(jq, queued);
+    jobqueue_flush(jq);
+    CHECK_FILE_EXISTS(TESTFILE("cancel_queued.ran"));
+
+    unlink(TESTFILE("cancel_running.started"));
+    unlink(TESTFILE("cancel_queued.ran"));
+    checked_jobqueue_destroy(jq);
+}
+
+static void recording() {
+    const char* record = TESTFILE("record");
+    const char* ok = TESTFILE("record_ok");
+    const char* fail = TESTFILE("record_fail");
+    unlink(record);
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "case {} in *fail) exit 3;; esac";
+    jqs.retry_wait_ms = 60 * 1000; // Only rerun when flushed
+    jqs.record_file = record;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    info.bytes = 5;
+    jobqueue_add_job(jq, ok, &info);
+    jobqueue_add_file(jq, fail);
+    jobqueue_flush(jq);
+    jobqueue_cancel(jq, fail);
+    checked_jobqueue_destroy(jq);
+
+    long long time_us, id, ok_id = -1, fail_id = -2, bytes, duration_us;
+    int code, ok_code = -1, fail_code = -1;
+    bool canceled = false;
+    char line[256];
+    FILE* f = fopen(record, "r");
+    CHECK(f);
+    while (fgets(line, sizeof(line), f)) {
+        int path_start;
+        if (sscanf(line, "enqueue %lld %lld %lld %n", &time_us, &id, &bytes, &path_start) == 3) {
+            CHECK(time_us > 0);
+            if (strcmp(line + path_start, "/tmp/queuefs_test_file_record_ok\n") == 0) {
+                CHECK(bytes == 5);
+                ok_id = id;
+            } else {
+                CHECK(bytes == -1);
+                fail_id = id;
+            }
+        } else if (sscanf(line, "run %lld %lld %lld %d", &time_us, &id, &duration_us, &code) == 4) {
+            CHECK(duration_us >= 0);
+            if (id == ok_id) {
+                ok_code = code;
+            } else if (id == fail_id) {
+                fail_code = code;
+            }
+        } else if (sscanf(line, "cancel %lld %lld", &time_us, &id) == 2) {
+            canceled = id == fail_id;
+        }
+    }
+    fclose(f);
+    CHECK(ok_code == 0);
+    CHECK(fail_code == 3);
+    CHECK(canceled);
+
+    unlink(record);
+}
+
+// The retry job fails twice and the slow job times out once. Each run takes minutes or hours.
+static int simulated_job(const char* path, int attempt, long long* duration_us) {
+    if (strstr(path, "slow")) {
+        *duration_us = (attempt == 0 ? 2 * 3600 : 60) * 1000000LL;
+        return 0;
+    }
+    *duration_us = 10 * 60 * 1000000LL;
+    return attempt < 2 ? 1 : 0;
+}
+
+static void simulated_jobs() {
+    const char* record = TESTFILE("virtual_record");
+    unlink(record);
+
+    JobQueueSimulation sim;
+    sim.virtual_clock = true;
+    sim.run_job = &simulated_job;
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "false";
+    jqs.retry_wait_ms = 3600 * 1000;
+    jqs.timeout_ms = 30 * 60 * 1000;
+    jqs.record_file = record;
+    jqs.simulation = &sim;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    jobqueue_add_file(jq, TESTFILE("virtual_retry"));
+    jobqueue_add_file(jq, TESTFILE("virtual_slow"));
+    // Not flushed, since barriers make jobs run before their retry time.
+    long jobs = 1;
+    long long bytes;
+    while (jobs > 0 && -ms_to_timeval(&start) < 5000) {
+        usleep(1000);
+        jobqueue_get_backlog(jq, &jobs, &bytes);
+    }
+    CHECK(jobs == 0);
+    checked_jobqueue_destroy(jq);
+
+    long long time_us, id, duration_us;
+    int code;
+    int runs = 0, failed_runs = 0, timed_out_runs = 0;
+    char line[256];
+    FILE* f = fopen(record, "r");
+    CHECK(f);
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "run %lld %lld %lld %d", &time_us, &id, &duration_us, &code) == 4) {
+            runs++;
+            if (code == 1) {
+                CHECK(duration_us == 10 * 60 * 1000000LL);
+                failed_runs++;
+            } else if (code == -SIGTERM) {
+                CHECK(duration_us == 30 * 60 * 1000000LL);
+                timed_out_runs++;
+            } else {
+                CHECK(code == 0);
+            }
+        }
+    }
+    fclose(f);
+    CHECK(runs == 5);
+    CHECK(failed_runs == 2);
+    CHECK(timed_out_runs == 1);
+
+    unlink(record);
+}
+
+// Takes a millisecond per byte of the size in the file name. The holder runs until canceled.
+// Retry jobs fail their first run at once.
+static int sized_job(const char* path, int attempt, long long* duration_us) {
+    if (strstr(path, "retry") && attempt == 0) {
+        *duration_us = 0;
+        return 1;
+    }
+    *duration_us = strstr(path, "holder") ? -1 : atol(strrchr(path, '_') + 1) * 1000LL;
+    return 0;
+}
+
+static void smallest_first() {
+    const char* record = TESTFILE("sjf_record");
+    unlink(record);
+
+    JobQueueSimulation sim;
+    sim.virtual_clock = true;
+    sim.run_job = &sized_job;
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "false";
+    jqs.max_workers = 1;
+    jqs.smallest_first = 1;
+    jqs.record_file = record;
+    jqs.simulation = &sim;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    info.bytes = 10;
+    jobqueue_add_job(jq, TESTFILE("sjf_10"), &info); // Teaches it the time per byte
+    jobqueue_flush(jq);
+
+    // Queued behind the holder at the same virtual time, so only their sizes differ.
+    jobqueue_add_file(jq, TESTFILE("sjf_holder"));
+    const long sizes[] = { 1000, 100, 1 };
+    for (int i = 0; i < 3; ++i) {
+        char path[100];
+        snprintf(path, sizeof(path), TESTFILE("sjf_%ld"), sizes[i]);
+        info.bytes = sizes[i];
+        jobqueue_add_job(jq, path, &info);
+    }
+    jobqueue_cancel(jq, TESTFILE("sjf_holder"));
+    jobqueue_flush(jq);
+    checked_jobqueue_destroy(jq);
+
+    // Jobs run one at a time so they're recorded in the order they ran.
+    long long time_us, id, bytes, duration_us, ids[1001];
+    int code;
+    for (int i = 0; i <= 1000; ++i) {
+        ids[i] = -1;
+    }
+    GString* order = g_string_new("");
+    char line[256];
+    FILE* f = fopen(record, "r");
+    CHECK(f);
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "enqueue %lld %lld %lld", &time_us, &id, &bytes) == 3 && bytes > 0) {
+            ids[bytes] = id;
+        } else if (sscanf(line, "run %lld %lld %lld %d", &time_us, &id, &duration_us, &code) == 4 && code == 0) {
+            for (long size = 1; size <= 1000; size *= 10) {
+                if (ids[size] == id) {
+                    g_string_append_printf(order, "%ld ", size);
+                }
+            }
+        }
+    }
+    fclose(f);
+    CHECK(strcmp(order->str, "10 1 100 1000 ") == 0);
+    g_string_free(order, TRUE);
+
+    unlink(record);
+}
+
+// A small job waiting for its retry sorts ahead of a big one that's due but mustn't hold it up.
+static void smallest_first_retry() {
+    const char* record = TESTFILE("sjf_retry_record");
+    unlink(record);
+
+    JobQueueSimulation sim;
+    sim.virtual_clock = true;
+    sim.run_job = &sized_job;
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "false";
+    jqs.max_workers = 1;
+    jqs.smallest_first = 1;
+    jqs.retry_wait_ms = 1000;
+    jqs.record_file = record;
+    jqs.simulation = &sim;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    info.bytes = 10;
+    jobqueue_add_job(jq, TESTFILE("sjf_10"), &info);
+    jobqueue_flush(jq);
+
+    // The retry job fails once the holder is gone. Its retry is due in 1 s,
+    // while the 100 s job is due at once.
+    jobqueue_add_file(jq, TESTFILE("sjf_holder"));
+    info.bytes = 1;
+    jobqueue_add_job(jq, TESTFILE("sjf_retry_1"), &info);
+    info.bytes = 100000;
+    jobqueue_add_job(jq, TESTFILE("sjf_100000"), &info);
+    jobqueue_cancel(jq, TESTFILE("sjf_holder"));
+    // Not flushed, since the failed run already counts for a barrier.
+    long jobs = 1;
+    long long bytes;
+    for (int tries = 0; tries < 5000 && jobs > 0; ++tries) {
+        usleep(1000);
+        jobqueue_get_backlog(jq, &jobs, &bytes);
+    }
+    CHECK(jobs == 0);
+    checked_jobqueue_destroy(jq);
+
+    long long time_us, id, duration_us, retry_id = -1, big_id = -1;
+    int code;
+    GString* order = g_string_new("");
+    char line[256];
+    FILE* f = fopen(record, "r");
+    CHECK(f);
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "enqueue %lld %lld %lld", &time_us, &id, &bytes) == 3) {
+            if (bytes == 1) {
+                retry_id = id;
+            } else if (bytes == 100000) {
+                big_id = id;
+            }
+        } else if (sscanf(line, "run %lld %lld %lld %d", &time_us, &id, &duration_us, &code) == 4 && code == 0) {
+            g_string_append(order, id == retry_id ? "retry " : id == big_id ? "big " : "");
+        }
+    }
+    fclose(f);
+    CHECK(strcmp(order->str, "big retry ") == 0);
+    g_string_free(order, TRUE);
+
+    unlink(record);
+}
+
+// Jobs of 60 bytes can't run together in a budget of 100. One of 150 still runs alone.
+static void byte_budget() {
+    const char* violation = TESTFILE("budget_violation");
+    unlink(violation);
+    rmdir(TESTFILE("budget_lock"));
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "if mkdir " TESTFILE("budget_lock") "; then "
+        "sleep 0.05; rmdir " TESTFILE("budget_lock") "; "
+        "else touch " TESTFILE("budget_violation") "; fi";
+    jqs.max_workers = 4;
+    jqs.shards = 2;
+    jqs.max_running_bytes = 100;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    for (int i = 0; i < 4; ++i) {
+        char name[100];
+        snprintf(name, sizeof(name), "budget_%d", i);
+        info.bytes = i < 3 ? 60 : 150;
+        jobqueue_add_job(jq, name, &info);
+    }
+    jobqueue_flush(jq);
+    CHECK_FILE_NOT_EXISTS(violation);
+    CHECK(jq->shared->running_bytes == 0);
+
+    checked_jobqueue_destroy(jq);
+}
+
+static void streamed_stdin() {
+    const char* filename = TESTFILE("stream");
+    const char* copy = TESTFILE("stream.copy");
+    const char* started = TESTFILE("stream.started");
+    unlink(copy);
+    unlink(started);
+    int file_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(file_fd != -1);
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    // The first run fails after reading the stream, the retry reads the file.
+    jqs.cmd_template = "touch {}.started; cat > {}.copy; [ {attempt} -gt 1 ]";
+    jqs.stdin_file = true;
+    jqs.retry_wait_ms = 1;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    int pipe_fds[2];
+    CHECK(pipe(pipe_fds) == 0);
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    info.stdin_fd = pipe_fds[0];
+    jobqueue_add_job(jq, filename, &info);
+    close(pipe_fds[0]);
+
+    // The job runs while the file is still being written.
+    CHECK(write(pipe_fds[1], "str", 3) == 3);
+    CHECK(write(file_fd, "str", 3) == 3);
+    for (int tries = 0; tries < 500 && stat(started, &global_stat_struct) != 0; ++tries) {
+        usleep(10 * 1000);
+    }
+    CHECK_FILE_EXISTS(started);
+    CHECK(write(pipe_fds[1], "eamed", 5) == 5);
+    CHECK(write(file_fd, "eamed", 5) == 5);
+    close(pipe_fds[1]);
+    close(file_fd);
+
+    jobqueue_flush(jq);
+    jobqueue_flush(jq);
+    CHECK(file_has_content(copy, "streamed"));
+    long jobs;
+    long long bytes;
+    jobqueue_get_backlog(jq, &jobs, &bytes);
+    CHECK(jobs == 0);
+
+    unlink(filename);
+    unlink(copy);
+    unlink(started);
+    checked_jobqueue_destroy(jq);
+}
+
+static void streamed_stdin_early_exit() {
+    const char* filename = TESTFILE("cut_stream");
+    const char* out = TESTFILE("cut_stream.out");
+    unlink(out);
+    int file_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(file_fd != -1);
+
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    // Succeeds without reading to the end
+    jqs.cmd_template = "head -c 3 >> {}.out";
+    jqs.stdin_file = true;
+    jqs.delete_on_finish = true;
+
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+
+    int pipe_fds[2];
+    CHECK(pipe(pipe_fds) == 0);
+    JobInfo info;
+    jobqueue_job_info_init(&info);
+    info.stdin_fd = pipe_fds[0];
+    jobqueue_add_job(jq, filename, &info);
+    close(pipe_fds[0]);
+    CHECK(write(pipe_fds[1], "abc", 3) == 3);
+    CHECK(write(file_fd, "abc", 3) == 3);
+    for (int tries = 0; tries < 500 && !file_has_content(out, "abc"); ++tries) {
+        usleep(10 * 1000);
+    }
+
+    // Exiting while the file is being written is no run. It's not finished or retried.
+    usleep(50 * 1000);
+    CHECK_FILE_EXISTS(filename);
+    CHECK(file_has_content(out, "abc"));
+
+    // The rest of the stream is discarded and the job runs again on the whole file.
+    CHECK(write(pipe_fds[1], "def", 3) == 3);
+    CHECK(write(file_fd, "def", 3) == 3);
+    close(pipe_fds[1]);
+    close(file_fd);
+    jobqueue_flush(jq);
+    CHECK(file_has_content(out, "abcabc"));
+    CHECK_FILE_NOT_EXISTS(filename);
+
+    unlink(out);
+    checked_jobqueue_destroy(jq);
+}
+
+static void* time_fast_op(void* unused) {
+    opstats_finish(0, opstats_start(), "/a");
+    return NULL;
+}
+
+static void op_stats() {
+    static const char* const names[] = { "fast", "slow" };
+    CHECK(opstats_init(2, names, 1000));
+
+    /* One from a thread that has exited by the time of the report */
+    pthread_t thread;
+    pthread_create(&thread, NULL, &time_fast_op, NULL);
+    pthread_join(thread, NULL);
+    time_fast_op(NULL);
+    opstats_finish(1, opstats_start() - 5000, "/b");
+
+    char* report = opstats_report();
+    unsigned long long count, max_us;
+    const char* line = strstr(report, "\nfast ");
+    CHECK(line && sscanf(line, " fast %llu", &count) == 1 && count == 2);
+    line = strstr(report, "\nslow ");
+    CHECK(line && sscanf(line, " slow %llu %*u %*d %*d %*d %llu", &count, &max_us) == 2);
+    CHECK(count == 1 && max_us >= 5000);
+    CHECK(strstr(report, "slow ops (at least 1000 us): 1\n"));
+    CHECK(strstr(report, " slow 5") && strstr(report, " us /b\n"));
+    g_free(report);
+
+    opstats_shutdown();
+}
+
+static GQueue taken_over;
+
+static void record_takeover(const char* rel_path) {
+    g_queue_push_tail(&taken_over, g_strdup(rel_path));
+}
+
+static void write_foreign_claim(const char* dir, const char* foreign_owner, const char* rel_path) {
+    gchar* path = claim_file_name(dir, rel_path);
+    FILE* f = fopen(path, "w");
+    fprintf(f, "%s\n%s\n", foreign_owner, rel_path);
+    fclose(f);
+    g_free(path);
+}
+
+static void claims() {
+    const char* dir = TESTFILE("claims");
+    CHECK(system("rm -rf " TESTFILE("claims")) == 0);
+    g_queue_init(&taken_over);
+    CHECK(claim_init(dir, "/mnt/a", 300, false, &record_takeover));
+
+    // New and own claims
+    CHECK(claim_acquire("x"));
+    CHECK(claim_acquire("x"));
+    gchar* x_claim = claim_file_name(dir, "x");
+    CHECK_FILE_EXISTS(x_claim);
+
+    // A live instance's claim, until its heartbeat stops
+    FILE* f = fopen(TESTFILE("claims/other.alive"), "w");
+    fclose(f);
+    write_foreign_claim(dir, "other", "y");
+    CHECK(!claim_acquire("y"));
+    struct timespec old_times[2] = { { time(NULL) - 10, 0 }, { time(NULL) - 10, 0 } };
+    CHECK(utimensat(AT_FDCWD, TESTFILE("claims/other.alive"), old_times, 0) == 0);
+    CHECK(claim_acquire("y"));
+
+    // A dead instance's claim is taken over in the background
+    write_foreign_claim(dir, "ghost", "z");
+    for (int tries = 0; tries < 100 && g_queue_is_empty(&taken_over); ++tries) {
+        usleep(10 * 1000);
+    }
+    CHECK(g_queue_get_length(&taken_over) == 1);
+    gchar* rel_path = g_queue_pop_head(&taken_over);
+    CHECK(g_str_equal(rel_path, "z"));
+    g_free(rel_path);
+    CHECK(claim_acquire("z"));
+
+    // A claim its creator didn't get to write, once it's older than the lease
+    gchar* w_claim = claim_file_name(dir, "w");
+    fclose(fopen(w_claim, "w"));
+    CHECK(!claim_acquire("w"));
+    CHECK(utimensat(AT_FDCWD, w_claim, old_times, 0) == 0);
+    CHECK(claim_acquire("w"));
+    gchar* w_content = g_strdup_printf("%s\nw\n", owner);
+    CHECK(file_has_content(w_claim, w_content));
+    g_free(w_content);
+    g_free(w_claim);
+
+    // Released by the job queue when the job succeeds
+    JobQueueSettings jqs;
+    jobqueue_settings_init(&jqs);
+    jqs.cmd_template = "true";
+    jqs.source_dir = "/src";
+    jqs.claim_dir = dir;
+    JobQueue* jq = jobqueue_create(&jqs);
+    CHECK(jq);
+    jobqueue_add_file(jq, "/src/x");
+    jobqueue_flush(jq);
+    CHECK_FILE_NOT_EXISTS(x_claim);
+    checked_jobqueue_destroy(jq);
+
+    claim_shutdown();
+    g_free(x_claim);
+    CHECK(system("rm -rf " TESTFILE("claims")) == 0);
+}
+
 int main() {
+    command_templates();
     simple();
     rerunning();
+    job_logs();
+    timeout();
+    export_and_adopt();
+    sharded();
+    backlog();
+    dedup();
+    stdin_modes();
+    delete_and_move_on_finish();
+    ordered_keys();
+    start_rate_limit();
+    scoped_barriers();
+    worker_placement();
+    cancel();
+    recording();
+    simulated_jobs();
+    smallest_first();
+    smallest_first_retry();
+    byte_budget();
+    streamed_stdin();
+    streamed_stdin_early_exit();
+    op_stats();
+    claims();
 }
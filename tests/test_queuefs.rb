@@ -75,3 +75,83 @@ test "retry failed job", :options => '-r 300', :cmd => 'test -f {}2 && echo {} >
     flush_jobs
     assert { logfile_contains 'src/file' }
 end
+
+test "deleting a file cancels its job", :options => '-r 300', :cmd => 'echo {} >> logfile; test -f {}2' do
+    touch('mnt/file')
+    flush_jobs
+    assert { logfile.count {|line| line.strip == 'src/file' } == 1 }
+    rm('mnt/file')
+    flush_jobs
+    assert { logfile.count {|line| line.strip == 'src/file' } == 1 }
+end
+
+test "identical content is processed once", :options => '--dedup-index=dedup_index' do
+    File.open('mnt/file1', 'w') {|f| f.write('same') }
+    flush_jobs
+    File.open('mnt/file2', 'w') {|f| f.write('same') }
+    File.open('mnt/file3', 'w') {|f| f.write('different') }
+    flush_jobs
+    assert { logfile_contains 'src/file1' }
+    assert { !logfile_contains 'src/file2' }
+    assert { logfile_contains 'src/file3' }
+end
+
+test "skipped duplicates are deleted too", :options => '--dedup-index=dedup_index --delete-on-finish' do
+    File.open('mnt/file1', 'w') {|f| f.write('same') }
+    flush_jobs
+    File.open('mnt/file2', 'w') {|f| f.write('same') }
+    flush_jobs
+    assert { !logfile_contains 'src/file2' }
+    assert { !File.exists?('src/file1') }
+    assert { !File.exists?('src/file2') }
+end
+
+test "rename mode enqueues files renamed into place", :options => '--enqueue-on=rename --ignore=*.tmp' do
+    File.open('mnt/file.tmp', 'w') {|f| f.write('data') }
+    File.rename('mnt/file.tmp', 'mnt/file')
+    File.open('mnt/other.tmp', 'w') {|f| f.write('data') }
+    flush_jobs
+    assert { logfile_contains 'src/file' }
+    assert { !logfile_contains 'src/file.tmp' }
+    assert { !logfile_contains 'src/other.tmp' }
+end
+
+test "streamed jobs get the data on stdin", :options => '--stream', :cmd => 'cat >> logfile' do
+    File.open('mnt/file', 'w') do |f|
+        f.write("first\n")
+        f.flush
+        f.write("second\n")
+    end
+    flush_jobs
+    assert { logfile_contains 'first' }
+    assert { logfile_contains 'second' }
+end
+
+test "the stats file has operation latencies", :options => '--stats-file=.stats' do
+    File.open('mnt/file', 'w') {|f| f.write('data') }
+    flush_jobs
+    stats = File.read('mnt/.stats')
+    assert { stats =~ /^write +1 / }
+    assert { stats =~ /^release +1 / }
+    assert { stats.include?('backlog: ') }
+    assert { !File.exist?('src/.stats') }
+end
+
+test "the stats file can't be changed", :options => '--stats-file=.stats' do
+    File.open('mnt/file', 'w') {|f| f.write('data') }
+    assert_exception(EACCES) { File.unlink('mnt/.stats') }
+    assert_exception(EACCES) { File.rename('mnt/file', 'mnt/.stats') }
+    assert_exception(EACCES) { File.truncate('mnt/.stats', 0) }
+    assert_exception(EACCES) { File.chmod(0666, 'mnt/.stats') }
+    assert_exception(EEXIST) { Dir.mkdir('mnt/.stats') }
+    assert { File.exist?('mnt/file') }
+    assert { !File.exist?('src/.stats') }
+end
+
+test "claims of succeeded jobs are released", :options => '--claim-dir=claims' do
+    File.open('mnt/file', 'w') {|f| f.write('data') }
+    flush_jobs
+    assert { logfile_contains 'src/file' }
+    assert { Dir.glob('claims/*.claim').empty? }
+    assert { Dir.glob('claims/*.alive').size == 1 }
+end